@@ -204,6 +204,7 @@ EOF
   ES_ASK_YNS(Do you want to enable Floating-point debugging options, no, fp="yes", fp="no", fp="")
     ES_ASK_DEBUG(Floating Point conversions, FP_CONVERSION, $fp)
     ES_ASK_DEBUG(Floating Point load/store, FP_LOADSTORE, $fp)
+    ES_ASK_DEBUG(Floating Point host FPU, FP_HOST, $fp)
 
   ES_ASK_YNS(Do you want to enable network interface debugging options, no, nic="yes", nic="no", nic="")
     ES_ASK_DEBUG(General NIC, NIC, $nic)
@@ -1564,6 +1564,72 @@ EOF
   fi
 
 
+    # arg 1: human-readable name of debugging
+# arg 2: name of debug-macro (excluding DEBUG_)
+# arg 3: pre-determined answer
+  # ask a yes/no question, and define/undefine a macro accordingly
+# arg 1: question to follow "Do you want to "
+# arg 2: name of macro
+# arg 3: default value
+# arg 4: pre-determined answer
+# arg 5: explanation
+# arg 6: reverse (yes, no)
+  # ask a question with a response of yes or no
+# arg 1: question
+# arg 2: default value
+# arg 3: action on yes
+# arg 4: action on no
+# arg 5: pre-determined answer (if not "", the answer will be assumed to be this)
+# arg 6: explanation
+  if test "X$fp" = "X"; then
+    if test "$all_default" = "yes"; then
+      answer="no"
+    else
+      while true; do
+        echo -n "Do you want to enable Floating Point host FPU debugging? (yes, no) [no]: "
+        read answer
+        if test "X$answer" = "X"; then
+          answer="no"
+        fi
+        if test "$answer" = "y" -o "$answer" = "ye" -o "$answer" = "yes"; then
+          answer="yes"
+          break
+        elif test "$answer" = "n" -o "$answer" = "no"; then
+          answer="no"
+          break
+        fi
+        echo "Invalid value: please answer yes or no"
+      done
+    fi
+  else
+    answer="$fp"
+  fi
+  if test "$answer" = "yes"; then
+    debug="yes"
+  elif test "$answer" = "no"; then
+    debug="no"
+  fi
+
+  if test "" = "yes"; then
+    check_for="no"
+  else
+    check_for="yes"
+  fi
+  if test "$debug" = $check_for; then
+    cat >>src/config_debug.h <<EOF
+
+// Define to 1 if you want to enable Floating Point host FPU debugging
+#define DEBUG_FP_HOST 1
+EOF
+  else
+    cat >>src/config_debug.h <<EOF
+
+// Define to 1 if you want to enable Floating Point host FPU debugging
+#undef DEBUG_FP_HOST
+EOF
+  fi
+
+
 
   # ask a higher-level question, with a response of yes, no, or some
 # arg 1: question
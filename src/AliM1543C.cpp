@@ -420,9 +420,8 @@ void CAliM1543C::start_threads()
   if(!myThread)
   {
     myThread = new CThread("ali");
-    printf(" %s", myThread->getName().c_str());
     StopThread = false;
-    myThread->start(*this);
+    start_thread(myThread, *this);
   }
 }
 
@@ -365,9 +365,8 @@ void CAliM1543C_ide::start_threads()
     {
       sprintf(buffer, "ide%d", i);
       thrController[i] = new CThread(buffer);
-      printf(" %s", thrController[i]->getName().c_str());
       StopThread = false;
-      thrController[i]->start(*this);
+      start_thread(thrController[i], *this);
     }
   }
 }
@@ -354,6 +354,7 @@
 #if !defined(HAVE_NEW_FP)
 #include "es40_float.h"
 #endif
+
 void CAlphaCPU::release_threads()
 {
   mySemaphore.set();
@@ -375,8 +376,16 @@ void CAlphaCPU::run()
     {
       if(StopThread)
         return;
+#if defined(IDB)
+      if(bTrace || bDisassemble || bListing)
+      {
+        for(int i = 0; i < 1000000; i++)
+          execute_mode<EXEC_DEBUG>();
+        continue;
+      }
+#endif
       for(int i = 0; i < 1000000; i++)
-        execute();
+        execute_mode<EXEC_FAST>();
     }
   }
   catch(CException & e)
@@ -387,11 +396,75 @@ void CAlphaCPU::run()
   }
 }
 
+/**
+ * Register numbers for the normal and PALshadow register banks. In the
+ * PALshadow bank, registers 4..7 and 20..23 are replaced by 36..39 and
+ * 52..55.
+ **/
+const u8 CAlphaCPU::reg_banks[2][32] =
+{
+  { 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+   16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31 },
+  { 0,  1,  2,  3, 36, 37, 38, 39,  8,  9, 10, 11, 12, 13, 14, 15,
+   16, 17, 18, 19, 52, 53, 54, 55, 24, 25, 26, 27, 28, 29, 30, 31 }
+};
+
 /**
  * Constructor.
  **/
 CAlphaCPU::CAlphaCPU(CConfigurator* cfg, CSystem* system) : CSystemComponent(cfg, system), mySemaphore(0, 1)
-{ }
+{
+  icache = 0;
+  tb[0] = tb[1] = 0;
+  vmspal_saved[0] = vmspal_saved[1] = 0;
+  vmspal_saved_tb = 0;
+#if defined(CPU_JIT)
+  jit_enabled = false;
+  jit_blocks = 0;
+  jit_code = 0;
+#endif
+}
+
+/**
+ * Allocate memory that starts on a host cache line boundary. The address
+ * returned by malloc is kept just before the aligned block.
+ **/
+static void* cpu_alloc_aligned(size_t size)
+{
+  char*   p;
+  char*   a;
+
+  CHECK_ALLOCATION(p = (char*) malloc(size + sizeof(void*) + CPU_CACHE_LINE - 1));
+  a = (char*) (((size_t) p + sizeof(void*) + CPU_CACHE_LINE - 1) & ~(size_t) (CPU_CACHE_LINE - 1));
+  ((void**) a)[-1] = p;
+  return a;
+}
+
+/**
+ * Free memory allocated by cpu_alloc_aligned.
+ **/
+static void cpu_free_aligned(void* a)
+{
+  if(a)
+    free(((void**) a)[-1]);
+}
+
+/**
+ * Allocate a CPU on a cache line boundary, so that it doesn't share cache
+ * lines with another CPU running in a different thread.
+ **/
+void* CAlphaCPU::operator new(size_t size)
+{
+  return cpu_alloc_aligned(size);
+}
+
+/**
+ * Free a CPU allocated by CAlphaCPU::operator new.
+ **/
+void CAlphaCPU::operator delete(void* p)
+{
+  cpu_free_aligned(p);
+}
 
 /**
  * Initialize the CPU.
@@ -399,6 +472,13 @@ CAlphaCPU::CAlphaCPU(CConfigurator* cfg, CSystem* system) : CSystemComponent(cfg
 void CAlphaCPU::init()
 {
   memset(&state, 0, sizeof(state));
+  set_reg_bank();
+
+  icache = (SICache*) cpu_alloc_aligned(ICACHE_ENTRIES * sizeof(SICache));
+  tb[0] = (STBEntry*) cpu_alloc_aligned(2 * TB_ENTRIES * sizeof(STBEntry));
+  tb[1] = tb[0] + TB_ENTRIES;
+  memset(icache, 0, ICACHE_ENTRIES * sizeof(SICache));
+  memset(tb[0], 0, 2 * TB_ENTRIES * sizeof(STBEntry));
 
   cpu_hz = myCfg->get_num_value("speed", true, 500000000);
 
@@ -407,7 +487,74 @@ void CAlphaCPU::init()
   state.wait_for_start = (state.iProcNum == 0) ? false : true;
   icache_enabled = true;
   flush_icache();
-  icache_enabled = myCfg->get_bool_value("icache", false);
+  icache_enabled = myCfg->get_bool_value("icache", true);
+  block_enabled = myCfg->get_bool_value("block_exec", true);
+#if defined(CPU_JIT)
+  jit_init();
+#endif
+
+  const char*   idle = myCfg->get_text_value("idle", "none");
+  if(!strcasecmp(idle, "none"))
+    idle_mode = 0;
+  else if(!strcasecmp(idle, "srm"))
+    idle_mode = IDLE_LOOP | IDLE_SRM;
+  else if(!strcasecmp(idle, "vms"))
+    idle_mode = IDLE_LOOP;
+  else if(!strcasecmp(idle, "tru64") || !strcasecmp(idle, "linux"))
+    idle_mode = IDLE_WTINT;
+  else
+    FAILURE(Configuration, "idle must be none, srm, vms, tru64 or linux");
+
+  const char*   vmspal_int = myCfg->get_text_value("vmspal_int", "pal");
+  if(!strcasecmp(vmspal_int, "pal"))
+    vmspal_int_mode = VMSPAL_INT_PAL;
+  else if(!strcasecmp(vmspal_int, "native"))
+    vmspal_int_mode = VMSPAL_INT_NATIVE;
+  else if(!strcasecmp(vmspal_int, "validate"))
+    vmspal_int_mode = VMSPAL_INT_VALIDATE;
+  else
+    FAILURE(Configuration, "vmspal_int must be pal, native or validate");
+
+  const char*   osfpal_call = myCfg->get_text_value("osfpal_call", "pal");
+  if(!strcasecmp(osfpal_call, "pal"))
+    osfpal_call_mode = OSFPAL_CALL_PAL;
+  else if(!strcasecmp(osfpal_call, "native"))
+    osfpal_call_mode = OSFPAL_CALL_NATIVE;
+  else if(!strcasecmp(osfpal_call, "validate"))
+    osfpal_call_mode = OSFPAL_CALL_VALIDATE;
+  else
+    FAILURE(Configuration, "osfpal_call must be pal, native or validate");
+  vmspal_journal_size = -1;
+  if(vmspal_int_mode == VMSPAL_INT_VALIDATE || osfpal_call_mode == OSFPAL_CALL_VALIDATE)
+  {
+    vmspal_saved[0] = (SCPU_state*) cpu_alloc_aligned(2 * sizeof(SCPU_state));
+    vmspal_saved[1] = vmspal_saved[0] + 1;
+    vmspal_saved_tb = (STBEntry*) cpu_alloc_aligned(2 * TB_ENTRIES * sizeof(STBEntry));
+  }
+  idle_loop_pc = 0;
+  idle_spins = 0;
+  icache_coherent = true;
+#if defined(MIPS_ESTIMATE)
+  icache_hit_last = 0;
+  icache_hit_set = 0;
+  icache_miss = 0;
+  tb_hit_last = 0;
+  tb_hit_set = 0;
+  tb_miss = 0;
+  page_cross = 0;
+  btc_hit = 0;
+  btc_miss = 0;
+  ras_hit = 0;
+  ras_miss = 0;
+#endif
+  memset(btc, 0, sizeof(btc));
+  memset(ras, 0, sizeof(ras));
+  ras_top = 0;
+
+  int tb_entries = (int) myCfg->get_num_value("tb_entries", false, 128);
+  if(tb_entries < 16 || tb_entries > TB_ENTRIES || (tb_entries & (tb_entries - 1)))
+    FAILURE(Configuration, "tb_entries must be a power of 2 from 16 to 1024");
+  state.tb_sets = tb_entries / TB_WAYS;
 
   tbia(ACCESS_READ);
   tbia(ACCESS_EXEC);
@@ -439,6 +586,8 @@ void CAlphaCPU::init()
 #endif
   ins_per_timer_int = cpu_hz / 1024;
   next_timer_int = state.iProcNum ? U64(0xFFFFFFFFFFFFFFFF) : ins_per_timer_int;  /* only on CPU 0 */
+  ins_to_event = 0;
+  irq_h_mailbox = 0;
 
   state.r[22] = state.r[22 + 32] = state.iProcNum;
 
@@ -454,9 +603,8 @@ void CAlphaCPU::start_threads()
   {
     sprintf(buffer, "cpu%d", state.iProcNum);
     myThread = new CThread(buffer);
-    printf(" %s", myThread->getName().c_str());
     StopThread = false;
-    myThread->start(*this);
+    start_thread(myThread, *this);
   }
 }
 
@@ -481,6 +629,13 @@ void CAlphaCPU::stop_threads()
 CAlphaCPU::~CAlphaCPU()
 {
   stop_threads();
+  cpu_free_aligned(vmspal_saved[0]);
+  cpu_free_aligned(vmspal_saved_tb);
+  cpu_free_aligned(icache);
+  cpu_free_aligned(tb[0]);
+#if defined(CPU_JIT)
+  jit_exit();
+#endif
 }
 
 #if defined(IDB)
@@ -562,6 +717,7 @@ void CAlphaCPU::check_state()
     //    printf("ce %12" LL "d | aim %12" LL "d | diff %12" LL "d | new  %12" LL "d  \n",ce,ce_aim,ce_diff,ce_new);
     //    printf("==========================================================================  \n");
     cc_per_instruction = ce_new;
+    reschedule_events();  // timer interrupt distance has changed
 //    printf("cpu %d speed factor: %d\n",get_cpuid(),ce_new);
   }
 
@@ -573,23 +729,107 @@ void CAlphaCPU::check_state()
   return;
 }
 
+/**
+ * Called when a short backward branch is taken. If the same loop keeps
+ * being executed without any of the integer registers changing, it is
+ * waiting for something: a typical idle loop, or a console polling loop.
+ **/
+void CAlphaCPU::idle_loop(u64 target)
+{
+  int i;
+  bool  same = (target == idle_loop_pc);
+
+  // Only the registers of the active bank; the PALshadow registers replace
+  // some of them in PALmode.
+  for(i = 0; same && i < 32; i++)
+    same = (idle_regs[i] == state.r[reg_map[i]]);
+  if(!same)
+  {
+    idle_loop_pc = target;
+    idle_spins = 0;
+    for(i = 0; i < 32; i++)
+      idle_regs[i] = state.r[reg_map[i]];
+    return;
+  }
+
+  if(++idle_spins < CPU_IDLE_SPINS)
+    return;
+  idle_spins = 0;
+
+  // The OpenVMS idle loop runs in kernel mode below IPL 3, where the
+  // rescheduling interrupt gets in. Spinlock waits run at IPL 8 or higher;
+  // a CPU sleeping there would only notice the release of the lock at the
+  // next interrupt. Loops in PALmode or at any IPL are only considered when
+  // console idle detection is enabled.
+  if(!(idle_mode & IDLE_SRM)
+   && ((state.pc & 1) || state.cm != 0 || !state.pal_vms
+    || ((state.r[32 + 22] >> 8) & 0x1f) >= 3))
+    return;
+
+  idle_wait();
+}
+
+/**
+ * Put the CPU thread to sleep until an interrupt is raised, or for at most
+ * CPU_IDLE_SLEEP milliseconds, so the next timer interrupt is not missed.
+ * The cycle counters are advanced by the time spent sleeping.
+ **/
+void CAlphaCPU::idle_wait()
+{
+  if(state.check_int || atomic_load_32(&irq_h_mailbox))
+    return;
+
+  CTimestamp  start;
+  idle_event.tryWait(CPU_IDLE_SLEEP);
+
+  u64 cycles = (u64) start.elapsed() * cpu_hz / 1000000;
+  cc_large += cycles;
+  if(state.cc_ena)
+    state.cc += cycles;
+  ins_to_event = 0;
+}
+
 /**
  * \brief Called each clock-cycle.
  *
+ * Executes one instruction, using the EXEC_DEBUG version of execute_mode if
+ * tracing, disassembly or listing is active in the interactive debugger, and
+ * the EXEC_FAST version otherwise.
+ **/
+void CAlphaCPU::execute()
+{
+#if defined(IDB)
+  if(bTrace || bDisassemble || bListing)
+  {
+    execute_mode<EXEC_DEBUG>();
+    return;
+  }
+#endif
+  execute_mode<EXEC_FAST>();
+}
+
+/**
+ * \brief Execute one instruction.
+ *
  * This is where the actual CPU emulation takes place. Each clocktick, one instruction
  * is processed by the processor. The instruction pipeline is not emulated, things are
  * complicated enough as it is. The one exception is the instruction cache, which is
  * implemented, to accomodate self-modifying code. The instruction cache can be disabled
  * if self-modifying code is not expected.
+ *
+ * \param mode   EXEC_FAST or EXEC_DEBUG. In the EXEC_FAST version, the debugger flags
+ *               are constants, so all of the tracing and disassembly code drops out.
  **/
-void CAlphaCPU::execute()
+template <int mode> void CAlphaCPU::execute_mode()
 {
   u32 ins;
-  int i;
   u64 phys_address;
   u64 temp_64;
-  u64 temp_64_1;
   u64 temp_64_2;
+#if !defined(__SSE2__)
+  int i;          // used by the MVI instructions without SSE2 (cpu_mvi.h)
+  u64 temp_64_1;
+#endif
   UFP ufp1;
   UFP ufp2;
 
@@ -597,6 +837,14 @@ void CAlphaCPU::execute()
 
   int opcode;
   int function;
+#if defined(CPU_PREDECODE)
+  SDecoded*   d = 0;
+  int         line = 0;
+  int         burst = 0;
+#define OPC_LABEL(mnemonic)  &&PD_##mnemonic,
+  static void*  pd_handlers[OPC_COUNT] = { 0, 0, CPU_OPS(OPC_LABEL) };
+#undef OPC_LABEL
+#endif
 
 #if defined(MIPS_ESTIMATE)
 
@@ -616,14 +864,36 @@ void CAlphaCPU::execute()
         min_mips = mips;
       printf("ES40 MIPS (%3.1f sec):: current: %5.3f, min: %5.3f, max: %5.3f\n",
              secs, mips, min_mips, max_mips);
+      printf("%s: icache: %" LL "u last-entry hits, %" LL "u set hits, %" LL "u misses\n",
+             devid_string, icache_hit_last, icache_hit_set, icache_miss);
+      printf("%s: tb: %" LL "u last-entry hits, %" LL "u set hits, %" LL "u misses\n",
+             devid_string, tb_hit_last, tb_hit_set, tb_miss);
+      printf("%s: %" LL "u page-crossing accesses\n", devid_string, page_cross);
+      printf("%s: jumps: %" LL "u btc hits, %" LL "u btc misses, %" LL "u ras hits, %" LL "u ras misses\n",
+             devid_string, btc_hit, btc_miss, ras_hit, ras_miss);
     }
 
+    icache_hit_last = 0;
+    icache_hit_set = 0;
+    icache_miss = 0;
+    tb_hit_last = 0;
+    tb_hit_set = 0;
+    tb_miss = 0;
+    page_cross = 0;
+    btc_hit = 0;
+    btc_miss = 0;
+    ras_hit = 0;
+    ras_miss = 0;
+
     saved = current;
     count = 0;
   }
 #endif
 #if defined(IDB)
-  char*   funcname = 0;
+  const bool  bTrace = (mode == EXEC_DEBUG) && ::bTrace;
+  const bool  bDisassemble = (mode == EXEC_DEBUG) && ::bDisassemble;
+  const bool  bListing = (mode == EXEC_DEBUG) && ::bListing;
+  char*       funcname = 0;
   dbg_string[0] = '\0';
 #if !defined(LS_MASTER) && !defined(LS_SLAVE)
   dbg_strptr = dbg_string;
@@ -642,98 +912,100 @@ void CAlphaCPU::execute()
     state.instruction_count++;
     cc_large += cc_per_instruction;
 
-    if(cc_large > next_timer_int)
-    {
-      next_timer_int += ins_per_timer_int;
-      cSystem->interrupt(-1, true);
-    }
-
     if(state.cc_ena)
     {
       state.cc += cc_per_instruction;
     }
 
-    if(state.check_timers)
+    // Timers and interrupts only need to be looked at when schedule_events
+    // says so, or when something that affects them has changed. Requests
+    // from other threads only show up in irq_h_mailbox.
+    if(--ins_to_event <= 0 || atomic_load_32(&irq_h_mailbox))
     {
-
-      // There are one or more active delayed irq_h interrupts. Go through the 6
-      // irq_h timers, decrease them as needed, and set the interrupt if the timer
-      // reaches 0.
-      state.check_timers = false;
-      for(int i = 0; i < 6; i++)
+      if(cc_large > next_timer_int)
       {
-        if(state.irq_h_timer[i])
-        {
+        next_timer_int += ins_per_timer_int;
+        cSystem->interrupt(-1, true);
+      }
 
-          // This timer is active. Decrease it, and check if it reached 0.
-          state.irq_h_timer[i]--;
-          if(state.irq_h_timer[i])
-          {
+      if(atomic_load_32(&irq_h_mailbox))
+        irq_h_drain();
 
-            // The timer hasn't reached 0 yet; check on the timers again next clock tick.
-            state.check_timers = true;
-          }
-          else
-          {
+      if(state.check_timers)
+      {
 
-            // The timer has reached 0. Set the interrupt status, and set the flag that we
-            // need to check the interrupt status
-            state.eir |= (U64(0x1) << i);
-            state.check_int = true;
+        // There are one or more active delayed irq_h interrupts. Go through the 6
+        // irq_h timers, and set the interrupt for those that have become due.
+        state.check_timers = false;
+        for(int i = 0; i < 6; i++)
+        {
+          if(state.irq_h_due[i])
+          {
+            if(state.irq_h_due[i] > state.instruction_count)
+            {
+
+              // The timer hasn't expired yet; keep checking on the timers.
+              state.check_timers = true;
+            }
+            else
+            {
+
+              // The timer has expired. Set the interrupt status, and set the flag that we
+              // need to check the interrupt status
+              state.irq_h_due[i] = 0;
+              state.eir |= (U64(0x1) << i);
+              request_int_check();
+            }
           }
         }
       }
-    }
-
-    if(state.check_int && !(state.pc & 1))
-    {
 
-      // One or more of the variables that affect interrupt status have changed, and we are not
-      // currently inside PALmode. It is not certain that this means we hava an interrupt to
-      // service, but we might have. This needs to be checked.
-
-      /*      
-      if (state.pal_vms) {
-        // PALcode base is set to 0x8000; meaning OpenVMS PALcode is currently active. In this
-        // case, our VMS PALcode replacement routines are valid, and should be used as it is
-        // faster than using the original PALcode.
-        
-        if (state.eir & state.eien & 6)
-          if (vmspal_ent_ext_int(state.eir&state.eien & 6))
-            return;
+      if(state.check_int && !(state.pc & 1))
+      {
 
-        if (state.sir & state.sien & 0xfffc)
-          if (vmspal_ent_sw_int(state.sir&state.sien))
-            return;
+        // One or more of the variables that affect interrupt status have changed, and we are not
+        // currently inside PALmode. It is not certain that this means we hava an interrupt to
+        // service, but we might have. This needs to be checked.
 
-        if (state.asten && (state.aster & state.astrr & ((1<<(state.cm+1))-1) ))
-          if (vmspal_ent_ast_int(state.aster & state.astrr & ((1<<(state.cm+1))-1) ))
-            return;
+        if(state.pal_vms && vmspal_int_mode != VMSPAL_INT_PAL)
+        {
 
-        if (state.sir & state.sien)
-          if (vmspal_ent_sw_int(state.sir&state.sien))
+          // PALcode base is set to 0x8000; meaning OpenVMS PALcode is currently active. In this
+          // case, our VMS PALcode replacement routines are valid, and can be used as it is
+          // faster than using the original PALcode. Interrupts they can't handle are left
+          // pending, and go to the PALcode below.
+          if(vmspal_int_mode == VMSPAL_INT_VALIDATE)
+          {
+            if(vmspal_check_int() < 0)
+              return;
+          }
+          else if(vmspal_ent_int() < 0)
             return;
-      } else 
-*/
-      {
+        }
 
-        // PALcode base is set to an unsupported value. We have no choice but to transfer control
-        // to PALmode at the PALcode interrupt entry point.
-        //        if (state.eir & 8)
-        //        {
-        //          printf("%s: IP interrupt received%s...\n",devid_string, (state.eien&8)?"(enabled)":"(masked)");
-        //        }
-        if((state.eien & state.eir) || (state.sien & state.sir) || (state.asten
-         && (state.aster & state.astrr & ((1 << (state.cm + 1)) - 1))))
         {
-          GO_PAL(INTERRUPT);
-          return;
+
+          // PALcode base is set to an unsupported value, or the interrupt couldn't be handled
+          // by the replacement routines. We have no choice but to transfer control to PALmode
+          // at the PALcode interrupt entry point.
+          //        if (state.eir & 8)
+          //        {
+          //          printf("%s: IP interrupt received%s...\n",devid_string, (state.eien&8)?"(enabled)":"(masked)");
+          //        }
+          if((state.eien & state.eir) || (state.sien & state.sir) || (state.asten
+           && (state.aster & state.astrr & ((1 << (state.cm + 1)) - 1))))
+          {
+            GO_PAL(INTERRUPT);
+            return;
+          }
         }
+
+        // This point is reached only if there are no more active interrupts. We can safely set
+        // check_int to false now to save time on the next CPU clock ticks.
+        state.check_int = false;
       }
 
-      // This point is reached only if there are no more active interrupts. We can safely set
-      // check_int to false now to save time on the next CPU clock ticks.
-      state.check_int = false;
+      schedule_events();
     }
 
     // If profiling is enabled, increase the profiling counter for the current block of addresses.
@@ -744,6 +1016,35 @@ void CAlphaCPU::execute()
     // Get the next instruction from the instruction cache.
     if(get_icache(state.pc, &ins))
       return;
+
+#if defined(CPU_PREDECODE)
+    if(icache_enabled)
+    {
+
+      // get_icache leaves the cache line used in last_found_icache. Decode the
+      // instruction if this hasn't been done yet since the line was filled.
+      line = state.last_found_icache;
+      if(!decoded_valid[line])
+      {
+        memset(decoded[line], 0, sizeof(decoded[line]));
+        decoded_valid[line] = true;
+#if defined(CPU_JIT)
+        decoded_gen[line]++;
+#endif
+      }
+
+      d = &decoded[line][(state.pc >> 2) & ICACHE_INDEX_MASK];
+      if(d->op == OPC_UNDECODED)
+        decode(ins, d);
+#if defined(CPU_JIT)
+
+      // Every instruction fetched here may start a block; this one has
+      // been counted already.
+      if(jit_enabled && !(state.pc & 1) && jit_run(line, true))
+        goto pd_next;
+#endif
+    }
+#endif
 #if defined(IDB)
     current_pc_physical = state.pc_phys;
 #endif
@@ -774,551 +1075,102 @@ void CAlphaCPU::execute()
   last_instruction = ins;
 #endif
   opcode = ins >> 26;
-  switch(opcode)
+#if defined(CPU_PREDECODE)
+  if(d && d->op != OPC_UNKNOWN)
   {
-  case 0x00:  // CALL_PAL
-    function = ins & 0x1fffffff;
-    OP(CALL_PAL, PAL);
-
-  //    switch (function)
-  //    {
-  //      case 0x123401: OP_FNC(vmspal_int_read_ide, NOP);
-  //      default: OP(CALL_PAL,PAL);
-  //    }
-  case 0x08:
-    OP(LDA, MEM);
-
-  case 0x09:
-    OP(LDAH, MEM);
-
-  case 0x0a:
-    OP(LDBU, MEM);
-
-  case 0x0b:
-    OP(LDQ_U, MEM);
-
-  case 0x0c:
-    OP(LDWU, MEM);
-
-  case 0x0d:
-    OP(STW, MEM);
-
-  case 0x0e:
-    OP(STB, MEM);
-
-  case 0x0f:
-    OP(STQ_U, MEM);
-
-  case 0x10:  // INTA* instructions
-    function = (ins >> 5) & 0x7f;
-    switch(function)
-    {
-    case 0x40:  OP(ADDL_V, R12_R3);
-    case 0x00:  OP(ADDL, R12_R3);
-    case 0x02:  OP(S4ADDL, R12_R3);
-    case 0x49:  OP(SUBL_V, R12_R3);
-    case 0x09:  OP(SUBL, R12_R3);
-    case 0x0b:  OP(S4SUBL, R12_R3);
-    case 0x0f:  OP(CMPBGE, R12_R3);
-    case 0x12:  OP(S8ADDL, R12_R3);
-    case 0x1b:  OP(S8SUBL, R12_R3);
-    case 0x1d:  OP(CMPULT, R12_R3);
-    case 0x60:  OP(ADDQ_V, R12_R3);
-    case 0x20:  OP(ADDQ, R12_R3);
-    case 0x22:  OP(S4ADDQ, R12_R3);
-    case 0x69:  OP(SUBQ_V, R12_R3);
-    case 0x29:  OP(SUBQ, R12_R3);
-    case 0x2b:  OP(S4SUBQ, R12_R3);
-    case 0x2d:  OP(CMPEQ, R12_R3);
-    case 0x32:  OP(S8ADDQ, R12_R3);
-    case 0x3b:  OP(S8SUBQ, R12_R3);
-    case 0x3d:  OP(CMPULE, R12_R3);
-    case 0x4d:  OP(CMPLT, R12_R3);
-    case 0x6d:  OP(CMPLE, R12_R3);
-    default:    UNKNOWN2;
-    }
-    break;
-
-  case 0x11:  // INTL* instructions
-    function = (ins >> 5) & 0x7f;
-    switch(function)
-    {
-    case 0x00:  OP(AND, R12_R3);
-    case 0x08:  OP(BIC, R12_R3);
-    case 0x14:  OP(CMOVLBS, R12_R3);
-    case 0x16:  OP(CMOVLBC, R12_R3);
-    case 0x20:  OP(BIS, R12_R3);
-    case 0x24:  OP(CMOVEQ, R12_R3);
-    case 0x26:  OP(CMOVNE, R12_R3);
-    case 0x28:  OP(ORNOT, R12_R3);
-    case 0x40:  OP(XOR, R12_R3);
-    case 0x44:  OP(CMOVLT, R12_R3);
-    case 0x46:  OP(CMOVGE, R12_R3);
-    case 0x48:  OP(EQV, R12_R3);
-    case 0x61:  OP(AMASK, R2_R3);
-    case 0x64:  OP(CMOVLE, R12_R3);
-    case 0x66:  OP(CMOVGT, R12_R3);
-    case 0x6c:  OP(IMPLVER, X_R3);
-    default:    UNKNOWN2;
-    }
-    break;
-
-  case 0x12:  // INTS* instructions
-    function = (ins >> 5) & 0x7f;
-    switch(function)
-    {
-    case 0x02:  OP(MSKBL, R12_R3);
-    case 0x06:  OP(EXTBL, R12_R3);
-    case 0x0b:  OP(INSBL, R12_R3);
-    case 0x12:  OP(MSKWL, R12_R3);
-    case 0x16:  OP(EXTWL, R12_R3);
-    case 0x1b:  OP(INSWL, R12_R3);
-    case 0x22:  OP(MSKLL, R12_R3);
-    case 0x26:  OP(EXTLL, R12_R3);
-    case 0x2b:  OP(INSLL, R12_R3);
-    case 0x30:  OP(ZAP, R12_R3);
-    case 0x31:  OP(ZAPNOT, R12_R3);
-    case 0x32:  OP(MSKQL, R12_R3);
-    case 0x34:  OP(SRL, R12_R3);
-    case 0x36:  OP(EXTQL, R12_R3);
-    case 0x39:  OP(SLL, R12_R3);
-    case 0x3b:  OP(INSQL, R12_R3);
-    case 0x3c:  OP(SRA, R12_R3);
-    case 0x52:  OP(MSKWH, R12_R3);
-    case 0x57:  OP(INSWH, R12_R3);
-    case 0x5a:  OP(EXTWH, R12_R3);
-    case 0x62:  OP(MSKLH, R12_R3);
-    case 0x67:  OP(INSLH, R12_R3);
-    case 0x6a:  OP(EXTLH, R12_R3);
-    case 0x72:  OP(MSKQH, R12_R3);
-    case 0x77:  OP(INSQH, R12_R3);
-    case 0x7a:  OP(EXTQH, R12_R3);
-    default:    UNKNOWN2;
-    }
-    break;
-
-  case 0x13:  // INTM* instructions
-    function = (ins >> 5) & 0x7f;
-    switch(function)  // ignore /V for now
-    {
-    case 0x40:  OP(MULL_V, R12_R3);
-    case 0x00:  OP(MULL, R12_R3);
-    case 0x60:  OP(MULQ_V, R12_R3);
-    case 0x20:  OP(MULQ, R12_R3);
-    case 0x30:  OP(UMULH, R12_R3);
-    default:    UNKNOWN2;
-    }
-    break;
-
-  case 0x14:          // ITFP* instructions
-    function = (ins >> 5) & 0x7ff;
-    switch(function)
-    {
-    case 0x004:
-      OP(ITOFS, R1_F3);
-
-    case 0x00a:
-    case 0x08a:
-    case 0x10a:
-    case 0x18a:
-    case 0x40a:
-    case 0x48a:
-    case 0x50a:
-    case 0x58a:
-      OP(SQRTF, F2_F3);
-
-    case 0x00b:
-    case 0x04b:
-    case 0x08b:
-    case 0x0cb:
-    case 0x10b:
-    case 0x14b:
-    case 0x18b:
-    case 0x1cb:
-    case 0x50b:
-    case 0x54b:
-    case 0x58b:
-    case 0x5cb:
-    case 0x70b:
-    case 0x74b:
-    case 0x78b:
-    case 0x7cb:
-      OP(SQRTS, F2_F3);
-
-    case 0x014:
-      OP(ITOFF, R1_F3);
-
-    case 0x024:
-      OP(ITOFT, R1_F3);
-
-    case 0x02a:
-    case 0x0aa:
-    case 0x12a:
-    case 0x1aa:
-    case 0x42a:
-    case 0x4aa:
-    case 0x52a:
-    case 0x5aa:
-      OP(SQRTG, F2_F3);
-
-    case 0x02b:
-    case 0x06b:
-    case 0x0ab:
-    case 0x0eb:
-    case 0x12b:
-    case 0x16b:
-    case 0x1ab:
-    case 0x1eb:
-    case 0x52b:
-    case 0x56b:
-    case 0x5ab:
-    case 0x5eb:
-    case 0x72b:
-    case 0x76b:
-    case 0x7ab:
-    case 0x7eb:
-      OP(SQRTT, F2_F3);
-
-    default:
-      UNKNOWN2;
-    }
-    break;
-
-  case 0x15:          // FLTV* instructions
-    function = (ins >> 5) & 0x7ff;
-    switch(function)
-    {
-    case 0x0a5:
-    case 0x4a5:
-      OP(CMPGEQ, F12_F3);
-
-    case 0x0a6:
-    case 0x4a6:
-      OP(CMPGLT, F12_F3);
-
-    case 0x0a7:
-    case 0x4a7:
-      OP(CMPGLE, F12_F3);
-
-    case 0x03c:
-    case 0x0bc:
-      OP(CVTQF, F2_F3);
-
-    case 0x03e:
-    case 0x0be:
-      OP(CVTQG, F2_F3);
-
-    default:
-      if(function & 0x200)
-      {
-        UNKNOWN2;
-      }
-
-      switch(function & 0x7f)
-      {
-      case 0x000: OP(ADDF, F12_F3);
-      case 0x001: OP(SUBF, F12_F3);
-      case 0x002: OP(MULF, F12_F3);
-      case 0x003: OP(DIVF, F12_F3);
-      case 0x01e: OP(CVTDG, F2_F3);
-      case 0x020: OP(ADDG, F12_F3);
-      case 0x021: OP(SUBG, F12_F3);
-      case 0x022: OP(MULG, F12_F3);
-      case 0x023: OP(DIVG, F12_F3);
-      case 0x02c: OP(CVTGF, F12_F3);
-      case 0x02d: OP(CVTGD, F2_F3);
-      case 0x02f: OP(CVTGQ, F2_F3);
-      default:    UNKNOWN2;
-      }
-      break;
-    }
-    break;
-
-  case 0x16:          // FLTI* instructions
-    function = (ins >> 5) & 0x7ff;
-    switch(function)
-    {
-    case 0x0a4:
-    case 0x5a4:
-      OP(CMPTUN, F12_F3);
-
-    case 0x0a5:
-    case 0x5a5:
-      OP(CMPTEQ, F12_F3);
-
-    case 0x0a6:
-    case 0x5a6:
-      OP(CMPTLT, F12_F3);
-
-    case 0x0a7:
-    case 0x5a7:
-      OP(CMPTLE, F12_F3);
-
-    case 0x2ac:
-    case 0x6ac:
-      OP(CVTST, F2_F3);
-
-    default:
-      if(((function & 0x600) == 0x200) || ((function & 0x500) == 0x400))
-      {
-        UNKNOWN2;
-      }
-
-      switch(function & 0x3f)
-      {
-      case 0x00:  OP(ADDS, F12_F3);
-      case 0x01:  OP(SUBS, F12_F3);
-      case 0x02:  OP(MULS, F12_F3);
-      case 0x03:  OP(DIVS, F12_F3);
-      case 0x20:  OP(ADDT, F12_F3);
-      case 0x21:  OP(SUBT, F12_F3);
-      case 0x22:  OP(MULT, F12_F3);
-      case 0x23:  OP(DIVT, F12_F3);
-      case 0x2c:  OP(CVTTS, F2_F3);
-      case 0x2f:  OP(CVTTQ, F2_F3);
-      case 0x3c:  if((function & 0x300) == 0x100){ UNKNOWN2; }OP(CVTQS, F2_F3);
-      case 0x3e:  if((function & 0x300) == 0x100){ UNKNOWN2; }OP(CVTQT, F2_F3);
-      default:    UNKNOWN2;
-      }
-      break;
-    }
-    break;
-
-  case 0x17:          // FLTL* instructions
-    function = (ins >> 5) & 0x7ff;
-    switch(function)
-    {
-    case 0x010:
-      OP(CVTLQ, F2_F3);
-
-    case 0x020:
-      OP(CPYS, F12_F3);
-
-    case 0x021:
-      OP(CPYSN, F12_F3);
-
-    case 0x022:
-      OP(CPYSE, F12_F3);
-
-    case 0x024:
-      OP(MT_FPCR, X_F1);
-
-    case 0x025:
-      OP(MF_FPCR, X_F1);
-
-    case 0x02a:
-      OP(FCMOVEQ, F12_F3);
-
-    case 0x02b:
-      OP(FCMOVNE, F12_F3);
-
-    case 0x02c:
-      OP(FCMOVLT, F12_F3);
-
-    case 0x02d:
-      OP(FCMOVGE, F12_F3);
-
-    case 0x02e:
-      OP(FCMOVLE, F12_F3);
-
-    case 0x02f:
-      OP(FCMOVGT, F12_F3);
-
-    case 0x030:
-    case 0x130:
-    case 0x530:
-      OP(CVTQL, F12_F3);
-
-    default:
-      UNKNOWN2;
-    }
-    break;
-
-  case 0x18:          // MISC* instructions
-    function = (ins & 0xffff);
-    switch(function)
-    {
-    case 0x0000:  OP(TRAPB, NOP);
-    case 0x0400:  OP(EXCB, NOP);
-    case 0x4000:  OP(MB, NOP);
-    case 0x4400:  OP(WMB, NOP);
-    case 0x8000:  OP(FETCH, NOP);
-    case 0xA000:  OP(FETCH_M, NOP);
-    case 0xC000:  OP(RPCC, X_R1);
-    case 0xE000:  OP(RC, X_R1);
-    case 0xE800:  OP(ECB, NOP);
-    case 0xF000:  OP(RS, X_R1);
-    case 0xF800:  OP(WH64, NOP);
-    case 0xFC00:  OP(WH64EN, NOP);
-    default:      UNKNOWN2;
-    }
-    break;
-
-  case 0x19:          // HW_MFPR
-    function = (ins >> 8) & 0xff;
-    OP(HW_MFPR, MFPR);
-
-  case 0x1a:          // JSR* instructions
-    OP(JMP, JMP);
-
-  case 0x1b:          // PAL reserved - HW_LD
-    function = (ins >> 12) & 0xf;
-    if(function & 1)
-    {
-      OP(HW_LDQ, HW_LD);
-    }
-    else
-    {
-      OP(HW_LDL, HW_LD);
-    }
-
-  case 0x1c:          // FPTI* instructions
-    function = (ins >> 5) & 0x7f;
-    switch(function)
-    {
-    case 0x00:  OP(SEXTB, R2_R3);
-    case 0x01:  OP(SEXTW, R2_R3);
-    case 0x30:  OP(CTPOP, R2_R3);
-    case 0x31:  OP(PERR, R2_R3);
-    case 0x32:  OP(CTLZ, R2_R3);
-    case 0x33:  OP(CTTZ, R2_R3);
-    case 0x34:  OP(UNPKBW, R2_R3);
-    case 0x35:  OP(UNPKBL, R2_R3);
-    case 0x36:  OP(PKWB, R2_R3);
-    case 0x37:  OP(PKLB, R2_R3);
-    case 0x38:  OP(MINSB8, R12_R3);
-    case 0x39:  OP(MINSW4, R12_R3);
-    case 0x3a:  OP(MINUB8, R12_R3);
-    case 0x3b:  OP(MINUW4, R12_R3);
-    case 0x3c:  OP(MAXUB8, R12_R3);
-    case 0x3d:  OP(MAXUW4, R12_R3);
-    case 0x3e:  OP(MAXSB8, R12_R3);
-    case 0x3f:  OP(MAXSW4, R12_R3);
-    case 0x70:  OP(FTOIT, F1_R3);
-    case 0x78:  OP(FTOIS, F1_R3);
-    default:    UNKNOWN2;
-    }
-    break;
+    function = d->function;
+    goto *pd_handlers[d->op];
+  }
+#endif
+#include "cpu_decode.h"
 
-  case 0x1d:          // HW_MTPR
-    function = (ins >> 8) & 0xff;
-    OP(HW_MTPR, MTPR);
+  return;
 
-  case 0x1e:
-    OP(HW_RET, RET);
+#if defined(CPU_PREDECODE)
+
+  // Handlers for predecoded instructions. These are the same DO_<mnemonic>
+  // macros as used in the decoding tree, but the register numbers come from
+  // the predecoded instruction. The do-while is needed because some handlers
+  // use "break" to abort the instruction.
+#undef REG_1
+#undef REG_2
+#undef REG_3
+#define REG_1 (d->ra)
+#define REG_2 (d->rb)
+#define REG_3 (d->rc)
+#define PD_HANDLER(mnemonic) \
+  PD_##mnemonic:             \
+  do                         \
+  {                          \
+    DO_##mnemonic;           \
+  } while(0);                \
+  goto pd_next;
+  CPU_OPS(PD_HANDLER)
+#undef PD_HANDLER
+
+  // Block execution. As long as nothing needs to be serviced by the code at
+  // the start of this function (interrupts, timers, a line change), keep
+  // executing predecoded instructions from the same icache line, without
+  // going back through the instruction fetch. A jump that predict_jump found
+  // the icache line for continues the block in that line. The number of
+  // instructions run this way is limited, so run() still gets to check for
+  // StopThread.
+pd_next:
+  if(!block_enabled || ++burst >= CPU_BLOCK_MAX || !icache_enabled || ins_to_event <= 1
+   || atomic_load_32(&irq_h_mailbox))
+    return;
+
+  if(icache[line].address != (state.pc & ICACHE_MATCH_MASK))
+    line = state.last_found_icache;
+
+  if(decoded_valid[line]
+   && icache[line].valid
+   && (icache[line].asn == state.asn || icache[line].asm_bit)
+   && icache[line].address == (state.pc & ICACHE_MATCH_MASK))
+  {
+#if defined(CPU_JIT)
 
-  case 0x1f:          // HW_ST
-    function = (ins >> 12) & 0xf;
-    if(function & 1)
-    {
-      OP(HW_STQ, HW_ST);
-    }
-    else
+    // A branch (not falling through) starts a block.
+    if(jit_enabled && state.pc != state.current_pc + 4 && !(state.pc & 1)
+     && jit_run(line, false))
+      goto pd_next;
+#endif
+    d = &decoded[line][(state.pc >> 2) & ICACHE_INDEX_MASK];
+    ins = endian_32(icache[line].data[(state.pc >> 2) & ICACHE_INDEX_MASK]);
+    if(d->op == OPC_UNDECODED)
+      decode(ins, d);
+    if(d->op != OPC_UNKNOWN)
     {
-      OP(HW_STL, HW_ST);
+#if defined(MIPS_ESTIMATE)
+      count++;
+      icache_hit_last++;
+#endif
+      state.current_pc = state.pc;
+      state.instruction_count++;
+      cc_large += cc_per_instruction;
+      if(state.cc_ena)
+        state.cc += cc_per_instruction;
+      ins_to_event--;
+#if defined(PROFILE)
+      PROFILE_DO(state.pc);
+#endif
+      next_pc();
+      state.r[31] = 0;
+      state.f[31] = 0;
+      opcode = ins >> 26;
+      function = d->function;
+      goto *pd_handlers[d->op];
     }
-
-  case 0x20:
-    OP(LDF, FMEM);
-
-  case 0x21:
-    OP(LDG, FMEM);
-
-  case 0x22:
-    OP(LDS, FMEM);
-
-  case 0x23:
-    OP(LDT, FMEM);
-
-  case 0x24:
-    OP(STF, FMEM);
-
-  case 0x25:
-    OP(STG, FMEM);
-
-  case 0x26:
-    OP(STS, FMEM);
-
-  case 0x27:
-    OP(STT, FMEM);
-
-  case 0x28:
-    OP(LDL, MEM);
-
-  case 0x29:
-    OP(LDQ, MEM);
-
-  case 0x2a:
-    OP(LDL_L, MEM);
-
-  case 0x2b:
-    OP(LDQ_L, MEM);
-
-  case 0x2c:
-    OP(STL, MEM);
-
-  case 0x2d:
-    OP(STQ, MEM);
-
-  case 0x2e:
-    OP(STL_C, MEM);
-
-  case 0x2f:
-    OP(STQ_C, MEM);
-
-  case 0x30:
-    OP(BR, BR);
-
-  case 0x31:
-    OP(FBEQ, FCOND);
-
-  case 0x32:
-    OP(FBLT, FCOND);
-
-  case 0x33:
-    OP(FBLE, FCOND);
-
-  case 0x34:
-    OP(BSR, BSR);
-
-  case 0x35:
-    OP(FBNE, FCOND);
-
-  case 0x36:
-    OP(FBGE, FCOND);
-
-  case 0x37:
-    OP(FBGT, FCOND);
-
-  case 0x38:
-    OP(BLBC, COND);
-
-  case 0x39:
-    OP(BEQ, COND);
-
-  case 0x3a:
-    OP(BLT, COND);
-
-  case 0x3b:
-    OP(BLE, COND);
-
-  case 0x3c:
-    OP(BLBS, COND);
-
-  case 0x3d:
-    OP(BNE, COND);
-
-  case 0x3e:
-    OP(BGE, COND);
-
-  case 0x3f:
-    OP(BGT, COND);
-
-  default:
-    UNKNOWN1;
   }
 
   return;
+#undef REG_1
+#undef REG_2
+#undef REG_3
+#define REG_1 RREG(I_GETRA(ins))
+#define REG_2 RREG(I_GETRB(ins))
+#define REG_3 RREG(I_GETRC(ins))
+#endif
 }
 
 #if defined(IDB)
@@ -1378,11 +1230,13 @@ static u32  cpu_magic2 = 0xC8646212;
  **/
 int CAlphaCPU::SaveState(FILE* f)
 {
-  long  ss = sizeof(state);
+  long  ss = sizeof(state) + ICACHE_ENTRIES * sizeof(SICache) + 2 * TB_ENTRIES * sizeof(STBEntry);
 
   fwrite(&cpu_magic1, sizeof(u32), 1, f);
   fwrite(&ss, sizeof(long), 1, f);
   fwrite(&state, sizeof(state), 1, f);
+  fwrite(icache, sizeof(SICache), ICACHE_ENTRIES, f);
+  fwrite(tb[0], sizeof(STBEntry), 2 * TB_ENTRIES, f);
   fwrite(&cpu_magic2, sizeof(u32), 1, f);
   printf("%s: %d bytes saved.\n", devid_string, (int) ss);
   return 0;
@@ -1418,7 +1272,7 @@ int CAlphaCPU::RestoreState(FILE* f)
     return -1;
   }
 
-  if(ss != sizeof(state))
+  if(ss != (long) (sizeof(state) + ICACHE_ENTRIES * sizeof(SICache) + 2 * TB_ENTRIES * sizeof(STBEntry)))
   {
     printf("%s: STRUCT SIZE does not match!\n", devid_string);
     return -1;
@@ -1431,6 +1285,15 @@ int CAlphaCPU::RestoreState(FILE* f)
     return -1;
   }
 
+  r = fread(icache, sizeof(SICache), ICACHE_ENTRIES, f);
+  if(r == ICACHE_ENTRIES)
+    r = fread(tb[0], sizeof(STBEntry), 2 * TB_ENTRIES, f);
+  if(r != 2 * TB_ENTRIES)
+  {
+    printf("%s: unexpected end of file!\n", devid_string);
+    return -1;
+  }
+
   r = fread(&m2, sizeof(u32), 1, f);
   if(r != 1)
   {
@@ -1444,6 +1307,17 @@ int CAlphaCPU::RestoreState(FILE* f)
     return -1;
   }
 
+  set_reg_bank();
+  flush_decode();
+  flush_stlb();
+  reschedule_events();
+
+  // Writes to the memory the restored icache lines came from should still
+  // invalidate them.
+  for(int i = 0; i < ICACHE_ENTRIES; i++)
+    if(icache[i].valid)
+      cSystem->mark_code_page(icache[i].p_address);
+
   printf("%s: %d bytes restored.\n", devid_string, (int) ss);
   return 0;
 }
@@ -1476,24 +1350,49 @@ int CAlphaCPU::FindTBEntry(u64 virt, int flags)
 
   int rw = (flags & ACCESS_WRITE) ? 1 : 0;
 
+  int gh;
+  int set;
+
   // Try last match first; this is a good quess, especially in the ITB
   int i = state.last_found_tb[t][rw];
-  if(state.tb[t][i].valid
-   && !((state.tb[t][i].virt ^ virt) & state.tb[t][i].match_mask)
-   && (state.tb[t][i].asm_bit || (state.tb[t][i].asn == asn))) return i;
+  if(tb[t][i].valid
+   && !((tb[t][i].virt ^ virt) & tb[t][i].match_mask)
+   && (tb[t][i].asm_bit || (tb[t][i].asn == asn)))
+  {
+#if defined(MIPS_ESTIMATE)
+    tb_hit_last++;
+#endif
+    return i;
+  }
 
-  // Otherwise, loop through the TB entries to find a match.
-  for(i = 0; i < TB_ENTRIES; i++)
+  // Otherwise, look through the set the address belongs to for each of the
+  // granularity hints that are in use.
+  for(gh = 0; gh < 4; gh++)
   {
-    if(state.tb[t][i].valid
-     && !((state.tb[t][i].virt ^ virt) & state.tb[t][i].match_mask)
-     && (state.tb[t][i].asm_bit || (state.tb[t][i].asn == asn)))
+    if(!(state.tb_gh_used[t] & (1 << gh)))
+      continue;
+
+    set = tb_set(virt, gh);
+    for(i = set; i < set + TB_WAYS; i++)
     {
-      state.last_found_tb[t][rw] = i;
-      return i;
+      if(tb[t][i].valid
+       && tb[t][i].gh == gh
+       && !((tb[t][i].virt ^ virt) & tb[t][i].match_mask)
+       && (tb[t][i].asm_bit || (tb[t][i].asn == asn)))
+      {
+#if defined(MIPS_ESTIMATE)
+        tb_hit_set++;
+#endif
+        state.last_found_tb[t][rw] = i;
+        tb[t][i].used = ++state.tb_clock[t];
+        return i;
+      }
     }
   }
 
+#if defined(MIPS_ESTIMATE)
+  tb_miss++;
+#endif
   return -1;
 }
 
@@ -1742,7 +1641,7 @@ int CAlphaCPU::virt2phys(u64 virt, u64* phys, int flags, bool* asm_bit, u32 ins)
   {
 
     // check if requested access is allowed
-    if(!state.tb[t][i].access[flags & ACCESS_WRITE][cm])
+    if(!tb[t][i].access[flags & ACCESS_WRITE][cm])
     {
 #if defined(DEBUG_TB)
       if(forreal)
@@ -1799,7 +1698,7 @@ int CAlphaCPU::virt2phys(u64 virt, u64* phys, int flags, bool* asm_bit, u32 ins)
     }
 
     // check if requested access doesn't fault
-    if(state.tb[t][i].fault[flags & ACCESS_MODE])
+    if(tb[t][i].fault[flags & ACCESS_MODE])
     {
 #if defined(DEBUG_TB)
       if(forreal)
@@ -1858,9 +1757,9 @@ int CAlphaCPU::virt2phys(u64 virt, u64* phys, int flags, bool* asm_bit, u32 ins)
 
   // No access violations or faults
   // Return the converted address
-  *phys = state.tb[t][i].phys | (virt & state.tb[t][i].keep_mask);
+  *phys = tb[t][i].phys | (virt & tb[t][i].keep_mask);
   if(asm_bit)
-    *asm_bit = state.tb[t][i].asm_bit ? true : false;
+    *asm_bit = tb[t][i].asm_bit ? true : false;
 
 #if defined(DEBUG_TB)
   if(forreal)
@@ -1902,7 +1801,9 @@ void CAlphaCPU::add_tb(u64 virt, u64 pte_phys, u64 pte_flags, int flags)
   u64 match_mask = 0;
   u64 keep_mask = 0;
   u64 phys_mask = 0;
+  int gh = (int) (pte_flags >> 5) & 3;
   int i;
+  int set;
   int asn = (flags & ACCESS_EXEC) ? state.asn : state.asn0;
 
   switch(pte_flags & 0x60)  // granularity hint
@@ -1932,34 +1833,52 @@ void CAlphaCPU::add_tb(u64 virt, u64 pte_phys, u64 pte_flags, int flags)
     break;
   }
 
+  // An existing entry for this address is replaced. It may have been in
+  // another set, if it had a different granularity hint.
   i = FindTBEntry(virt, flags);
+  if(i >= 0)
+  {
+    tb[t][i].valid = false;
+    if(!t)
+      flush_stlb(tb[t][i].virt, tb[t][i].match_mask);
+  }
 
-  if(i < 0)
+  // Use an invalid entry in the set if there is one, or else the least
+  // recently used one.
+  set = tb_set(virt, gh);
+  i = set;
+  for(int j = set; j < set + TB_WAYS; j++)
   {
-    i = state.next_tb[t];
-    state.next_tb[t]++;
-    if(state.next_tb[t] == TB_ENTRIES)
-      state.next_tb[t] = 0;
+    if(tb[t][i].valid
+     && (!tb[t][j].valid || (tb[t][j].used < tb[t][i].used)))
+      i = j;
   }
 
-  state.tb[t][i].match_mask = match_mask;
-  state.tb[t][i].keep_mask = keep_mask;
-  state.tb[t][i].virt = virt & match_mask;
-  state.tb[t][i].phys = pte_phys & phys_mask;
-  state.tb[t][i].fault[0] = (int) pte_flags & 2;
-  state.tb[t][i].fault[1] = (int) pte_flags & 4;
-  state.tb[t][i].fault[2] = (int) pte_flags & 8;
-  state.tb[t][i].access[0][0] = (int) pte_flags & 0x100;
-  state.tb[t][i].access[1][0] = (int) pte_flags & 0x1000;
-  state.tb[t][i].access[0][1] = (int) pte_flags & 0x200;
-  state.tb[t][i].access[1][1] = (int) pte_flags & 0x2000;
-  state.tb[t][i].access[0][2] = (int) pte_flags & 0x400;
-  state.tb[t][i].access[1][2] = (int) pte_flags & 0x4000;
-  state.tb[t][i].access[0][3] = (int) pte_flags & 0x800;
-  state.tb[t][i].access[1][3] = (int) pte_flags & 0x8000;
-  state.tb[t][i].asm_bit = (int) pte_flags & 0x10;
-  state.tb[t][i].asn = asn;
-  state.tb[t][i].valid = true;
+  // The software TLB may only hold translations that are in the DTB.
+  if(!t && tb[t][i].valid)
+    flush_stlb(tb[t][i].virt, tb[t][i].match_mask);
+
+  tb[t][i].match_mask = match_mask;
+  tb[t][i].keep_mask = keep_mask;
+  tb[t][i].virt = virt & match_mask;
+  tb[t][i].phys = pte_phys & phys_mask;
+  tb[t][i].fault[0] = (int) pte_flags & 2;
+  tb[t][i].fault[1] = (int) pte_flags & 4;
+  tb[t][i].fault[2] = (int) pte_flags & 8;
+  tb[t][i].access[0][0] = (int) pte_flags & 0x100;
+  tb[t][i].access[1][0] = (int) pte_flags & 0x1000;
+  tb[t][i].access[0][1] = (int) pte_flags & 0x200;
+  tb[t][i].access[1][1] = (int) pte_flags & 0x2000;
+  tb[t][i].access[0][2] = (int) pte_flags & 0x400;
+  tb[t][i].access[1][2] = (int) pte_flags & 0x4000;
+  tb[t][i].access[0][3] = (int) pte_flags & 0x800;
+  tb[t][i].access[1][3] = (int) pte_flags & 0x8000;
+  tb[t][i].asm_bit = (int) pte_flags & 0x10;
+  tb[t][i].asn = asn;
+  tb[t][i].gh = gh;
+  tb[t][i].used = ++state.tb_clock[t];
+  tb[t][i].valid = true;
+  state.tb_gh_used[t] |= (1 << gh);
   state.last_found_tb[t][rw] = i;
 
 #if defined(DEBUG_TB_)
@@ -1968,22 +1887,22 @@ void CAlphaCPU::add_tb(u64 virt, u64 pte_phys, u64 pte_flags, int flags)
 #endif
   {
     printf("Add TB---------------------------------------\n");
-    printf("Map VIRT    %016"LL "x\n", state.tb[i].virt);
-    printf("Matching    %016"LL "x\n", state.tb[i].match_mask);
-    printf("And keeping %016"LL "x\n", state.tb[i].keep_mask);
-    printf("To PHYS     %016"LL "x\n", state.tb[i].phys);
-    printf("Read : %c%c%c%c %c\n", state.tb[i].access[0][0] ? 'K' : '-',
-           state.tb[i].access[0][1] ? 'E' : '-',
-           state.tb[i].access[0][2] ? 'S' : '-',
-           state.tb[i].access[0][3] ? 'U' : '-', state.tb[i].fault[0] ? 'F' : '-');
-    printf("Write: %c%c%c%c %c\n", state.tb[i].access[1][0] ? 'K' : '-',
-           state.tb[i].access[1][1] ? 'E' : '-',
-           state.tb[i].access[1][2] ? 'S' : '-',
-           state.tb[i].access[1][3] ? 'U' : '-', state.tb[i].fault[1] ? 'F' : '-');
-    printf("Exec : %c%c%c%c %c\n", state.tb[i].access[1][0] ? 'K' : '-',
-           state.tb[i].access[1][1] ? 'E' : '-',
-           state.tb[i].access[1][2] ? 'S' : '-',
-           state.tb[i].access[1][3] ? 'U' : '-', state.tb[i].fault[1] ? 'F' : '-');
+    printf("Map VIRT    %016"LL "x\n", tb[i].virt);
+    printf("Matching    %016"LL "x\n", tb[i].match_mask);
+    printf("And keeping %016"LL "x\n", tb[i].keep_mask);
+    printf("To PHYS     %016"LL "x\n", tb[i].phys);
+    printf("Read : %c%c%c%c %c\n", tb[i].access[0][0] ? 'K' : '-',
+           tb[i].access[0][1] ? 'E' : '-',
+           tb[i].access[0][2] ? 'S' : '-',
+           tb[i].access[0][3] ? 'U' : '-', tb[i].fault[0] ? 'F' : '-');
+    printf("Write: %c%c%c%c %c\n", tb[i].access[1][0] ? 'K' : '-',
+           tb[i].access[1][1] ? 'E' : '-',
+           tb[i].access[1][2] ? 'S' : '-',
+           tb[i].access[1][3] ? 'U' : '-', tb[i].fault[1] ? 'F' : '-');
+    printf("Exec : %c%c%c%c %c\n", tb[i].access[1][0] ? 'K' : '-',
+           tb[i].access[1][1] ? 'E' : '-',
+           tb[i].access[1][2] ? 'S' : '-',
+           tb[i].access[1][3] ? 'U' : '-', tb[i].fault[1] ? 'F' : '-');
   }
 #endif
 }
@@ -2038,6 +1957,129 @@ void CAlphaCPU::add_tb_i(u64 virt, u64 pte)
   add_tb(virt, pte, pte & 0xf70, ACCESS_EXEC);
 }
 
+/**
+ * Read data that crosses a page boundary. Only the second page still needs
+ * to be translated; the bytes are then taken from the two pages directly
+ * if they are in memory, or read one by one otherwise.
+ *
+ * \param va      Virtual address of the first byte.
+ * \param phys1   Physical address of the first byte.
+ * \param size    Size of the data in bits.
+ * \param ins     Instruction doing the read (for exceptions).
+ * \param data    Receives the data read.
+ * \return        Non-zero if translating the second page caused an exception.
+ **/
+int CAlphaCPU::read_split(u64 va, u64 phys1, int size, u32 ins, u64* data)
+{
+  int   n1 = (int) (STLB_PAGE_SIZE - (va & STLB_OFFSET_MASK));
+  u64   phys2;
+  char*   p1;
+  char*   p2;
+  u64   b;
+
+#if defined(MIPS_ESTIMATE)
+  page_cross++;
+#endif
+  if(virt2phys(va + n1, &phys2, ACCESS_READ, NULL, ins))
+    return -1;
+
+  p1 = cSystem->PtrToMem(phys1);
+  p2 = cSystem->PtrToMem(phys2);
+  *data = 0;
+  for(int i = 0; i < size / 8; i++)
+  {
+    if(i < n1)
+      b = p1 ? (u8) p1[i] : cSystem->ReadMem(phys1 + i, 8, this);
+    else
+      b = p2 ? (u8) p2[i - n1] : cSystem->ReadMem(phys2 + i - n1, 8, this);
+    *data |= b << (i * 8);
+  }
+
+  return 0;
+}
+
+/**
+ * Write data that crosses a page boundary. Only the second page still
+ * needs to be translated; the bytes are then stored into the two pages
+ * directly if they are in memory and nothing needs to see the write (see
+ * CSystem::is_write_watched), or written one by one otherwise.
+ *
+ * \param va      Virtual address of the first byte.
+ * \param phys1   Physical address of the first byte.
+ * \param size    Size of the data in bits.
+ * \param ins     Instruction doing the write (for exceptions).
+ * \param data    Data to write.
+ * \return        Non-zero if translating the second page caused an exception.
+ **/
+int CAlphaCPU::write_split(u64 va, u64 phys1, int size, u32 ins, u64 data)
+{
+  int   n1 = (int) (STLB_PAGE_SIZE - (va & STLB_OFFSET_MASK));
+  u64   phys2;
+  char*   p1;
+  char*   p2;
+
+#if defined(MIPS_ESTIMATE)
+  page_cross++;
+#endif
+  if(virt2phys(va + n1, &phys2, ACCESS_WRITE, NULL, ins))
+    return -1;
+
+  p1 = cSystem->is_write_watched(phys1) ? 0 : cSystem->PtrToMem(phys1);
+  p2 = cSystem->is_write_watched(phys2) ? 0 : cSystem->PtrToMem(phys2);
+  for(int i = 0; i < size / 8; i++)
+  {
+    if(i < n1)
+    {
+      if(p1)
+        p1[i] = (char) data;
+      else
+        cSystem->WriteMem(phys1 + i, 8, data & 0xff, this);
+    }
+    else
+    {
+      if(p2)
+        p2[i - n1] = (char) data;
+      else
+        cSystem->WriteMem(phys2 + i - n1, 8, data & 0xff, this);
+    }
+
+    data >>= 8;
+  }
+
+  return 0;
+}
+
+/**
+ * \brief Add software TLB entry
+ *
+ * Called after virt2phys has translated and checked a normal data access,
+ * to let further accesses to the same page bypass virt2phys. Only pages of
+ * main memory are entered; device memory is always accessed through
+ * ReadMem and WriteMem.
+ *
+ * \param virt    Virtual address.
+ * \param phys    Physical address virt translated to.
+ * \param rw      0 for a read access, 1 for a write access.
+ **/
+void CAlphaCPU::stlb_fill(u64 virt, u64 phys, int rw)
+{
+  SSoftTLB*   e = &stlb[rw][STLB_INDEX(virt)];
+  char*       host = cSystem->PtrToMem(phys &~STLB_OFFSET_MASK);
+  int         i;
+
+  if(!host)
+    return;
+
+  // Superpage translations are not in the TB, and don't depend on the ASN.
+  i = FindTBEntry(virt, rw ? ACCESS_WRITE : ACCESS_READ);
+
+  e->virt = virt &~STLB_OFFSET_MASK;
+  e->phys = phys &~STLB_OFFSET_MASK;
+  e->host = host;
+  e->cm = state.cm;
+  e->asn = (i < 0 || tb[0][i].asm_bit) ? -1 : state.asn0;
+}
+
 /**
  * \brief Invalidate all translation-buffer entries
  *
@@ -2049,11 +2091,14 @@ void CAlphaCPU::tbia(int flags)
 {
   int t = (flags & ACCESS_EXEC) ? 1 : 0;
   int i;
-  for(i = 0; i < TB_ENTRIES; i++)
-    state.tb[t][i].valid = false;
+  for(i = 0; i < state.tb_sets * TB_WAYS; i++)
+    tb[t][i].valid = false;
+  if(!t)
+    flush_stlb();
   state.last_found_tb[t][0] = 0;
   state.last_found_tb[t][1] = 0;
-  state.next_tb[t] = 0;
+  state.tb_gh_used[t] = 0;
+  state.tb_clock[t] = 0;
 }
 
 /**
@@ -2068,9 +2113,11 @@ void CAlphaCPU::tbiap(int flags)
 {
   int t = (flags & ACCESS_EXEC) ? 1 : 0;
   int i;
-  for(i = 0; i < TB_ENTRIES; i++)
-    if(!state.tb[t][i].asm_bit)
-      state.tb[t][i].valid = false;
+  for(i = 0; i < state.tb_sets * TB_WAYS; i++)
+    if(!tb[t][i].asm_bit)
+      tb[t][i].valid = false;
+  if(!t)
+    flush_stlb();
 }
 
 /**
@@ -2084,7 +2131,11 @@ void CAlphaCPU::tbis(u64 virt, int flags)
   int t = (flags & ACCESS_EXEC) ? 1 : 0;
   int i = FindTBEntry(virt, flags);
   if(i >= 0)
-    state.tb[t][i].valid = false;
+  {
+    tb[t][i].valid = false;
+    if(!t)
+      flush_stlb(tb[t][i].virt, tb[t][i].match_mask);
+  }
 }
 
 //\}
@@ -2097,6 +2148,10 @@ void CAlphaCPU::tbis(u64 virt, int flags)
 void CAlphaCPU::enable_icache()
 {
   icache_enabled = true;
+
+  // The decompressor doesn't expect its own writes to invalidate the
+  // instructions it has cached, just like on a real 21264.
+  icache_coherent = false;
 }
 
 /**
@@ -2106,12 +2161,13 @@ void CAlphaCPU::restore_icache()
 {
   bool  newval;
 
-  newval = myCfg->get_bool_value("icache", false);
+  newval = myCfg->get_bool_value("icache", true);
 
   if(!newval)
     flush_icache();
 
   icache_enabled = newval;
+  icache_coherent = true;
 }
 
 #if defined(IDB)
@@ -2218,3 +2274,42 @@ const char*   IPR_NAME[] = {
   "?1111.1101?", "?1111.1110?", "?1111.1111?",
 };
 #endif
+
+#if defined(CPU_PREDECODE)
+
+/**
+ * \brief Decode an instruction for the predecoded instruction cache.
+ *
+ * Walks the same decoding tree as CAlphaCPU::execute, but instead of
+ * executing the instruction, records the handler number, the function
+ * code and the (PALshadow-translated) register numbers.
+ *
+ * \param ins  Instruction to decode.
+ * \param d    Predecoded instruction to fill in.
+ **/
+void CAlphaCPU::decode(u32 ins, SDecoded* d)
+{
+  int opcode;
+  int function;
+
+  d->ra = (u8) REG_1;
+  d->rb = (u8) REG_2;
+  d->rc = (u8) REG_3;
+  d->function = 0;
+
+#undef OP
+#undef UNKNOWN1
+#undef UNKNOWN2
+#define OP(mnemonic, format)   \
+  d->op = OPC_##mnemonic;      \
+  d->function = function;      \
+  return;
+#define UNKNOWN1  d->op = OPC_UNKNOWN; \
+  return;
+#define UNKNOWN2  d->op = OPC_UNKNOWN; \
+  return;
+  function = 0;
+  opcode = ins >> 26;
+#include "cpu_decode.h"
+}
+#endif
@@ -224,6 +224,10 @@
 
 /// Number of entries in the Instruction Cache
 #define ICACHE_ENTRIES    1024
+/// Number of entries in each set of the Instruction Cache
+#define ICACHE_WAYS       4
+/// Number of sets in the Instruction Cache
+#define ICACHE_SETS       (ICACHE_ENTRIES / ICACHE_WAYS)
 // Size of Instruction Cache entries in DWORDS (instructions)
 #define ICACHE_LINE_SIZE  512
 /** These bits should match to have an Instruction Cache hit.
@@ -233,8 +237,222 @@
 #define ICACHE_INDEX_MASK (u64) (ICACHE_LINE_SIZE - U64(0x1))
 /// Byte numer of an address in an ICache entry.
 #define ICACHE_BYTE_MASK  (u64) (ICACHE_INDEX_MASK << 2)
-/// Number of entries in each Translation Buffer
-#define TB_ENTRIES        16
+/** Set number for an address in the ICache. Folds in higher address bits
+    and the PALmode bit, so PALcode and the code it serves don't collide. */
+#define ICACHE_SET(a)                                                            \
+    ((int) ((((a) >> 11) ^ ((a) >> 19) ^ ((a) << 7)) & (ICACHE_SETS - 1)) * ICACHE_WAYS)
+/// Maximum number of entries in each Translation Buffer
+#define TB_ENTRIES        1024
+/// Number of entries in each set of a Translation Buffer
+#define TB_WAYS           4
+
+/// Size of a host cache line
+#define CPU_CACHE_LINE    64
+
+/** Aligns a structure to a host cache line. CAlphaCPU objects are allocated
+    on cache line boundaries as well, so the state of different CPU's never
+    shares a cache line. */
+#if defined(_MSC_VER)
+#define CPU_ALIGNED       __declspec(align(64))
+#else
+#define CPU_ALIGNED       __attribute__((aligned(64)))
+#endif
+
+/** Predecoded instruction dispatch. Every instruction in the instruction
+    cache is decoded only once; subsequent executions jump directly to the
+    handler for the instruction. This uses the GCC "labels as values"
+    extension, and is not used in the interactive debugger, because that
+    needs the disassembly done while decoding. */
+#if !defined(IDB) && defined(__GNUC__)
+#define CPU_PREDECODE 1
+#endif
+
+/** Maximum number of predecoded instructions that are executed in a row
+    by a single call to CAlphaCPU::execute. */
+#define CPU_BLOCK_MAX     64
+
+/** Translation of hot predecoded blocks into x86-64 host code (the "jit"
+    configuration option). The generated code follows the System V calling
+    convention, and doesn't keep the profiling counters. */
+#if defined(CPU_PREDECODE) && defined(__x86_64__) && !defined(_WIN32) && !defined(PROFILE)
+#define CPU_JIT 1
+#endif
+
+/// Number of entries in the table of (candidate) translated blocks
+#define JIT_BLOCKS        4096
+/// Number of times a block must be entered before it gets translated
+#define JIT_HOT           32
+/// Block entry count that marks a block that can't be translated
+#define JIT_NEVER         0xffffffff
+/// Maximum number of instructions in a translated block
+#define JIT_BLOCK_MAX     64
+/// Minimum number of instructions worth translating
+#define JIT_BLOCK_MIN     3
+/// Size of the host code buffer of each CPU
+#define JIT_CODE_SIZE     (4 * 1024 * 1024)
+/// Host code space reserved for translating one block
+#define JIT_CODE_MAX      (32 * 1024)
+
+/// Number of entries in the branch target cache for computed jumps
+#define BTC_ENTRIES       256
+/// Number of entries in the return address stack
+#define RAS_ENTRIES       16
+
+/// execute_mode: no tracing, disassembly or listing
+#define EXEC_FAST         0
+/// execute_mode: tracing, disassembly and listing as set in the debugger
+#define EXEC_DEBUG        1
+
+/// Idle detection: watch for loops that don't make progress (OpenVMS idle loop)
+#define IDLE_LOOP         1
+/// Idle detection: treat CALL_PAL WTINT as idle
+#define IDLE_WTINT        2
+/// Idle detection: also watch loops in PALmode or with interrupts disabled
+#define IDLE_SRM          4
+
+/// VMS PALcode interrupt entry: always go through the PALcode
+#define VMSPAL_INT_PAL      0
+/// VMS PALcode interrupt entry: use the replacement routines
+#define VMSPAL_INT_NATIVE   1
+/// VMS PALcode interrupt entry: run both, report differences, keep the PALcode's result
+#define VMSPAL_INT_VALIDATE 2
+/// Maximum number of PALcode instructions run for one interrupt when validating
+#define VMSPAL_VALIDATE_MAX 10000
+/// Maximum number of memory writes recorded for one interrupt when validating
+#define VMSPAL_JOURNAL_MAX  64
+
+/// OSF/1 PALcode calls that keep state in PALcode scratch: always through the PALcode
+#define OSFPAL_CALL_PAL       0
+/// OSF/1 PALcode calls that keep state in PALcode scratch: use the replacement routines
+#define OSFPAL_CALL_NATIVE    1
+/// OSF/1 PALcode calls that keep state in PALcode scratch: run both, report differences
+#define OSFPAL_CALL_VALIDATE  2
+
+/// Longest loop, in bytes, that idle detection looks at
+#define CPU_IDLE_LOOP     64
+/// Number of iterations without register changes before a loop is idle
+#define CPU_IDLE_SPINS    100
+/// Longest time, in milliseconds, an idle CPU sleeps before looking again
+#define CPU_IDLE_SLEEP    1
+
+/// Maximum number of instructions executed between checks for interrupts
+/// and timers. Bounds the delay for interrupts raised from other threads.
+#define CPU_EVENT_MAX     1000
+
+/// Requests in irq_h_mailbox for IRQ_H line n: assert, assert after a delay, release.
+#define IRQ_H_ASSERT(n)   (1 << (n))
+#define IRQ_H_DELAYED(n)  (1 << ((n) + 8))
+#define IRQ_H_RELEASE(n)  (1 << ((n) + 16))
+/// Request in irq_h_mailbox that only makes the CPU thread look at its events again
+#define IRQ_H_RESCHEDULE  (1 << 24)
+
+/// Number of entries in each of the software TLB's
+#define STLB_ENTRIES      256
+/// Page size used by the software TLB
+#define STLB_PAGE_SIZE    U64(0x2000)
+/// Offset of an address within a software TLB page
+#define STLB_OFFSET_MASK  (STLB_PAGE_SIZE - 1)
+/// Software TLB entry for a virtual address
+#define STLB_INDEX(a)     ((int) ((a) >> 13) & (STLB_ENTRIES - 1))
+
+/**
+ * \brief Software TLB entry.
+ *
+ * Maps a virtual page directly to the host memory that holds the emulated
+ * RAM for it. Only translations that have passed the access checks in
+ * virt2phys for a mode are entered, so a hit needs no further checks.
+ **/
+struct SSoftTLB
+{
+  u64   virt;     /**< Virtual page address, or 1 if the entry is empty */
+  u64   phys;     /**< Physical page address */
+  char*  host;    /**< Host address of the page */
+  int   asn;      /**< Address space number, or -1 if valid for all ASN's */
+  int   cm;       /**< Mode the access was checked for */
+};
+
+/**
+ * \brief Predecoded instruction.
+ *
+ * One of these exists for every instruction in the instruction cache.
+ **/
+struct SDecoded
+{
+  u8  op;       /**< Handler number; 0 if not decoded yet */
+  u8  ra;       /**< Register a, translated for PALshadow registers */
+  u8  rb;       /**< Register b, translated for PALshadow registers */
+  u8  rc;       /**< Register c, translated for PALshadow registers */
+  u32 function; /**< Function code, as extracted by the decoding tree */
+};
+
+#if defined(CPU_PREDECODE)
+
+/**
+ * List of all instruction handlers that can appear in the decoding tree
+ * (cpu_decode.h). Used to generate the handler numbers stored in SDecoded,
+ * and the jump table and handlers in CAlphaCPU::execute.
+ **/
+#define CPU_OPS(X) \
+  X(CALL_PAL) X(LDA) X(LDAH) X(LDBU) X(LDQ_U) X(LDWU) X(STW) X(STB) X(STQ_U) \
+  X(ADDL_V) X(ADDL) X(S4ADDL) X(SUBL_V) X(SUBL) X(S4SUBL) X(CMPBGE) X(S8ADDL) \
+  X(S8SUBL) X(CMPULT) X(ADDQ_V) X(ADDQ) X(S4ADDQ) X(SUBQ_V) X(SUBQ) X(S4SUBQ) \
+  X(CMPEQ) X(S8ADDQ) X(S8SUBQ) X(CMPULE) X(CMPLT) X(CMPLE) X(AND) X(BIC) \
+  X(CMOVLBS) X(CMOVLBC) X(BIS) X(CMOVEQ) X(CMOVNE) X(ORNOT) X(XOR) X(CMOVLT) \
+  X(CMOVGE) X(EQV) X(AMASK) X(CMOVLE) X(CMOVGT) X(IMPLVER) X(MSKBL) X(EXTBL) \
+  X(INSBL) X(MSKWL) X(EXTWL) X(INSWL) X(MSKLL) X(EXTLL) X(INSLL) X(ZAP) \
+  X(ZAPNOT) X(MSKQL) X(SRL) X(EXTQL) X(SLL) X(INSQL) X(SRA) X(MSKWH) X(INSWH) \
+  X(EXTWH) X(MSKLH) X(INSLH) X(EXTLH) X(MSKQH) X(INSQH) X(EXTQH) X(MULL_V) \
+  X(MULL) X(MULQ_V) X(MULQ) X(UMULH) X(ITOFS) X(SQRTF) X(SQRTS) X(ITOFF) \
+  X(ITOFT) X(SQRTG) X(SQRTT) X(CMPGEQ) X(CMPGLT) X(CMPGLE) X(CVTQF) X(CVTQG) \
+  X(ADDF) X(SUBF) X(MULF) X(DIVF) X(CVTDG) X(ADDG) X(SUBG) X(MULG) X(DIVG) \
+  X(CVTGF) X(CVTGD) X(CVTGQ) X(CMPTUN) X(CMPTEQ) X(CMPTLT) X(CMPTLE) X(CVTST) \
+  X(ADDS) X(SUBS) X(MULS) X(DIVS) X(ADDT) X(SUBT) X(MULT) X(DIVT) X(CVTTS) \
+  X(CVTTQ) X(CVTQS) X(CVTQT) X(CVTLQ) X(CPYS) X(CPYSN) X(CPYSE) X(MT_FPCR) \
+  X(MF_FPCR) X(FCMOVEQ) X(FCMOVNE) X(FCMOVLT) X(FCMOVGE) X(FCMOVLE) \
+  X(FCMOVGT) X(CVTQL) X(TRAPB) X(EXCB) X(MB) X(WMB) X(FETCH) X(FETCH_M) \
+  X(RPCC) X(RC) X(ECB) X(RS) X(WH64) X(WH64EN) X(HW_MFPR) X(JMP) X(HW_LDQ) \
+  X(HW_LDL) X(SEXTB) X(SEXTW) X(CTPOP) X(PERR) X(CTLZ) X(CTTZ) X(UNPKBW) \
+  X(UNPKBL) X(PKWB) X(PKLB) X(MINSB8) X(MINSW4) X(MINUB8) X(MINUW4) X(MAXUB8) \
+  X(MAXUW4) X(MAXSB8) X(MAXSW4) X(FTOIT) X(FTOIS) X(HW_MTPR) X(HW_RET) \
+  X(HW_STQ) X(HW_STL) X(LDF) X(LDG) X(LDS) X(LDT) X(STF) X(STG) X(STS) X(STT) \
+  X(LDL) X(LDQ) X(LDL_L) X(LDQ_L) X(STL) X(STQ) X(STL_C) X(STQ_C) X(BR) \
+  X(FBEQ) X(FBLT) X(FBLE) X(BSR) X(FBNE) X(FBGE) X(FBGT) X(BLBC) X(BEQ) \
+  X(BLT) X(BLE) X(BLBS) X(BNE) X(BGE) X(BGT)
+
+/// Handler numbers for predecoded instructions.
+enum
+{
+  OPC_UNDECODED = 0,  /**< Instruction has not been decoded yet */
+  OPC_UNKNOWN,        /**< Unknown instruction; use the decoding tree */
+#define OPC_ENUM(mnemonic)  OPC_##mnemonic,
+  CPU_OPS(OPC_ENUM)
+#undef OPC_ENUM
+  OPC_COUNT
+};
+#endif
+
+#if defined(CPU_JIT)
+
+/**
+ * \brief Translated block.
+ *
+ * A run of predecoded instructions starting at one slot of an icache line,
+ * with the number of times it was entered, and once it is hot, the host
+ * code generated for it. The host code is called with state.r, keeps the
+ * guest registers it uses in host registers, and returns the number of
+ * instructions it completed; bit 16 is set if the block ended in a branch
+ * that was taken.
+ **/
+struct SJitBlock
+{
+  u32 key;      /**< Icache line * ICACHE_LINE_SIZE + slot, or 0xffffffff if unused */
+  u32 gen;      /**< decoded_gen of the line this was counted or translated for */
+  u32 count;    /**< Times entered, or JIT_NEVER if the block can't be translated */
+  int n;        /**< Number of instructions in the translated block */
+  u64 disp;     /**< Displacement of the branch that ends the block */
+  u32 (*code)(u64* r);  /**< Host code, or 0 if not translated */
+};
+#endif
 
 /**
  * \brief Emulated CPU.
@@ -254,17 +472,27 @@ class CAlphaCPU : public CSystemComponent, public CRunnable
     virtual int   SaveState(FILE* f);
     virtual int   RestoreState(FILE* f);
     void          irq_h(int number, bool assert, int delay);
+    void          schedule_events();
+    void          request_int_check();
+    void          reschedule_events();
+    void          irq_h_drain();
     int           get_cpuid();
     void          flush_icache();
+    void          flush_decode();
+    void          flush_icache_page(u64 address);
+    void          flush_stlb();
 
     virtual void  run();    // Poco Thread entry point
     void          execute();
+    template <int mode> void execute_mode();
     void          release_threads();
 
     void          set_PAL_BASE(u64 pb);
     virtual void  check_state();
     CAlphaCPU(CConfigurator* cfg, CSystem* system);
     virtual       ~CAlphaCPU();
+    static void*  operator new(size_t size);
+    static void   operator delete(void* p);
     u64           get_r(int i, bool translate);
     u64           get_f(int i);
     void          set_r(int reg, u64 val);
@@ -290,6 +518,7 @@ class CAlphaCPU : public CSystemComponent, public CRunnable
     void          next_pc();
     void          set_pc(u64 p_pc);
     void          add_pc(u64 a_pc);
+    void          set_reg_bank();
 
     u64           get_speed() { return cpu_hz; };
 
@@ -310,8 +539,34 @@ class CAlphaCPU : public CSystemComponent, public CRunnable
     CSemaphore mySemaphore;
     bool            StopThread;
 
+    int             idle_mode;        /**< Enabled idle detection (IDLE_xxx) */
+    u64             idle_loop_pc;     /**< Start of the loop being watched */
+    int             idle_spins;       /**< Iterations of that loop without register changes */
+    u64             idle_regs[32];    /**< Registers at the start of the last iteration */
+    CEvent          idle_event;       /**< Wakes up a sleeping idle CPU */
+    void            idle_loop(u64 target);
+    void            idle_wait();
+
     int             get_icache(u64 address, u32* data);
+    int             find_icache(u64 address);
+    void            predict_jump(u32 ins);
+    bool            stlb_read(u64 virt, int size, u64* data);
+    bool            stlb_write(u64 virt, int size, u64 data);
+    void            stlb_fill(u64 virt, u64 phys, int rw);
+    int             read_split(u64 va, u64 phys1, int size, u32 ins, u64* data);
+    int             write_split(u64 va, u64 phys1, int size, u32 ins, u64 data);
+    void            flush_stlb(u64 virt, u64 match_mask);
+#if defined(CPU_PREDECODE)
+    void            decode(u32 ins, SDecoded* d);
+#endif
+#if defined(CPU_JIT)
+    void            jit_init();
+    void            jit_exit();
+    bool            jit_run(int line, bool counted);
+    void            jit_translate(int line, int slot, SJitBlock* b);
+#endif
     int             FindTBEntry(u64 virt, int flags);
+    int             tb_set(u64 virt, int gh);
     void            add_tb(u64 virt, u64 pte_phys, u64 pte_flags, int flags);
     void            add_tb_i(u64 virt, u64 pte);
     void            add_tb_d(u64 virt, u64 pte);
@@ -405,6 +660,31 @@ class CAlphaCPU : public CSystemComponent, public CRunnable
     void            vmspal_call_read_unq();
     void            vmspal_call_write_unq();
 
+    /* OSF/1 PALcode call: */
+    void            osfpal_call_cflush();
+    void            osfpal_call_draina();
+    void            osfpal_call_tbi();
+    void            osfpal_call_whami();
+    void            osfpal_call_wtint();
+    void            osfpal_call_imb();
+    int             osfpal_call_swpctx();
+    int             osfpal_call_wrent();
+    int             osfpal_call_swpipl();
+    int             osfpal_call_rdps();
+    int             osfpal_call_wrusp();
+    int             osfpal_call_rdusp();
+    int             osfpal_call_rti();
+    int             osfpal_call_callsys();
+
+    /* OSF/1 PALcode internal: */
+    int             osfpal_call(int function);
+    int             osfpal_call_native(int function);
+    int             osfpal_check_call(int function);
+    bool            osfpal_kstack(u64 virt, u64* phys);
+    void            osfpal_set_ipl(int ipl);
+
+    int             osfpal_call_mode; /**< How OSF/1 PALcode calls are done (OSFPAL_CALL_xxx) */
+
     /* VMS PALcode entry: */
     int             vmspal_ent_dtbm_double_3(int flags);
     int             vmspal_ent_dtbm_single(int flags);
@@ -414,12 +694,90 @@ class CAlphaCPU : public CSystemComponent, public CRunnable
     int             vmspal_ent_ext_int(int ei);
     int             vmspal_ent_sw_int(int si);
     int             vmspal_ent_ast_int(int ast);
+    int             vmspal_ent_int();
 
     /* VMS PALcode internal: */
     int             vmspal_int_initiate_exception();
     int             vmspal_int_initiate_interrupt();
+    void            vmspal_write(u64 address, int dsize, u64 data);
+    void            vmspal_check_begin();
+    int             vmspal_check_undo();
+    void            vmspal_check_pal(const char* what, int writes);
+    int             vmspal_check_int();
+
+    int             vmspal_int_mode;  /**< How VMS PALcode interrupts are entered (VMSPAL_INT_xxx) */
+
+    /**
+     * \brief Memory write done by the PALcode replacement routines.
+     *
+     * Recorded while validating, so the writes can be undone before the
+     * PALcode runs from the same state, and compared afterwards.
+     **/
+    struct SPalWrite
+    {
+      u64 address;
+      int dsize;
+      u64 old_data;
+      u64 new_data;
+    } vmspal_journal[VMSPAL_JOURNAL_MAX];
+    int             vmspal_journal_size;  /**< Number of writes recorded, or -1 if not recording */
 
     bool            icache_enabled;
+    bool            icache_coherent;  /**< Writes to cached code invalidate the icache */
+
+    const u8*       reg_map;          /**< Register numbers (0..31) in the active register bank */
+    static const u8 reg_banks[2][32]; /**< Normal and PALshadow register banks */
+
+    SSoftTLB        stlb[2][STLB_ENTRIES];  /**< Software TLB's for reads and writes */
+    bool            block_enabled;    /**< Run predecoded instructions as blocks (block_exec); interpreted, no code is generated */
+
+    /**
+     * \brief Branch target cache entry.
+     *
+     * Remembers where a JMP or JSR went the last time, and the icache
+     * line that holds that address.
+     **/
+    struct SBranchTarget
+    {
+      u64 from;   /**< Address of the jump instruction */
+      u64 to;     /**< Address jumped to */
+      int line;   /**< Icache line holding the target, or -1 */
+    } btc[BTC_ENTRIES];
+
+    /// Return address stack entry: the return address for a JSR, and the icache line it's in.
+    struct SReturnAddress
+    {
+      u64 pc;
+      int line;
+    } ras[RAS_ENTRIES];
+    int             ras_top;          /**< Top of the (circular) return address stack */
+
+#if defined(MIPS_ESTIMATE)
+    u64             icache_hit_last;  /**< Hits on the last used icache entry */
+    u64             icache_hit_set;   /**< Hits on another icache entry */
+    u64             icache_miss;      /**< Icache misses (cache fills) */
+    u64             tb_hit_last;      /**< Hits on the last used TB entry */
+    u64             tb_hit_set;       /**< Hits on another TB entry */
+    u64             tb_miss;          /**< TB misses */
+    u64             page_cross;       /**< Memory accesses that cross a page boundary */
+    u64             btc_hit;          /**< Jumps found in the branch target cache */
+    u64             btc_miss;         /**< Jumps not found in the branch target cache */
+    u64             ras_hit;          /**< Returns predicted by the return address stack */
+    u64             ras_miss;         /**< Returns not predicted by the return address stack */
+#endif
+
+#if defined(CPU_PREDECODE)
+    SDecoded        decoded[ICACHE_ENTRIES][ICACHE_LINE_SIZE];  /**< Predecoded icache contents */
+    bool            decoded_valid[ICACHE_ENTRIES];              /**< Predecoded line is usable */
+#endif
+
+#if defined(CPU_JIT)
+    u32             decoded_gen[ICACHE_ENTRIES];  /**< Counts the times a line was predecoded afresh */
+    bool            jit_enabled;      /**< Translate hot blocks to host code (jit) */
+    SJitBlock*      jit_blocks;       /**< JIT_BLOCKS candidate and translated blocks */
+    u8*             jit_code;         /**< Executable buffer for host code (JIT_CODE_SIZE bytes) */
+    size_t          jit_used;         /**< Bytes of jit_code in use */
+#endif
 
     // ... ... ...
     u64             cc_large;
@@ -433,34 +791,103 @@ class CAlphaCPU : public CSystemComponent, public CRunnable
     u64             ins_per_timer_int;
     u64             next_timer_int;
     u64             cpu_hz;
-
-    /// The state structure contains all elements that need to be saved to the statefile
-    struct SCPU_state
+    int             ins_to_event;     /**< Instructions until interrupts and timers need to be checked (CPU thread only) */
+    volatile u32    irq_h_mailbox;    /**< IRQ_H requests from other threads (IRQ_H_xxx) */
+    volatile u32    irq_h_delay[6];   /**< Delay that goes with IRQ_H_DELAYED */
+
+    /**
+     * \brief Instruction cache entry.
+     *
+     * An instruction cache entry contains the address and address space number
+     * (ASN) + 16 32-bit instructions. [HRM 2-11]
+     **/
+    struct SICache
+    {
+      int   asn;        /**< Address Space Number */
+      u32   data[ICACHE_LINE_SIZE]; /**< Actual cached instructions  */
+      u64   address;          /**< Address of first instruction */
+      u64   p_address;        /**< Physical address of first instruction */
+      bool  asm_bit;          /**< Address Space Match bit */
+      bool  valid;            /**< Valid cache entry */
+      u32   used;             /**< Value of icache_clock when last used */
+    };
+
+    /**
+     * \brief Translation Buffer Entry.
+     *
+     * A translation buffer entry provides the mapping from a page of virtual memory to a page of physical memory.
+     **/
+    struct STBEntry
+    {
+      u64   virt;         /**< Virtual address of page*/
+      u64   phys;         /**< Physical address of page*/
+      u64   match_mask;   /**< The virtual address has to match for these bits to be a hit*/
+      u64   keep_mask;    /**< This part of the virtual address is OR-ed with the phys address*/
+      int   asn;          /**< Address Space Number*/
+      int   asm_bit;      /**< Address Space Match bit*/
+      int   access[2][4]; /**< Access permitted [read/write][current mode]*/
+      int   fault[3];     /**< Fault on access [read/write/execute]*/
+      int   gh;           /**< Granularity hint (0..3) */
+      u32   used;         /**< Value of tb_clock when last used */
+      bool  valid;        /**< Valid entry*/
+    };
+
+    /** Instruction cache entries [HRM p 2-11]. Allocated separately, so they
+        don't come between the fields in state that are used for every
+        instruction. Saved to the state file after state. */
+    SICache*        icache;
+    STBEntry*       tb[2];            /**< Translation buffer entries; saved like icache */
+
+    /**
+     * \brief The state structure contains all elements that need to be saved to the statefile
+     *
+     * The fields used while executing every instruction come first, so they
+     * share a few cache lines; the rarely used IPR's come last.
+     **/
+    struct CPU_ALIGNED SCPU_state
     {
-      bool  wait_for_start;
-      u64   pal_base;       /**< IPR PAL_BASE [HRM: p 5-15] */
       u64   pc;             /**< Program counter */
+      u64   current_pc;     /**< Virtual address of current instruction */
+      u64   pc_phys;
       u64   cc;             /**< IPR CC: Cycle counter [HRM p 5-3] */
+      u64   instruction_count;  /**< Number of times doclock has been called */
+      u64   fpcr;           /**< Floating-Point Control Register [HRM p 2-36] */
+      u32   rem_ins_in_page;      /**< Number of instructions remaining in current page */
+      u32   cc_offset;      /**< IPR CC: Cycle counter offset [HRM p 5-3] */
+      u32   icache_clock;   /**< Increased each time we switch cache entries */
+      u32   tb_clock[2];    /**< Increased each time a translation buffer entry is used */
+      int   cm;             /**< IPR IER_CM: cm (current mode) [HRM p 5-9..10] */
+      int   asn;            /**< IPR PCTX: asn (address space number) [HRM p 5-21..22] */
+      int   last_found_icache;    /**< Number of last cache entry found */
+      int   last_found_tb[2][2];  /**< Number of last translation buffer entry found */
+      int   tb_sets;        /**< Number of sets in use in each translation buffer */
+      int   tb_gh_used[2];  /**< Granularity hints of entries in each translation buffer */
+      bool  check_int;      /**< True if an interrupt may be pending */
+      bool  check_timers;   /**< True if a delayed IRQ_H assertion is pending */
+      bool  cc_ena;         /**< IPR CC_CTL: Cycle counter enabled [HRM p 5-3] */
+      bool  fpen;           /**< IPR PCTX: fpe (floating point enable) [HRM p 5-21..23] */
+      bool  sde;            /**< IPR I_CTL: sde[1] (PALshadow enable) [HRM p 5-15..18] */
+      bool  pal_vms;        /**< True if the PALcode base is 0x8000 (=VMS PALcode base) */
+      bool  pal_osf;        /**< True if the PALcode base belongs to the OSF/1 PALcode */
+      bool  swppal_osf;     /**< True if the last SWPPAL asked for the OSF/1 PALcode */
       u64   r[64];          /**< Integer registers (0-31 normal, 32-63 shadow) */
+      u64   f[64];          /**< Floating point registers (0-31 normal, 32-63 shadow) */
+
+      bool  wait_for_start;
+      u64   pal_base;       /**< IPR PAL_BASE [HRM: p 5-15] */
       u64   dc_stat;        /**< IPR DC_STAT: Dcache status [HRM p 5-31..32] */
       bool  ppcen;          /**< IPR PCTX: ppce (proc perf counting enable) [HRM p 5-21..23] */
       u64   i_stat;         /**< IPR I_STAT: Ibox status [HRM p 5-18..20] */
       u64   pctr_ctl;       /**< IPR PCTR_CTL [HRM p 5-23..25] */
-      bool  cc_ena;         /**< IPR CC_CTL: Cycle counter enabled [HRM p 5-3] */
-      u32   cc_offset;      /**< IPR CC: Cycle counter offset [HRM p 5-3] */
       u64   dc_ctl;         /**< IPR DC_CTL: Dcache control [HRM p 5-30..31] */
       int   alt_cm;         /**< IPR DTB_ALTMODE: alternative cm for HW_LD/HW_ST [HRM p 5-26..27] */
       int   smc;            /**< IPR M_CTL: smc (speculative miss control) [HRM p 5-29..30] */
-      bool  fpen;           /**< IPR PCTX: fpe (floating point enable) [HRM p 5-21..23] */
-      bool  sde;            /**< IPR I_CTL: sde[1] (PALshadow enable) [HRM p 5-15..18] */
       u64   fault_va;       /**< IPR VA: virtual address of last Dstream miss or fault [HRM p 5-4] */
       u64   exc_sum;        /**< IPR EXC_SUM: exception summary [HRM p 5-13..15] */
       int   i_ctl_va_mode;  /**< IPR I_CTL: (va_form_32 + va_48) [HRM p 5-15..17] */
       int   va_ctl_va_mode; /**< IPR VA_CTL: (va_form_32 + va_48) [HRM p 5-4] */
       u64   i_ctl_vptb;     /**< IPR I_CTL: vptb (virtual page table base) [HRM p 5-15..16] */
       u64   va_ctl_vptb;    /**< IPR VA_CTL: vptb (virtual page table base) [HRM p 5-4] */
-      int   cm;           /**< IPR IER_CM: cm (current mode) [HRM p 5-9..10] */
-      int   asn;          /**< IPR PCTX: asn (address space number) [HRM p 5-21..22] */
       int   asn0;         /**< IPR DTB_ASN0: asn (address space number) [HRM p 5-28] */
       int   asn1;         /**< IPR DTB_ASN1: asn (address space number) [HRM p 5-28] */
       int   eien;         /**< IPR IER_CM: eien (external interrupt enable) [HRM p 5-9..10] */
@@ -483,60 +910,15 @@ class CAlphaCPU : public CSystemComponent, public CRunnable
       int   i_ctl_spe;    /**< IPR I_CTL: spe (Super Page mode enabled) [HRM p 5-15..18] */
       u64   exc_addr;     /**< IPR EXC_ADDR: address of last exception [HRM p 5-8] */
       u64   pmpc;
-      u64   fpcr;         /**< Floating-Point Control Register [HRM p 2-36] */
       bool  bIntrFlag;
-      u64   current_pc;   /**< Virtual address of current instruction */
-
-      /**
-       * \brief Instruction cache entry.
-       *
-       * An instruction cache entry contains the address and address space number
-       * (ASN) + 16 32-bit instructions. [HRM 2-11]
-       **/
-      struct SICache
-      {
-        int   asn;        /**< Address Space Number */
-        u32   data[ICACHE_LINE_SIZE]; /**< Actual cached instructions  */
-        u64   address;          /**< Address of first instruction */
-        u64   p_address;        /**< Physical address of first instruction */
-        bool  asm_bit;          /**< Address Space Match bit */
-        bool  valid;            /**< Valid cache entry */
-      } icache[ICACHE_ENTRIES]; /**< Instruction cache entries [HRM p 2-11] */
-      int next_icache;          /**< Number of next cache entry to use */
-      int last_found_icache;    /**< Number of last cache entry found */
-
-      /**
-       * \brief Translation Buffer Entry.
-       *
-       * A translation buffer entry provides the mapping from a page of virtual memory to a page of physical memory.
-       **/
-      struct STBEntry
-      {
-        u64   virt;         /**< Virtual address of page*/
-        u64   phys;         /**< Physical address of page*/
-        u64   match_mask;   /**< The virtual address has to match for these bits to be a hit*/
-        u64   keep_mask;    /**< This part of the virtual address is OR-ed with the phys address*/
-        int   asn;          /**< Address Space Number*/
-        int   asm_bit;      /**< Address Space Match bit*/
-        int   access[2][4]; /**< Access permitted [read/write][current mode]*/
-        int   fault[3];     /**< Fault on access [read/write/execute]*/
-        bool  valid;        /**< Valid entry*/
-      } tb[2][TB_ENTRIES];  /**< Translation buffer entries */
-
-      int   next_tb[2];     /**< Number of next translation buffer entry to use */
-      int   last_found_tb[2][2];  /**< Number of last translation buffer entry found */
-      u32   rem_ins_in_page;      /**< Number of instructions remaining in current page */
-      u64   pc_phys;
-      u64   f[64];    /**< Floating point registers (0-31 normal, 32-63 shadow) */
       int   iProcNum; /**< number of the current processor (0 in a 1-processor system) */
-      u64   instruction_count;  /**< Number of times doclock has been called */
       u64   last_tb_virt;
-      bool  pal_vms;            /**< True if the PALcode base is 0x8000 (=VMS PALcode base) */
-      bool  check_int;          /**< True if an interrupt may be pending */
-      int   irq_h_timer[6];     /**< Timers for delayed IRQ_H[0:5] assertion */
-      bool  check_timers;
+      u64   irq_h_due[6];       /**< Instruction count at which delayed IRQ_H[0:5] is asserted (0 = none) */
     } state;  /**< Determines CPU state that needs to be saved to the state file */
 
+    SCPU_state*     vmspal_saved[2];  /**< Starting and replacement state when validating */
+    STBEntry*       vmspal_saved_tb;  /**< Translation buffers at the start when validating */
+
 #ifdef IDB
     u64 current_pc_physical;  /**< Physical address of current instruction */
     u32 last_instruction;
@@ -546,13 +928,9 @@ class CAlphaCPU : public CSystemComponent, public CRunnable
 };
 
 /** Translate raw register (0..31) number to a number that takes PALshadow
-    registers into consideration (0..63). Considers the program counter
-    (to determine if we're in PALmode), and the SDE (Shadow Enable) bit. */
-#define RREG(a)                                                          \
-    (                                                                    \
-      ((a) & 0x1f) +                                                     \
-        (((state.pc & 1) && (((a) & 0xc) == 0x4) && state.sde) ? 32 : 0) \
-    )
+    registers into consideration (0..63). Uses the active register bank,
+    which is selected by set_reg_bank. */
+#define RREG(a) (reg_map[(a) & 0x1f])
 
 /**
  * Empty the instruction cache.
@@ -566,14 +944,72 @@ inline void CAlphaCPU::flush_icache()
     int i;
     for(i = 0; i < ICACHE_ENTRIES; i++)
     {
-      state.icache[i].valid = false;
+      icache[i].valid = false;
 
-      //    state.icache[i].asm_bit = true;
+      //    icache[i].asm_bit = true;
     }
 
-    state.next_icache = 0;
+    state.icache_clock = 0;
     state.last_found_icache = 0;
+    flush_decode();
+  }
+}
+
+/**
+ * Empty the instruction cache of lines that were filled from a page of
+ * physical memory. Called by CSystem::invalidate_code when the page is
+ * written to.
+ **/
+inline void CAlphaCPU::flush_icache_page(u64 address)
+{
+  int i;
+  for(i = 0; i < ICACHE_ENTRIES; i++)
+    if(icache[i].valid
+     && !((icache[i].p_address ^ address) >> CODE_PAGE_SHIFT))
+      icache[i].valid = false;
+}
+
+/**
+ * Empty the software TLB's.
+ **/
+inline void CAlphaCPU::flush_stlb()
+{
+  int i;
+  for(i = 0; i < STLB_ENTRIES; i++)
+  {
+    stlb[0][i].virt = 1;
+    stlb[1][i].virt = 1;
+  }
+}
+
+/**
+ * Empty the software TLB entries that could map addresses matched by a
+ * translation buffer entry.
+ **/
+inline void CAlphaCPU::flush_stlb(u64 virt, u64 match_mask)
+{
+  if(!(match_mask & STLB_PAGE_SIZE))
+  {
+
+    // The entry has a granularity hint, and covers more than one page.
+    flush_stlb();
+    return;
   }
+
+  stlb[0][STLB_INDEX(virt)].virt = 1;
+  stlb[1][STLB_INDEX(virt)].virt = 1;
+}
+
+/**
+ * Discard all predecoded instructions. Needed whenever the outcome of
+ * decoding could change for instructions still in the instruction cache
+ * (e.g. when the SDE bit changes).
+ **/
+inline void CAlphaCPU::flush_decode()
+{
+#if defined(CPU_PREDECODE)
+  memset(decoded_valid, 0, sizeof(decoded_valid));
+#endif
 }
 
 /**
@@ -585,30 +1021,38 @@ inline void CAlphaCPU::flush_icache_asm()
   {
     int i;
     for(i = 0; i < ICACHE_ENTRIES; i++)
-      if(!state.icache[i].asm_bit)
-        state.icache[i].valid = false;
+      if(!icache[i].asm_bit)
+        icache[i].valid = false;
   }
 }
 
 /**
  * Set the PALcode BASE register, and determine whether we're running VMS PALcode.
+ *
+ * The OSF/1 PALcode used by Tru64 and Linux is only trusted when it was
+ * asked for by name: a SWPPAL with variant 2 [ARM] that moves the base away
+ * from the VMS PALcode. A SWPPAL to a PALcode image at a physical address,
+ * or any other change of base, runs the PALcode without replacements.
  **/
 inline void CAlphaCPU::set_PAL_BASE(u64 pb)
 {
   state.pal_base = pb;
   state.pal_vms = (pb == U64(0x8000));
+  state.pal_osf = !state.pal_vms && state.swppal_osf;
 }
 
 /**
  * Get an instruction from the instruction cache.
  * If necessary, fill a new cache block from memory.
  *
- * get_icache checks all cache entries, to see if there is a
+ * The instruction cache is 4-way set associative. get_icache checks
+ * the cache entries in the set for the address, to see if there is a
  * cache entry that matches the current address space number,
  * and that contains the address we're looking for. If it 
  * exists, the instruction is fetched from this cache,
  * otherwise, the physical address for the instruction is
- * calculated, and the cache block is filled.
+ * calculated, and the least recently used cache block in the set
+ * is filled.
  *
  * The last cache entry that was a hit is remembered, so that
  * cache entry is checked first on the next instruction. (very
@@ -617,11 +1061,15 @@ inline void CAlphaCPU::set_PAL_BASE(u64 pb)
  * It would be easiest to do without the instruction cache
  * altogether, but unfortunately SRM uses self-modifying
  * code, that relies on the correct instruction stream to 
- * remain in the cache.
+ * remain in the cache. The physical page a cache block is
+ * filled from is marked in CSystem, so writes to it (by a CPU
+ * or by DMA) invalidate the cache blocks for that page.
  **/
 inline int CAlphaCPU::get_icache(u64 address, u32* data)
 {
   int   i = state.last_found_icache;
+  int   set;
+  int   victim;
   u64   v_a;
   u64   p_a;
   int   result;
@@ -629,35 +1077,53 @@ inline int CAlphaCPU::get_icache(u64 address, u32* data)
 
   if(icache_enabled)
   {
-    if(state.icache[i].valid
-     && (state.icache[i].asn == state.asn || state.icache[i].asm_bit)
-     && state.icache[i].address == (address & ICACHE_MATCH_MASK))
+    if(icache[i].valid
+     && (icache[i].asn == state.asn || icache[i].asm_bit)
+     && icache[i].address == (address & ICACHE_MATCH_MASK))
     {
-      *data = endian_32(state.icache[i].data[(address >> 2) & ICACHE_INDEX_MASK]);
+#if defined(MIPS_ESTIMATE)
+      icache_hit_last++;
+#endif
+      *data = endian_32(icache[i].data[(address >> 2) & ICACHE_INDEX_MASK]);
 #ifdef IDB
-      current_pc_physical = state.icache[i].p_address + (address & ICACHE_BYTE_MASK);
+      current_pc_physical = icache[i].p_address + (address & ICACHE_BYTE_MASK);
 #endif
       return 0;
     }
 
-    for(i = 0; i < ICACHE_ENTRIES; i++)
+    v_a = address & ICACHE_MATCH_MASK;
+    set = ICACHE_SET(v_a);
+    victim = set;
+
+    for(i = set; i < set + ICACHE_WAYS; i++)
     {
-      if(state.icache[i].valid
-       && (state.icache[i].asn == state.asn || state.icache[i].asm_bit)
-       && state.icache[i].address == (address & ICACHE_MATCH_MASK))
+      if(icache[i].valid
+       && (icache[i].asn == state.asn || icache[i].asm_bit)
+       && icache[i].address == v_a)
       {
+#if defined(MIPS_ESTIMATE)
+        icache_hit_set++;
+#endif
         state.last_found_icache = i;
-        *data = endian_32(state.icache[i].data[(address >> 2) & ICACHE_INDEX_MASK]);
+        icache[i].used = ++state.icache_clock;
+        *data = endian_32(icache[i].data[(address >> 2) & ICACHE_INDEX_MASK]);
 
 #ifdef IDB
-        current_pc_physical = state.icache[i].p_address + (address & ICACHE_BYTE_MASK);
+        current_pc_physical = icache[i].p_address + (address & ICACHE_BYTE_MASK);
 #endif
         return 0;
       }
-    }
 
-    v_a = address & ICACHE_MATCH_MASK;
+      // Remember the entry to replace if we miss: an invalid entry if there is
+      // one, the least recently used one otherwise.
+      if(icache[victim].valid
+       && (!icache[i].valid || (icache[i].used < icache[victim].used)))
+        victim = i;
+    }
 
+#if defined(MIPS_ESTIMATE)
+    icache_miss++;
+#endif
     if(address & 1)
     {
       p_a = v_a &~U64(0x1);
@@ -670,24 +1136,39 @@ inline int CAlphaCPU::get_icache(u64 address, u32* data)
         return result;
     }
 
-    memcpy(state.icache[state.next_icache].data, cSystem->PtrToMem(p_a),
+    if(icache_coherent)
+      cSystem->mark_code_page(p_a);
+    memcpy(icache[victim].data, cSystem->PtrToMem(p_a),
            ICACHE_LINE_SIZE * 4);
 
-    state.icache[state.next_icache].valid = true;
-    state.icache[state.next_icache].asn = state.asn;
-    state.icache[state.next_icache].asm_bit = asm_bit;
-    state.icache[state.next_icache].address = address & ICACHE_MATCH_MASK;
-    state.icache[state.next_icache].p_address = p_a;
+    icache[victim].valid = true;
+    icache[victim].asn = state.asn;
+    icache[victim].asm_bit = asm_bit;
+    icache[victim].address = v_a;
+    icache[victim].p_address = p_a;
+    icache[victim].used = ++state.icache_clock;
+#if defined(CPU_PREDECODE)
+    decoded_valid[victim] = false;
+#endif
 
-    *data = endian_32(state.icache[state.next_icache].data[(address >> 2) & ICACHE_INDEX_MASK]);
+    // A write to the page while the line was being filled may have been
+    // missed: invalidate_code removes the mark before it looks at the
+    // lines, and this one wasn't valid yet. Check for the mark only now the
+    // line is published; the instruction fetched is used once, the next
+    // fetch fills the line again.
+    if(icache_coherent)
+    {
+      atomic_fence();
+      if(!cSystem->is_code_page(p_a))
+        icache[victim].valid = false;
+    }
+
+    *data = endian_32(icache[victim].data[(address >> 2) & ICACHE_INDEX_MASK]);
 
 #ifdef IDB
-    current_pc_physical = state.icache[state.next_icache].p_address + (address & ICACHE_BYTE_MASK);
+    current_pc_physical = icache[victim].p_address + (address & ICACHE_BYTE_MASK);
 #endif
-    state.last_found_icache = state.next_icache;
-    state.next_icache++;
-    if(state.next_icache == ICACHE_ENTRIES)
-      state.next_icache = 0;
+    state.last_found_icache = victim;
     return 0;
   }
 
@@ -708,10 +1189,184 @@ inline int CAlphaCPU::get_icache(u64 address, u32* data)
     }
   }
 
-  *data = (u32) cSystem->ReadMem(state.pc_phys, 32, this);
+  *data = (u32) cSystem->ReadMem<32>(state.pc_phys, this);
   return 0;
 }
 
+/**
+ * Find the icache line that holds an address, without filling the cache.
+ * Returns -1 if the address is not in the cache.
+ **/
+inline int CAlphaCPU::find_icache(u64 address)
+{
+  u64 v_a = address & ICACHE_MATCH_MASK;
+  int set = ICACHE_SET(v_a);
+
+  for(int i = set; i < set + ICACHE_WAYS; i++)
+  {
+    if(icache[i].valid
+     && (icache[i].asn == state.asn || icache[i].asm_bit)
+     && icache[i].address == v_a)
+      return i;
+  }
+
+  return -1;
+}
+
+/**
+ * Called after a JMP, JSR, RET or JSR_COROUTINE has changed the program
+ * counter. Uses the prediction hint in the instruction to look up the icache
+ * line for the new address in the return address stack (returns) or the
+ * branch target cache (jumps and calls), and leaves it in last_found_icache,
+ * where get_icache looks first. Calls push their return address on the
+ * return address stack.
+ **/
+inline void CAlphaCPU::predict_jump(u32 ins)
+{
+  int hint = (ins >> 14) & 3;
+  int line = -1;
+
+  if(!icache_enabled)
+    return;
+
+  if(hint & 2)
+  {
+
+    // RET or JSR_COROUTINE: pop the return address stack.
+    SReturnAddress*   r = &ras[ras_top];
+    ras_top = (ras_top + RAS_ENTRIES - 1) & (RAS_ENTRIES - 1);
+    if(r->pc == state.pc)
+    {
+#if defined(MIPS_ESTIMATE)
+      ras_hit++;
+#endif
+      line = r->line;
+    }
+#if defined(MIPS_ESTIMATE)
+    else
+      ras_miss++;
+#endif
+  }
+  else
+  {
+
+    // JMP or JSR: look in the branch target cache.
+    SBranchTarget*  b = &btc[(state.current_pc >> 2) & (BTC_ENTRIES - 1)];
+    if(b->from != state.current_pc || b->to != state.pc || b->line < 0)
+    {
+#if defined(MIPS_ESTIMATE)
+      btc_miss++;
+#endif
+      b->from = state.current_pc;
+      b->to = state.pc;
+      b->line = find_icache(state.pc);
+    }
+#if defined(MIPS_ESTIMATE)
+    else
+      btc_hit++;
+#endif
+    line = b->line;
+  }
+
+  if(hint & 1)
+  {
+
+    // JSR or JSR_COROUTINE: push the return address. It is usually in the
+    // same icache line as the call.
+    ras_top = (ras_top + 1) & (RAS_ENTRIES - 1);
+    ras[ras_top].pc = state.current_pc + 4;
+    ras[ras_top].line = state.last_found_icache;
+  }
+
+  if(line >= 0)
+    state.last_found_icache = line;
+}
+
+/**
+ * \brief Read from memory through the software TLB.
+ *
+ * \param virt  Virtual address to read from.
+ * \param size  Number of bits to read (8, 16, 32 or 64).
+ * \param data  Where to return the data read.
+ * \return      true if the software TLB had a translation for the address,
+ *              false if the access should go through virt2phys and ReadMem.
+ **/
+inline bool CAlphaCPU::stlb_read(u64 virt, int size, u64* data)
+{
+  SSoftTLB*   e = &stlb[0][STLB_INDEX(virt)];
+  char*       p;
+
+  if(e->virt != (virt &~STLB_OFFSET_MASK)
+   || e->cm != state.cm
+   || (e->asn != state.asn0 && e->asn != -1)
+   || (virt & STLB_OFFSET_MASK) + (u64) (size / 8) > STLB_PAGE_SIZE)
+    return false;
+
+  p = e->host + (virt & STLB_OFFSET_MASK);
+  switch(size)
+  {
+  case 8:   *data = *((u8*) p); break;
+  case 16:  *data = endian_16(*((u16*) p)); break;
+  case 32:  *data = endian_32(*((u32*) p)); break;
+  default:  *data = endian_64(*((u64*) p));
+  }
+
+#if defined(IDB)
+  last_read_loc = e->phys | (virt & STLB_OFFSET_MASK);
+#endif
+  return true;
+}
+
+/**
+ * \brief Write to memory through the software TLB.
+ *
+ * Writes that could break an LL/SC lock or modify cached instructions
+ * are left to WriteMem.
+ *
+ * \param virt  Virtual address to write to.
+ * \param size  Number of bits to write (8, 16, 32 or 64).
+ * \param data  Data to write.
+ * \return      true if the write was done, false if the access should go
+ *              through virt2phys and WriteMem.
+ **/
+inline bool CAlphaCPU::stlb_write(u64 virt, int size, u64 data)
+{
+  SSoftTLB*   e = &stlb[1][STLB_INDEX(virt)];
+  char*       p;
+
+  if(e->virt != (virt &~STLB_OFFSET_MASK)
+   || e->cm != state.cm
+   || (e->asn != state.asn0 && e->asn != -1)
+   || (virt & STLB_OFFSET_MASK) + (u64) (size / 8) > STLB_PAGE_SIZE
+   || cSystem->is_write_watched(e->phys | (virt & STLB_OFFSET_MASK)))
+    return false;
+
+  p = e->host + (virt & STLB_OFFSET_MASK);
+  switch(size)
+  {
+  case 8:   *((u8*) p) = (u8) data; break;
+  case 16:  *((u16*) p) = endian_16((u16) data); break;
+  case 32:  *((u32*) p) = endian_32((u32) data); break;
+  default:  *((u64*) p) = endian_64((u64) data);
+  }
+
+#if defined(IDB)
+  last_write_loc = e->phys | (virt & STLB_OFFSET_MASK);
+#endif
+  return true;
+}
+
+/**
+ * Get the first entry of the translation buffer set for a virtual address
+ * mapped with a given granularity hint. Each granularity hint hashes a
+ * different part of the address; the part that identifies the page.
+ **/
+inline int CAlphaCPU::tb_set(u64 virt, int gh)
+{
+  u64 vpn = virt >> (13 + 3 * gh);
+  return ((int) (vpn ^ (vpn >> 10) ^ gh) & (state.tb_sets - 1)) * TB_WAYS;
+}
+
 /**
  * Convert a virtual address to va_form format.
  * Used for IPR VA_FORM [HRM 5-5..6] and IPR IVA_FORM [HRM 5-9].
@@ -745,38 +1400,144 @@ inline int CAlphaCPU::get_cpuid()
 
 /**
  * Assert or release an external interrupt line to the cpu.
+ *
+ * This is called from device and other CPU threads, so the CPU state is not
+ * touched here. The request is posted in irq_h_mailbox with an atomic
+ * operation, and applied by irq_h_drain on the CPU's own thread at its next
+ * event check. A release cancels an assertion that is still in the mailbox;
+ * an assertion posted after a release is applied after it.
  **/
 inline void CAlphaCPU::irq_h(int number, bool assert, int delay)
 {
-  bool  active = (state.eir & (U64(0x1) << number))
-  || state.irq_h_timer[number];
-  if(assert && !active)
+  u32 set;
+  u32 clear = 0;
+  u32 old;
+
+  if(!assert)
+  {
+    set = IRQ_H_RELEASE(number);
+    clear = IRQ_H_ASSERT(number) | IRQ_H_DELAYED(number);
+  }
+  else if(delay)
+  {
+    atomic_store_32(&irq_h_delay[number], (u32) delay);
+    set = IRQ_H_DELAYED(number);
+  }
+  else
+    set = IRQ_H_ASSERT(number);
+
+  do
+  {
+    old = irq_h_mailbox;
+  } while(atomic_cas_32(&irq_h_mailbox, old, (old &~clear) | set) != old);
+
+  // ins_to_event belongs to the CPU thread; it notices the mailbox by
+  // itself before the next instruction.
+  if(assert)
+    idle_event.set();
+}
+
+/**
+ * Apply the IRQ_H requests posted by irq_h. Runs on the CPU thread.
+ **/
+inline void CAlphaCPU::irq_h_drain()
+{
+  u32 m = atomic_xchg_32(&irq_h_mailbox, 0);
+
+  for(int i = 0; i < 6; i++)
   {
-    if(delay)
+    if(m & IRQ_H_RELEASE(i))
     {
-      state.irq_h_timer[number] = delay;
-      state.check_timers = true;
+      state.eir &= ~(U64(0x1) << i);
+      state.irq_h_due[i] = 0;
     }
-    else
+
+    if(!(m & (IRQ_H_ASSERT(i) | IRQ_H_DELAYED(i)))
+     || (state.eir & (U64(0x1) << i)) || state.irq_h_due[i])
+      continue;
+
+    if(m & IRQ_H_ASSERT(i))
     {
-      state.eir |= (U64(0x1) << number);
-      state.check_int = true;
+      state.eir |= (U64(0x1) << i);
+      request_int_check();
     }
+    else
+      state.irq_h_due[i] = state.instruction_count + atomic_load_32(&irq_h_delay[i]);
+  }
+
+  state.check_timers = false;
+  for(int i = 0; i < 6; i++)
+  {
+    if(state.irq_h_due[i])
+      state.check_timers = true;
+  }
+}
+
+/**
+ * Something that affects the interrupt state has changed: have the
+ * interrupt state looked at before the next instruction. Runs on the CPU
+ * thread.
+ **/
+inline void CAlphaCPU::request_int_check()
+{
+  state.check_int = true;
+  ins_to_event = 0;
+}
+
+/**
+ * Have the CPU thread work out again when it needs to look at timers and
+ * interrupts, before its next instruction. For other threads, which can't
+ * touch ins_to_event; the request is posted in irq_h_mailbox, where
+ * irq_h_drain clears it without acting on any IRQ_H line.
+ **/
+inline void CAlphaCPU::reschedule_events()
+{
+  u32 old;
+
+  do
+  {
+    old = irq_h_mailbox;
+  } while(atomic_cas_32(&irq_h_mailbox, old, old | IRQ_H_RESCHEDULE) != old);
+}
+
+/**
+ * Determine how many instructions can be executed before the timer
+ * interrupt, a delayed IRQ_H assertion or a possibly pending interrupt
+ * need to be looked at again.
+ **/
+inline void CAlphaCPU::schedule_events()
+{
+  u64 n = CPU_EVENT_MAX;
 
+  if(state.check_int)
+  {
+    ins_to_event = 1;
     return;
   }
 
-  if(!assert && active)
+  if(cc_large >= next_timer_int)
+    n = 1;
+  else if(cc_per_instruction && (next_timer_int - cc_large) / cc_per_instruction < n)
+    n = (next_timer_int - cc_large) / cc_per_instruction + 1;
+
+  if(state.check_timers)
   {
-    state.eir &= ~(U64(0x1) << number);
-    state.irq_h_timer[number] = 0;
-    state.check_timers = false;
     for(int i = 0; i < 6; i++)
     {
-      if(state.irq_h_timer[i])
-        state.check_timers = true;
+      if(!state.irq_h_due[i])
+        continue;
+      if(state.irq_h_due[i] <= state.instruction_count)
+        n = 1;
+      else if(state.irq_h_due[i] - state.instruction_count < n)
+        n = state.irq_h_due[i] - state.instruction_count;
     }
   }
+
+  ins_to_event = (int) n;
+
+  // irq_h may have posted while the count was being worked out.
+  if(atomic_load_32(&irq_h_mailbox))
+    ins_to_event = 1;
 }
 
 /**
@@ -824,6 +1585,17 @@ inline void CAlphaCPU::set_pc(u64 p_pc)
 {
   state.pc = p_pc;
   state.rem_ins_in_page = 0;
+  set_reg_bank();
+}
+
+/**
+ * Select the active register bank. The PALshadow registers are used when
+ * we're in PALmode (determined by the program counter), and the SDE (Shadow
+ * Enable) bit is set. Must be called whenever either of these changes.
+ **/
+inline void CAlphaCPU::set_reg_bank()
+{
+  reg_map = reg_banks[(state.pc & 1) && state.sde];
 }
 
 /**
@@ -833,6 +1605,10 @@ inline void CAlphaCPU::add_pc(u64 a_pc)
 {
   state.pc += a_pc;
   state.rem_ins_in_page = 0;
+
+  // A short backward branch may close an idle loop.
+  if((idle_mode & IDLE_LOOP) && (s64) a_pc < 0 && (s64) a_pc >= -CPU_IDLE_LOOP)
+    idle_loop(state.pc);
 }
 
 /**
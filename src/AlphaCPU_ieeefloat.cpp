@@ -59,6 +59,16 @@
 #include "AlphaCPU.h"
 #include "cpu_debug.h"
 
+#include <float.h>
+#include <math.h>
+
+/* The host FPU is only used if it evaluates expressions in the precision of
+   their type (e.g. SSE2); otherwise (e.g. x87) results are rounded twice. */
+#if defined(FLT_EVAL_METHOD) && (FLT_EVAL_METHOD == 0)
+#define IEEE_HOST_FPU 1
+#include <fenv.h>
+#endif
+
 /***************************************************************************/
 
 /**
@@ -161,6 +171,155 @@
 
 /***************************************************************************/
 
+/**
+ * \name IEEE_fp_host
+ * IEEE floating point host FPU fast path.
+ *
+ * For normal operands, rounding to nearest and normal results, the IEEE
+ * arithmetic of the host gives the same results as the UFP code used by the
+ * operate functions. Those functions try the host FPU first; the UFP code
+ * is used whenever this could make a difference:
+ *   - an operand is zero, denormal, infinite or NaN, or an S-floating
+ *     operand is not exactly representable as an S-floating;
+ *   - the rounding mode is not normal;
+ *   - the result is zero, infinite, or close to underflow;
+ *   - the result is inexact, and the instruction enables inexact traps (/SUI).
+ *   .
+ * That way, all exceptions are still raised by the UFP code.
+ ******************************************************************************/
+
+//\{
+#define HOST_ADD  0
+#define HOST_SUB  1
+#define HOST_MUL  2
+#define HOST_DIV  3
+#define HOST_SQRT 4
+
+#if defined(IEEE_HOST_FPU)
+
+/* Exponent range (register format) of normal S- and T-floatings. */
+static const s32  host_expmin[2] = { T_BIAS - S_BIAS, 0 };
+static const s32  host_expmax[2] = { T_BIAS - S_BIAS + S_M_EXP - 1, T_M_EXP - 1 };
+
+/**
+ * \brief Check if an operand can be used by the host FPU.
+ *
+ * \param op  IEEE floating.
+ * \param dp  DT_S for S-floating or DT_T for T-floating.
+ * \return    true if the operand is a normal number.
+ **/
+static inline bool ieee_host_operand(u64 op, u32 dp)
+{
+  s32 exp = FPR_GETEXP(op);
+
+  if((exp <= host_expmin[dp]) || (exp > host_expmax[dp]))
+    return false;
+  return (dp == DT_T) || !(op & U64(0x000000001FFFFFFF));
+}
+
+/**
+ * \brief Perform an IEEE floating-point operation using the host FPU.
+ *
+ * \param op    HOST_ADD, HOST_SUB, HOST_MUL, HOST_DIV or HOST_SQRT.
+ * \param s1    First operand (ignored for HOST_SQRT).
+ * \param s2    Second operand.
+ * \param ins   The instruction currently being executed. Used to determine
+ *              the rounding mode and trap qualifiers.
+ * \param fpcr  Floating-point control register.
+ * \param dp    DT_S for S-floating or DT_T for T-floating.
+ * \param res   Receives the result.
+ * \return      true if the result can be used, false if the operation needs
+ *              to be done by the UFP code.
+ **/
+static bool ieee_host_op(int op, u64 s1, u64 s2, u32 ins, u64 fpcr, u32 dp, u64* res)
+{
+  u32   rndm = I_GETFRND(ins);
+  bool  exact = Q_SUI(ins);
+  s32   exp;
+
+  if(rndm == I_FRND_D)
+    rndm = (u32) FPCR_GETFRND(fpcr);
+  if(rndm != I_FRND_N)
+    return false;
+  if(!ieee_host_operand(s2, dp))
+    return false;
+  if(op == HOST_SQRT ? FPR_GETSIGN(s2) : !ieee_host_operand(s1, dp))
+    return false;
+
+#if defined(FE_INEXACT)
+  if(exact)
+    feclearexcept(FE_INEXACT);
+#else
+  if(exact)
+    return false;
+#endif
+  if(dp == DT_T)
+  {
+    double          a;
+    double          b;
+    volatile double r;
+    double          rr;
+
+    memcpy(&a, &s1, sizeof(a));
+    memcpy(&b, &s2, sizeof(b));
+    switch(op)
+    {
+    case HOST_ADD:  r = a + b; break;
+    case HOST_SUB:  r = a - b; break;
+    case HOST_MUL:  r = a * b; break;
+    case HOST_DIV:  r = a / b; break;
+    default:        r = sqrt(b); break;
+    }
+
+    rr = r;
+    memcpy(res, &rr, sizeof(rr));
+  }
+  else
+  {
+    double          d;
+    float           a;
+    float           b;
+    volatile float  r;
+    double          rr;
+
+    memcpy(&d, &s1, sizeof(d));
+    a = (float) d;
+    memcpy(&d, &s2, sizeof(d));
+    b = (float) d;
+    switch(op)
+    {
+    case HOST_ADD:  r = a + b; break;
+    case HOST_SUB:  r = a - b; break;
+    case HOST_MUL:  r = a * b; break;
+    case HOST_DIV:  r = a / b; break;
+    default:        r = sqrtf(b); break;
+    }
+
+    rr = (double) r;
+    memcpy(res, &rr, sizeof(rr));
+  }
+
+#if defined(FE_INEXACT)
+  if(exact && fetestexcept(FE_INEXACT))
+    return false;
+#endif
+
+  // The UFP code rounds before checking for underflow, the host checks the
+  // other way around; leave results with the lowest normal exponent to UFP.
+  exp = FPR_GETEXP(*res);
+  return (exp > host_expmin[dp] + 1) && (exp <= host_expmax[dp]);
+}
+#else
+static inline bool ieee_host_op(int op, u64 s1, u64 s2, u32 ins, u64 fpcr, u32 dp, u64* res)
+{
+  return false;
+}
+#endif
+
+//\}
+
+/***************************************************************************/
+
 /**
  * \name IEEE_fp_load_store
  * IEEE floating point load and store functions.
@@ -474,6 +633,8 @@ u64 CAlphaCPU::ieee_fadd(u64 s1, u64 s2, u32 ins, u32 dp, bool sub)
   u32 sticky;
   s32 ediff;
 
+  FP_HOST_TRY(ieee_host_op(sub ? HOST_SUB : HOST_ADD, s1, s2, ins, state.fpcr, dp, &hres));
+
   ftpa = ieee_unpack(s1, &a, ins);  /* unpack operands */
   ftpb = ieee_unpack(s2, &b, ins);
   if(ftpb == UFT_NAN)
@@ -533,7 +694,7 @@ u64 CAlphaCPU::ieee_fadd(u64 s1, u64 s2, u32 ins, u32 dp, bool sub)
     } /* skip norm */
   }   /* end else if */
 
-  return ieee_rpack(&a, ins, dp); /* round and pack */
+  return FP_HOST_RESULT("ieee_fadd", ieee_rpack(&a, ins, dp), s1, s2); /* round and pack */
 }
 
 /**
@@ -569,6 +730,8 @@ u64 CAlphaCPU::ieee_fmul(u64 s1, u64 s2, u32 ins, u32 dp)
   u32 ftpb;
   u64 resl;
 
+  FP_HOST_TRY(ieee_host_op(HOST_MUL, s1, s2, ins, state.fpcr, dp, &hres));
+
   ftpa = ieee_unpack(s1, &a, ins);  /* unpack operands */
   ftpb = ieee_unpack(s2, &b, ins);
   if(ftpb == UFT_NAN)
@@ -595,7 +758,7 @@ u64 CAlphaCPU::ieee_fmul(u64 s1, u64 s2, u32 ins, u32 dp)
   resl = uemul64(a.frac, b.frac, &a.frac);  /* multiply fracs */
   ieee_norm(&a);  /* normalize */
   a.frac = a.frac | (resl ? 1 : 0); /* sticky bit */
-  return ieee_rpack(&a, ins, dp);   /* round and pack */
+  return FP_HOST_RESULT("ieee_fmul", ieee_rpack(&a, ins, dp), s1, s2);   /* round and pack */
 }
 
 /**
@@ -628,6 +791,8 @@ u64 CAlphaCPU::ieee_fdiv(u64 s1, u64 s2, u32 ins, u32 dp)
   u32 ftpb;
   u32 sticky;
 
+  FP_HOST_TRY(ieee_host_op(HOST_DIV, s1, s2, ins, state.fpcr, dp, &hres));
+
   ftpa = ieee_unpack(s1, &a, ins);
   ftpb = ieee_unpack(s2, &b, ins);
   if(ftpb == UFT_NAN)
@@ -673,7 +838,7 @@ u64 CAlphaCPU::ieee_fdiv(u64 s1, u64 s2, u32 ins, u32 dp)
   a.frac = ufdiv64(a.frac, b.frac, 55, &sticky);  /* divide */
   ieee_norm(&a);            /* normalize */
   a.frac = a.frac | sticky; /* insert sticky */
-  return ieee_rpack(&a, ins, dp); /* round and pack */
+  return FP_HOST_RESULT("ieee_fdiv", ieee_rpack(&a, ins, dp), s1, s2); /* round and pack */
 }
 
 /**
@@ -697,6 +862,8 @@ u64 CAlphaCPU::ieee_sqrt(u64 op, u32 ins, u32 dp)
   u32 ftpb;
   UFP b;
 
+  FP_HOST_TRY(ieee_host_op(HOST_SQRT, 0, op, ins, state.fpcr, dp, &hres));
+
   ftpb = ieee_unpack(op, &b, ins);  /* unpack */
   if(ftpb == UFT_NAN)
     return op | QNAN; /* NaN? */
@@ -708,9 +875,9 @@ u64 CAlphaCPU::ieee_sqrt(u64 op, u32 ins, u32 dp)
     return CQNAN;
   }
 
-  b.exp = ((b.exp - T_BIAS) >> 1) + T_BIAS; /* result exponent */
   b.frac = fsqrt64(b.frac, b.exp);          /* result fraction */
-  return ieee_rpack(&b, ins, dp);           /* round and pack */
+  b.exp = ((b.exp - T_BIAS) >> 1) + T_BIAS; /* result exponent */
+  return FP_HOST_RESULT("ieee_sqrt", ieee_rpack(&b, ins, dp), 0, op); /* round and pack */
 }
 
 //\}
@@ -848,6 +1015,7 @@ u64 CAlphaCPU::ieee_rpack(UFP* r, u32 ins, u32 dp)
   static const u64  infrnd[2] = { UF_SINF, UF_TINF };
   static const s32  expmax[2] = { T_BIAS - S_BIAS + S_M_EXP - 1, T_M_EXP - 1};
   static const s32  expmin[2] = { T_BIAS - S_BIAS, 0};
+  static const u64  lsb[2] = { U64(0x0000000020000000), U64(0x0000000000000001) };
   u64               rndadd;
   u64               rndbits;
   u64               res;
@@ -893,9 +1061,10 @@ u64 CAlphaCPU::ieee_rpack(UFP* r, u32 ins, u32 dp)
   } /* underflow to +0 */
 
   res = (((u64) r->sign) << FPR_V_SIGN) |           /* form result */
-  (((u64) r->exp) << FPR_V_EXP) | ((r->frac >> FPR_GUARD) & FPR_FRAC);
+  (((u64) r->exp) << FPR_V_EXP) |
+  ((r->frac >> FPR_GUARD) & FPR_FRAC &~(lsb[dp] - 1)); /* drop round bits */
   if((rndm == I_FRND_N) && (rndbits == stdrnd[dp])) /* nearest and halfway? */
-    res = res &~1;  /* clear lo bit */
+    res = res &~lsb[dp];  /* clear lo bit */
   return res;
 }
 
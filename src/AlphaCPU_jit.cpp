@@ -0,0 +1,1095 @@
+/* ES40 emulator.
+ * Copyright (C) 2007-2008 by the ES40 Emulator Project
+ *
+ * WWW    : http://sourceforge.net/projects/es40
+ * E-mail : camiel@camicom.com
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Although this is not required, the author would appreciate being notified of,
+ * and receiving any modifications you may make to the source code that might serve
+ * the general public.
+ */
+
+/**
+ * \file
+ * Contains the translator that turns hot blocks of predecoded instructions
+ * into x86-64 host code for the emulated DecChip 21264CB EV68 Alpha
+ * processor.
+ *
+ * Blocks start where execution arrives at an instruction other than by
+ * falling through, and are counted in CAlphaCPU::jit_run. A block that was
+ * entered JIT_HOT times is translated up to the first instruction the
+ * translator doesn't handle; PALcode, IPR accesses and everything that can
+ * trap (except memory accesses) are left to the interpreter. Integer
+ * registers used by the block are kept in host registers while it runs.
+ * Loads and stores go through the software TLB; when that misses, the
+ * block exits, and the interpreter runs the instruction.
+ *
+ * $Id$
+ **/
+#include "StdAfx.h"
+#include "AlphaCPU.h"
+#include "cpu_debug.h"
+
+#if defined(CPU_JIT)
+#include <sys/mman.h>
+
+/// Host registers
+#define HR_AX 0
+#define HR_CX 1
+#define HR_DX 2
+#define HR_BX 3
+#define HR_SP 4
+#define HR_BP 5
+#define HR_SI 6
+#define HR_DI 7
+
+/// Host registers that guest registers are kept in
+static const int  jit_host_regs[] = { 3, 5, 12, 13, 14, 15, 8, 9, 10, 11 };
+#define JIT_HOST_REGS 10
+
+/// Callee-saved host registers; pushed and popped by every block
+static const int  jit_saved_regs[] = { 3, 5, 12, 13, 14, 15 };
+#define JIT_SAVED_REGS  6
+
+/// x86 condition codes
+#define CC_B  0x2
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_BE 0x6
+#define CC_A  0x7
+#define CC_S  0x8
+#define CC_NS 0x9
+#define CC_L  0xc
+#define CC_GE 0xd
+#define CC_LE 0xe
+#define CC_G  0xf
+
+/// x86 ALU opcodes (op r/m, r); opcode >> 3 is the /digit for immediates
+#define ALU_ADD 0x01
+#define ALU_OR  0x09
+#define ALU_AND 0x21
+#define ALU_SUB 0x29
+#define ALU_XOR 0x31
+#define ALU_CMP 0x39
+
+/// x86 shift /digits
+#define SH_SHL  4
+#define SH_SHR  5
+#define SH_SAR  7
+
+/// Maximum number of side exits in one block
+#define JIT_EXITS (JIT_BLOCK_MAX * 8)
+
+/**
+ * \brief x86-64 code emitter for one block.
+ **/
+class CJitAsm
+{
+  public:
+    CJitAsm(u8* code)
+    {
+      p = code;
+      exits = 0;
+      dirty = 0;
+      for(int i = 0; i < 32; i++)
+        host[i] = -1;
+    }
+
+    u8*   p;              /**< Where the next byte goes */
+    int   host[32];       /**< Host register holding each guest register, or -1 */
+    u32   dirty;          /**< Guest registers written so far */
+
+    /// Side exit to be filled in: a rel32 at pos, out of instruction k
+    struct
+    {
+      u8*   pos;
+      int   k;
+      u32   dirty;
+    } exit[JIT_EXITS];
+    int   exits;
+
+    void  b(u8 v)   { *p++ = v; }
+    void  d(u32 v)  { memcpy(p, &v, 4); p += 4; }
+    void  q(u64 v)  { memcpy(p, &v, 8); p += 8; }
+
+    /// REX prefix; emitted if needed, or always if force is set (byte registers)
+    void rex(int w, int reg, int index, int base, bool force = false)
+    {
+      u8  r = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+      if(r != 0x40 || force)
+        b(r);
+    }
+
+    /// op reg, rm (register to register)
+    void rr(int w, u8 op, int reg, int rm)
+    {
+      rex(w, reg, 0, rm);
+      b(op);
+      b(0xc0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    /// 0x0f op reg, rm (register to register)
+    void rr2(int w, u8 op, int reg, int rm, bool force = false)
+    {
+      rex(w, reg, 0, rm, force);
+      b(0x0f);
+      b(op);
+      b(0xc0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    /// op reg, [base + disp32]
+    void mem(int w, u8 op, int reg, int base, s32 disp)
+    {
+      rex(w, reg, 0, base);
+      b(op);
+      b(0x80 | ((reg & 7) << 3) | (base & 7));
+      if((base & 7) == HR_SP)
+        b(0x24);
+      d((u32) disp);
+    }
+
+    /// op reg, [base + index]; base must not be rbp or r13
+    void memx(int w, u8 op, int reg, int base, int index, bool force = false)
+    {
+      rex(w, reg, index, base, force);
+      b(op);
+      b(0x04 | ((reg & 7) << 3));
+      b(((index & 7) << 3) | (base & 7));
+    }
+
+    /// 0x0f op reg, [base + index]; base must not be rbp or r13
+    void memx2(int w, u8 op, int reg, int base, int index)
+    {
+      rex(w, reg, index, base);
+      b(0x0f);
+      b(op);
+      b(0x04 | ((reg & 7) << 3));
+      b(((index & 7) << 3) | (base & 7));
+    }
+
+    /// ALU operation with a sign-extended immediate
+    void alu_i(int w, u8 op, int rm, s32 imm)
+    {
+      int digit = op >> 3;
+      rex(w, 0, 0, rm);
+      if(imm >= -128 && imm <= 127)
+      {
+        b(0x83);
+        b(0xc0 | (digit << 3) | (rm & 7));
+        b((u8) imm);
+      }
+      else
+      {
+        b(0x81);
+        b(0xc0 | (digit << 3) | (rm & 7));
+        d((u32) imm);
+      }
+    }
+
+    /// ALU operation register to register
+    void alu(int w, u8 op, int rm, int reg)
+    {
+      rr(w, op, reg, rm);
+    }
+
+    void shift_i(int digit, int rm, int n)
+    {
+      rex(1, 0, 0, rm);
+      b(0xc1);
+      b(0xc0 | (digit << 3) | (rm & 7));
+      b((u8) n);
+    }
+
+    void shift_i32(int digit, int rm, int n)
+    {
+      rex(0, 0, 0, rm);
+      b(0xc1);
+      b(0xc0 | (digit << 3) | (rm & 7));
+      b((u8) n);
+    }
+
+    void shift_cl(int digit, int rm)
+    {
+      rex(1, 0, 0, rm);
+      b(0xd3);
+      b(0xc0 | (digit << 3) | (rm & 7));
+    }
+
+    void not64(int rm)
+    {
+      rex(1, 0, 0, rm);
+      b(0xf7);
+      b(0xd0 | (rm & 7));
+    }
+
+    void mov(int dst, int src)  { rr(1, 0x89, src, dst); }
+
+    void mov_i(int dst, u64 v)
+    {
+      if(v <= U64(0xffffffff))
+      {
+        rex(0, 0, 0, dst);
+        b(0xb8 | (dst & 7));
+        d((u32) v);
+      }
+      else if((s64) v == (s64) (s32) v)
+      {
+        rex(1, 0, 0, dst);
+        b(0xc7);
+        b(0xc0 | (dst & 7));
+        d((u32) v);
+      }
+      else
+      {
+        rex(1, 0, 0, dst);
+        b(0xb8 | (dst & 7));
+        q(v);
+      }
+    }
+
+    void zero(int dst)          { rr(0, 0x31, dst, dst); }
+    void sext32(int r)          { rr(1, 0x63, r, r); }
+    void zext32(int r)          { rr(0, 0x89, r, r); }
+    void push(int r)            { rex(0, 0, 0, r); b(0x50 | (r & 7)); }
+    void pop(int r)             { rex(0, 0, 0, r); b(0x58 | (r & 7)); }
+
+    /// setcc al; movzx eax, al
+    void set_cc(int cc)
+    {
+      rr2(0, 0x90 | cc, 0, HR_AX);
+      rr2(0, 0xb6, HR_AX, HR_AX);
+    }
+
+    /// Conditional jump to a side exit out of instruction k
+    void exit_cc(int cc, int k)
+    {
+      b(0x0f);
+      b(0x80 | cc);
+      exit[exits].pos = p;
+      exit[exits].k = k;
+      exit[exits].dirty = dirty;
+      exits++;
+      d(0);
+    }
+
+    /// Conditional short jump forward; returns the byte to patch
+    u8*   jcc8(int cc)
+    {
+      b(0x70 | cc);
+      b(0);
+      return p - 1;
+    }
+
+    void  patch8(u8* pos)       { *pos = (u8) (p - pos - 1); }
+
+    /// Load a guest register into a host register
+    void get(int r, int g)
+    {
+      if(g == 31)
+        zero(r);
+      else
+        mov(r, host[g]);
+    }
+
+    /// Store a host register into a guest register
+    void put(int g, int r)
+    {
+      if(g == 31)
+        return;
+      mov(host[g], r);
+      dirty |= (1U << g);
+    }
+
+    /// Load operand b (register or 8-bit literal) into a host register
+    void get_b(int r, u32 ins, int g)
+    {
+      if(ins & 0x1000)
+        mov_i(r, (ins >> 13) & 0xff);
+      else
+        get(r, g);
+    }
+
+    /// Write back the guest registers in mask, and leave with eax
+    void epilogue(u32 mask)
+    {
+      for(int g = 0; g < 31; g++)
+        if((mask >> g) & 1)
+          mem(1, 0x89, host[g], HR_DI, g * 8);
+      for(int i = JIT_SAVED_REGS - 1; i >= 0; i--)
+        pop(jit_saved_regs[i]);
+      b(0xc3);
+    }
+};
+
+/**
+ * Guest registers an instruction uses (other than r31), or -1 if the
+ * translator doesn't handle the instruction.
+ **/
+static s64 jit_regs(SDecoded* d, u32 ins)
+{
+  u32   r = 0;
+
+  switch(d->op)
+  {
+  case OPC_ADDL:
+  case OPC_S4ADDL:
+  case OPC_S8ADDL:
+  case OPC_SUBL:
+  case OPC_S4SUBL:
+  case OPC_S8SUBL:
+  case OPC_ADDQ:
+  case OPC_S4ADDQ:
+  case OPC_S8ADDQ:
+  case OPC_SUBQ:
+  case OPC_S4SUBQ:
+  case OPC_S8SUBQ:
+  case OPC_CMPEQ:
+  case OPC_CMPLT:
+  case OPC_CMPLE:
+  case OPC_CMPULT:
+  case OPC_CMPULE:
+  case OPC_AND:
+  case OPC_BIC:
+  case OPC_BIS:
+  case OPC_ORNOT:
+  case OPC_XOR:
+  case OPC_EQV:
+  case OPC_SLL:
+  case OPC_SRL:
+  case OPC_SRA:
+  case OPC_CMOVEQ:
+  case OPC_CMOVNE:
+  case OPC_CMOVLT:
+  case OPC_CMOVGE:
+  case OPC_CMOVLE:
+  case OPC_CMOVGT:
+  case OPC_CMOVLBS:
+  case OPC_CMOVLBC:
+  case OPC_MULL:
+  case OPC_MULQ:
+  case OPC_UMULH:
+  case OPC_SEXTB:
+  case OPC_SEXTW:
+  case OPC_EXTBL:
+  case OPC_EXTWL:
+  case OPC_EXTLL:
+  case OPC_EXTQL:
+  case OPC_INSBL:
+  case OPC_INSWL:
+  case OPC_INSLL:
+  case OPC_INSQL:
+  case OPC_MSKBL:
+  case OPC_MSKWL:
+  case OPC_MSKLL:
+  case OPC_MSKQL:
+    r = (1U << d->ra) | (1U << d->rc);
+    if(!(ins & 0x1000))
+      r |= (1U << d->rb);
+    break;
+
+  case OPC_ZAP:
+  case OPC_ZAPNOT:
+    if(!(ins & 0x1000))
+      return -1;
+    r = (1U << d->ra) | (1U << d->rc);
+    break;
+
+  case OPC_LDBU:
+  case OPC_LDWU:
+  case OPC_LDL:
+  case OPC_LDQ:
+  case OPC_LDQ_U:
+
+    // A load into r31 is a prefetch; leave it to the interpreter
+    if(d->ra == 31)
+      return -1;
+
+  case OPC_LDA:
+  case OPC_LDAH:
+  case OPC_STB:
+  case OPC_STW:
+  case OPC_STL:
+  case OPC_STQ:
+  case OPC_STQ_U:
+    r = (1U << d->ra) | (1U << d->rb);
+    break;
+
+  case OPC_BR:
+  case OPC_BSR:
+  case OPC_BEQ:
+  case OPC_BNE:
+  case OPC_BLT:
+  case OPC_BGE:
+  case OPC_BLE:
+  case OPC_BGT:
+  case OPC_BLBC:
+  case OPC_BLBS:
+    r = (1U << d->ra);
+    break;
+
+  default:
+    return -1;
+  }
+
+  return r & 0x7fffffff;
+}
+
+/**
+ * Set up the host code buffer and the table of blocks, if the "jit"
+ * configuration option is set.
+ **/
+void CAlphaCPU::jit_init()
+{
+  memset(decoded_gen, 0, sizeof(decoded_gen));
+  jit_enabled = myCfg->get_bool_value("jit", false) && icache_enabled && block_enabled;
+  if(!jit_enabled)
+    return;
+
+  jit_code = (u8*) mmap(0, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(jit_code == (u8*) MAP_FAILED)
+  {
+    printf("%s: no executable memory for the jit; it is disabled.\n", devid_string);
+    jit_code = 0;
+    jit_enabled = false;
+    return;
+  }
+
+  jit_blocks = new SJitBlock[JIT_BLOCKS];
+  memset(jit_blocks, 0xff, JIT_BLOCKS * sizeof(SJitBlock));
+  jit_used = 0;
+}
+
+/**
+ * Free the host code buffer and the table of blocks.
+ **/
+void CAlphaCPU::jit_exit()
+{
+  if(jit_code)
+    munmap(jit_code, JIT_CODE_SIZE);
+  delete[] jit_blocks;
+  jit_code = 0;
+  jit_blocks = 0;
+}
+
+/**
+ * \brief Run the translated block that starts at state.pc, if there is one.
+ *
+ * Called where a block of instructions starts: when execute_mode fetched
+ * an instruction, or block execution arrived at one by a branch. Counts the
+ * times the block is entered, translates it once it is hot, and runs it if
+ * there's time for all of it before the next event.
+ *
+ * \param line    Icache line holding state.pc; it is valid and predecoded.
+ * \param counted True if the first instruction was already counted (in
+ *                state.instruction_count, state.cc and ins_to_event).
+ * \return        True if at least one instruction was run.
+ **/
+bool CAlphaCPU::jit_run(int line, bool counted)
+{
+  int         slot = (int) (state.pc >> 2) & ICACHE_INDEX_MASK;
+  u32         key = line * ICACHE_LINE_SIZE + slot;
+  SJitBlock*  b = &jit_blocks[(key * 2654435761U) >> 20];
+
+  if(b->key != key || b->gen != decoded_gen[line])
+  {
+    b->key = key;
+    b->gen = decoded_gen[line];
+    b->count = 0;
+    b->code = 0;
+  }
+
+  if(!b->code)
+  {
+    if(b->count == JIT_NEVER || ++b->count < JIT_HOT)
+      return false;
+    jit_translate(line, slot, b);
+    if(!b->code)
+      return false;
+  }
+
+  if(ins_to_event <= b->n)
+    return false;
+
+  u32 result = b->code(state.r);
+  u32 k = result & 0xffff;
+  if(!k)
+    return false;
+
+  u32 counts = counted ? k - 1 : k;
+  state.instruction_count += counts;
+  cc_large += counts * cc_per_instruction;
+  if(state.cc_ena)
+    state.cc += counts * cc_per_instruction;
+  ins_to_event -= counts;
+
+  state.current_pc = state.pc + 4 * (k - 1);
+  state.pc += 4 * k;
+  state.pc_phys += 4 * k;
+  state.rem_ins_in_page = (state.rem_ins_in_page > k) ? state.rem_ins_in_page - k : 0;
+  if(result & 0x10000)
+    add_pc(b->disp);
+  return true;
+}
+
+/**
+ * \brief Translate a block into host code.
+ *
+ * The block starts at a slot of an icache line, and runs until the first
+ * instruction that isn't translated, the first branch (which is included),
+ * the end of the line, JIT_BLOCK_MAX instructions, or the point where more
+ * guest registers are used than there are host registers for them. Sets
+ * b->code, or b->count to JIT_NEVER if the block is too short to bother.
+ **/
+void CAlphaCPU::jit_translate(int line, int slot, SJitBlock* b)
+{
+  int   n;
+  u32   used = 0;
+  int   nregs = 0;
+
+  // Find the length of the block, and the registers it uses.
+  for(n = 0; n < JIT_BLOCK_MAX && slot + n < ICACHE_LINE_SIZE; n++)
+  {
+    SDecoded*   d = &decoded[line][slot + n];
+    u32         ins = endian_32(icache[line].data[slot + n]);
+    if(d->op == OPC_UNDECODED)
+      decode(ins, d);
+
+    s64 regs = jit_regs(d, ins);
+    if(regs < 0)
+      break;
+
+    int add = 0;
+    for(int g = 0; g < 31; g++)
+      if(((regs &~used) >> g) & 1)
+        add++;
+    if(nregs + add > JIT_HOST_REGS)
+      break;
+    used |= (u32) regs;
+    nregs += add;
+
+    // Of the instructions translated, only the branches come after BR.
+    if(d->op >= OPC_BR)
+    {
+      n++;
+      break;
+    }
+  }
+
+  if(n < JIT_BLOCK_MIN || (icache[line].address & 1))
+  {
+    b->count = JIT_NEVER;
+    return;
+  }
+
+  if(jit_used + JIT_CODE_MAX > JIT_CODE_SIZE)
+  {
+
+    // Out of code space; start over.
+    memset(jit_blocks, 0xff, JIT_BLOCKS * sizeof(SJitBlock));
+    jit_used = 0;
+    b->key = line * ICACHE_LINE_SIZE + slot;
+    b->gen = decoded_gen[line];
+    b->count = JIT_HOT;
+  }
+
+  CJitAsm*  a = new CJitAsm(jit_code + jit_used);
+  u8*       start = a->p;
+  u64       pc = icache[line].address + slot * 4;
+  u64       disp = 0;
+  bool      ended = false;
+  int       k;
+  int       h = 0;
+
+  for(int g = 0; g < 31; g++)
+    if((used >> g) & 1)
+      a->host[g] = jit_host_regs[h++];
+
+  // Prologue: save the callee-saved registers, and load the guest registers.
+  for(int i = 0; i < JIT_SAVED_REGS; i++)
+    a->push(jit_saved_regs[i]);
+  for(int g = 0; g < 31; g++)
+    if((used >> g) & 1)
+      a->mem(1, 0x8b, a->host[g], HR_DI, g * 8);
+
+  for(k = 0; k < n; k++)
+  {
+    SDecoded*   d = &decoded[line][slot + k];
+    u32         ins = endian_32(icache[line].data[slot + k]);
+    int         op = d->op;
+    int         ra = d->ra;
+    int         rb = d->rb;
+    int         rc = d->rc;
+    int         size = 64;
+    bool        memory = true;
+    bool        store = false;
+    bool        align = false;
+
+    switch(op)
+    {
+    case OPC_STB:
+      store = true;
+    case OPC_LDBU:
+      size = 8;
+      break;
+
+    case OPC_STW:
+      store = true;
+    case OPC_LDWU:
+      size = 16;
+      break;
+
+    case OPC_STL:
+      store = true;
+    case OPC_LDL:
+      size = 32;
+      break;
+
+    case OPC_STQ_U:
+      store = true;
+    case OPC_LDQ_U:
+      align = true;
+      break;
+
+    case OPC_STQ:
+      store = true;
+    case OPC_LDQ:
+      break;
+
+    default:
+      memory = false;
+    }
+
+    switch(memory ? -1 : op)
+    {
+    case -1:
+      break;
+
+    case OPC_LDA:
+    case OPC_LDAH:
+      {
+        s64 disp16 = (s64) sext_u64_16(ins);
+        if(op == OPC_LDAH)
+          disp16 *= 65536;
+        if(rb == 31)
+          a->mov_i(HR_AX, (u64) disp16);
+        else
+        {
+          a->get(HR_AX, rb);
+          a->alu_i(1, ALU_ADD, HR_AX, (s32) disp16);
+        }
+
+        a->put(ra, HR_AX);
+      }
+      break;
+
+    case OPC_ADDQ:
+    case OPC_ADDL:
+    case OPC_S4ADDQ:
+    case OPC_S4ADDL:
+    case OPC_S8ADDQ:
+    case OPC_S8ADDL:
+    case OPC_SUBQ:
+    case OPC_SUBL:
+    case OPC_S4SUBQ:
+    case OPC_S4SUBL:
+    case OPC_S8SUBQ:
+    case OPC_S8SUBL:
+      a->get(HR_AX, ra);
+      if(op == OPC_S4ADDQ || op == OPC_S4ADDL || op == OPC_S4SUBQ || op == OPC_S4SUBL)
+        a->shift_i(SH_SHL, HR_AX, 2);
+      if(op == OPC_S8ADDQ || op == OPC_S8ADDL || op == OPC_S8SUBQ || op == OPC_S8SUBL)
+        a->shift_i(SH_SHL, HR_AX, 3);
+      a->get_b(HR_CX, ins, rb);
+      if(op == OPC_ADDQ || op == OPC_ADDL || op == OPC_S4ADDQ || op == OPC_S4ADDL
+       || op == OPC_S8ADDQ || op == OPC_S8ADDL)
+        a->alu(1, ALU_ADD, HR_AX, HR_CX);
+      else
+        a->alu(1, ALU_SUB, HR_AX, HR_CX);
+      if(op == OPC_ADDL || op == OPC_S4ADDL || op == OPC_S8ADDL || op == OPC_SUBL
+       || op == OPC_S4SUBL || op == OPC_S8SUBL)
+        a->sext32(HR_AX);
+      a->put(rc, HR_AX);
+      break;
+
+    case OPC_CMPEQ:
+    case OPC_CMPLT:
+    case OPC_CMPLE:
+    case OPC_CMPULT:
+    case OPC_CMPULE:
+      a->get(HR_AX, ra);
+      a->get_b(HR_CX, ins, rb);
+      a->alu(1, ALU_CMP, HR_AX, HR_CX);
+      switch(op)
+      {
+      case OPC_CMPEQ:   a->set_cc(CC_E); break;
+      case OPC_CMPLT:   a->set_cc(CC_L); break;
+      case OPC_CMPLE:   a->set_cc(CC_LE); break;
+      case OPC_CMPULT:  a->set_cc(CC_B); break;
+      default:          a->set_cc(CC_BE);
+      }
+
+      a->put(rc, HR_AX);
+      break;
+
+    case OPC_AND:
+    case OPC_BIC:
+    case OPC_BIS:
+    case OPC_ORNOT:
+    case OPC_XOR:
+    case OPC_EQV:
+      a->get(HR_AX, ra);
+      a->get_b(HR_CX, ins, rb);
+      if(op == OPC_BIC || op == OPC_ORNOT || op == OPC_EQV)
+        a->not64(HR_CX);
+      if(op == OPC_AND || op == OPC_BIC)
+        a->alu(1, ALU_AND, HR_AX, HR_CX);
+      else if(op == OPC_BIS || op == OPC_ORNOT)
+        a->alu(1, ALU_OR, HR_AX, HR_CX);
+      else
+        a->alu(1, ALU_XOR, HR_AX, HR_CX);
+      a->put(rc, HR_AX);
+      break;
+
+    case OPC_SLL:
+    case OPC_SRL:
+    case OPC_SRA:
+
+      // x86 masks the shift count to 6 bits, like the Alpha.
+      a->get(HR_AX, ra);
+      a->get_b(HR_CX, ins, rb);
+      a->shift_cl((op == OPC_SLL) ? SH_SHL : (op == OPC_SRL) ? SH_SHR : SH_SAR, HR_AX);
+      a->put(rc, HR_AX);
+      break;
+
+    case OPC_CMOVEQ:
+    case OPC_CMOVNE:
+    case OPC_CMOVLT:
+    case OPC_CMOVGE:
+    case OPC_CMOVLE:
+    case OPC_CMOVGT:
+    case OPC_CMOVLBS:
+    case OPC_CMOVLBC:
+      if(rc == 31)
+        break;
+      a->get(HR_AX, ra);
+      a->get_b(HR_CX, ins, rb);
+      if(op == OPC_CMOVLBS || op == OPC_CMOVLBC)
+      {
+        a->b(0xa8);   // test al, 1
+        a->b(0x01);
+      }
+      else
+        a->rr(1, 0x85, HR_AX, HR_AX);
+      {
+        int cc;
+        switch(op)
+        {
+        case OPC_CMOVEQ:  cc = CC_E; break;
+        case OPC_CMOVNE:  cc = CC_NE; break;
+        case OPC_CMOVLT:  cc = CC_S; break;
+        case OPC_CMOVGE:  cc = CC_NS; break;
+        case OPC_CMOVLE:  cc = CC_LE; break;
+        case OPC_CMOVGT:  cc = CC_G; break;
+        case OPC_CMOVLBS: cc = CC_NE; break;
+        default:          cc = CC_E;
+        }
+
+        a->rr2(1, 0x40 | cc, a->host[rc], HR_CX);
+        a->dirty |= (1U << rc);
+      }
+      break;
+
+    case OPC_MULQ:
+    case OPC_MULL:
+      a->get(HR_AX, ra);
+      a->get_b(HR_CX, ins, rb);
+      a->rr2(1, 0xaf, HR_AX, HR_CX);
+      if(op == OPC_MULL)
+        a->sext32(HR_AX);
+      a->put(rc, HR_AX);
+      break;
+
+    case OPC_UMULH:
+      a->get(HR_AX, ra);
+      a->get_b(HR_CX, ins, rb);
+      a->rex(1, 0, 0, HR_CX);   // mul rcx
+      a->b(0xf7);
+      a->b(0xe0 | HR_CX);
+      a->put(rc, HR_DX);
+      break;
+
+    case OPC_SEXTB:
+    case OPC_SEXTW:
+      a->get_b(HR_CX, ins, rb);
+      a->rr2(1, (op == OPC_SEXTB) ? 0xbe : 0xbf, HR_AX, HR_CX);
+      a->put(rc, HR_AX);
+      break;
+
+    case OPC_ZAP:
+    case OPC_ZAPNOT:
+      {
+        u64 mask = bytemask64((ins >> 13) & 0xff);
+        a->get(HR_AX, ra);
+        a->mov_i(HR_CX, (op == OPC_ZAP) ? ~mask : mask);
+        a->alu(1, ALU_AND, HR_AX, HR_CX);
+        a->put(rc, HR_AX);
+      }
+      break;
+
+    case OPC_EXTBL:
+    case OPC_EXTWL:
+    case OPC_EXTLL:
+    case OPC_EXTQL:
+    case OPC_INSBL:
+    case OPC_INSWL:
+    case OPC_INSLL:
+    case OPC_INSQL:
+    case OPC_MSKBL:
+    case OPC_MSKWL:
+    case OPC_MSKLL:
+    case OPC_MSKQL:
+      {
+        int width;
+        switch(op)
+        {
+        case OPC_EXTBL: case OPC_INSBL: case OPC_MSKBL: width = 8; break;
+        case OPC_EXTWL: case OPC_INSWL: case OPC_MSKWL: width = 16; break;
+        case OPC_EXTLL: case OPC_INSLL: case OPC_MSKLL: width = 32; break;
+        default:        width = 64;
+        }
+
+        a->get(HR_AX, ra);
+        a->get_b(HR_CX, ins, rb);
+        a->alu_i(0, ALU_AND, HR_CX, 7);
+        a->shift_i32(SH_SHL, HR_CX, 3);
+        if(op == OPC_EXTBL || op == OPC_EXTWL || op == OPC_EXTLL || op == OPC_EXTQL)
+        {
+          a->shift_cl(SH_SHR, HR_AX);
+          if(width == 8)
+            a->rr2(0, 0xb6, HR_AX, HR_AX);
+          else if(width == 16)
+            a->rr2(0, 0xb7, HR_AX, HR_AX);
+          else if(width == 32)
+            a->zext32(HR_AX);
+        }
+        else if(op == OPC_INSBL || op == OPC_INSWL || op == OPC_INSLL || op == OPC_INSQL)
+        {
+          if(width == 8)
+            a->rr2(0, 0xb6, HR_AX, HR_AX);
+          else if(width == 16)
+            a->rr2(0, 0xb7, HR_AX, HR_AX);
+          else if(width == 32)
+            a->zext32(HR_AX);
+          a->shift_cl(SH_SHL, HR_AX);
+        }
+        else
+        {
+          a->mov_i(HR_DX, (width == 64) ? X64_QUAD : ((U64(0x1) << width) - 1));
+          a->shift_cl(SH_SHL, HR_DX);
+          a->not64(HR_DX);
+          a->alu(1, ALU_AND, HR_AX, HR_DX);
+        }
+
+        a->put(rc, HR_AX);
+      }
+      break;
+
+    case OPC_BR:
+    case OPC_BSR:
+      if(ra != 31)
+      {
+        a->mov_i(HR_AX, pc + 4 * k + 4);
+        a->put(ra, HR_AX);
+      }
+
+      a->mov_i(HR_AX, 0x10000 | (k + 1));
+      disp = sext_u64_21(ins) * 4;
+      ended = true;
+      break;
+
+    default:  // conditional branches
+      a->get(HR_AX, ra);
+      if(op == OPC_BLBC || op == OPC_BLBS)
+      {
+        a->b(0xa8);   // test al, 1
+        a->b(0x01);
+      }
+      else
+        a->rr(1, 0x85, HR_AX, HR_AX);
+      switch(op)
+      {
+      case OPC_BEQ:   a->set_cc(CC_E); break;
+      case OPC_BNE:   a->set_cc(CC_NE); break;
+      case OPC_BLT:   a->set_cc(CC_S); break;
+      case OPC_BGE:   a->set_cc(CC_NS); break;
+      case OPC_BLE:   a->set_cc(CC_LE); break;
+      case OPC_BGT:   a->set_cc(CC_G); break;
+      case OPC_BLBC:  a->set_cc(CC_E); break;
+      default:        a->set_cc(CC_NE);
+      }
+
+      a->shift_i32(SH_SHL, HR_AX, 16);
+      a->alu_i(0, ALU_OR, HR_AX, k + 1);
+      disp = sext_u64_21(ins) * 4;
+      ended = true;
+    }
+
+    if(memory)
+    {
+      SSoftTLB*   t = stlb[store ? 1 : 0];
+      s32         disp16 = (s32) (s64) sext_u64_16(ins);
+
+      // Virtual address in rax.
+      a->get(HR_AX, rb);
+      if(disp16)
+        a->alu_i(1, ALU_ADD, HR_AX, disp16);
+      if(align)
+        a->alu_i(1, ALU_AND, HR_AX, -8);
+
+      // The software TLB entry in rdx; the same checks as stlb_read/stlb_write.
+      a->mov(HR_CX, HR_AX);
+      a->shift_i(SH_SHR, HR_CX, 13);
+      a->alu_i(0, ALU_AND, HR_CX, STLB_ENTRIES - 1);
+      a->rr(0, 0x69, HR_CX, HR_CX); // imul ecx, ecx, sizeof(SSoftTLB)
+      a->d((u32) sizeof(SSoftTLB));
+      a->mov_i(HR_DX, (u64) t);
+      a->alu(1, ALU_ADD, HR_DX, HR_CX);
+
+      a->mov(HR_CX, HR_AX);
+      a->alu_i(1, ALU_AND, HR_CX, (s32) ~STLB_OFFSET_MASK);
+      a->mem(1, 0x3b, HR_CX, HR_DX, offsetof(SSoftTLB, virt));
+      a->exit_cc(CC_NE, k);
+
+      a->mov_i(HR_SI, (u64) &state.cm);
+      a->mem(0, 0x8b, HR_CX, HR_SI, 0);
+      a->mem(0, 0x3b, HR_CX, HR_DX, offsetof(SSoftTLB, cm));
+      a->exit_cc(CC_NE, k);
+
+      a->mem(0, 0x8b, HR_CX, HR_DX, offsetof(SSoftTLB, asn));
+      a->alu_i(0, ALU_CMP, HR_CX, -1);
+
+      u8*   global = a->jcc8(CC_E);
+      a->mov_i(HR_SI, (u64) &state.asn0);
+      a->mem(0, 0x3b, HR_CX, HR_SI, 0);
+      a->exit_cc(CC_NE, k);
+      a->patch8(global);
+
+      a->rr(0, 0x89, HR_AX, HR_CX);
+      a->alu_i(0, ALU_AND, HR_CX, (s32) STLB_OFFSET_MASK);
+      a->alu_i(0, ALU_CMP, HR_CX, (s32) (STLB_PAGE_SIZE - (size / 8)));
+      a->exit_cc(CC_A, k);
+
+      if(!store)
+      {
+        int dst = a->host[ra];
+        a->mem(1, 0x8b, HR_DX, HR_DX, offsetof(SSoftTLB, host));
+        switch(size)
+        {
+        case 8:   a->memx2(0, 0xb6, dst, HR_DX, HR_CX); break;
+        case 16:  a->memx2(0, 0xb7, dst, HR_DX, HR_CX); break;
+        case 32:  a->memx(1, 0x63, dst, HR_DX, HR_CX); break;
+        default:  a->memx(1, 0x8b, dst, HR_DX, HR_CX);
+        }
+
+        a->dirty |= (1U << ra);
+        continue;
+      }
+
+      // Physical address in rsi, host address in rdx.
+      a->mem(1, 0x8b, HR_SI, HR_DX, offsetof(SSoftTLB, phys));
+      a->alu(1, ALU_OR, HR_SI, HR_CX);
+      a->mem(1, 0x8b, HR_DX, HR_DX, offsetof(SSoftTLB, host));
+      a->alu(1, ALU_ADD, HR_DX, HR_CX);
+
+      // The same checks as CSystem::is_write_watched.
+      a->mov_i(HR_CX, (u64) &cSystem->iNumMemoryBits);
+      a->mem(0, 0x8b, HR_CX, HR_CX, 0);
+      a->mov(HR_AX, HR_SI);
+      a->shift_cl(SH_SHR, HR_AX);
+      a->exit_cc(CC_NE, k);
+
+      a->mov(HR_AX, HR_SI);
+      a->shift_i(SH_SHR, HR_AX, 8);
+      a->alu_i(0, ALU_AND, HR_AX, CPU_LOCK_FILTER_SIZE - 1);
+      a->mov_i(HR_CX, (u64) cSystem->get_cpu_lock_filter());
+      a->memx(0, 0x80, 7, HR_CX, HR_AX); // cmp byte [rcx + rax], 0
+      a->b(0);
+      a->exit_cc(CC_NE, k);
+
+      a->mov_i(HR_CX, (u64) cSystem->get_code_pages());
+      a->mem(1, 0x8b, HR_CX, HR_CX, 0);
+      a->mov(HR_AX, HR_SI);
+      a->shift_i(SH_SHR, HR_AX, CODE_PAGE_SHIFT);
+      a->memx(0, 0x80, 7, HR_CX, HR_AX);
+      a->b(0);
+      a->exit_cc(CC_NE, k);
+
+      int src = a->host[ra];
+      if(ra == 31)
+      {
+        a->zero(HR_AX);
+        src = HR_AX;
+      }
+
+      switch(size)
+      {
+      case 8:
+        a->rex(0, src, 0, HR_DX, true);
+        a->b(0x88);
+        a->b(((src & 7) << 3) | HR_DX);
+        break;
+      case 16:
+        a->b(0x66);
+      case 32:
+        a->rex(0, src, 0, HR_DX);
+        a->b(0x89);
+        a->b(((src & 7) << 3) | HR_DX);
+        break;
+      default:
+        a->rex(1, src, 0, HR_DX);
+        a->b(0x89);
+        a->b(((src & 7) << 3) | HR_DX);
+      }
+    }
+
+    if(ended)
+      break;
+  }
+
+  // Normal end of the block.
+  if(!ended)
+    a->mov_i(HR_AX, n);
+  a->epilogue(a->dirty);
+
+  // Side exits: write back what was changed before the instruction, and
+  // report the instructions completed.
+  for(int i = 0; i < a->exits; i++)
+  {
+    u32 rel = (u32) (a->p - a->exit[i].pos - 4);
+    memcpy(a->exit[i].pos, &rel, 4);
+    a->mov_i(HR_AX, a->exit[i].k);
+    a->epilogue(a->exit[i].dirty);
+  }
+
+  b->code = (u32 (*)(u64*)) start;
+  b->n = n;
+  b->disp = disp;
+  jit_used = ((a->p - jit_code) + 15) &~15;
+  delete a;
+}
+#endif // defined(CPU_JIT)
@@ -68,6 +68,15 @@
 #include "AlphaCPU.h"
 #include "cpu_debug.h"
 
+#include <float.h>
+#include <math.h>
+
+/* The host FPU is only used if it evaluates expressions in the precision of
+   their type (e.g. SSE2); otherwise (e.g. x87) results are rounded twice. */
+#if defined(FLT_EVAL_METHOD) && (FLT_EVAL_METHOD == 0)
+#define VAX_HOST_FPU  1
+#endif
+
 #define IPMAX U64(0x7FFFFFFFFFFFFFFF)   /* plus MAX (int) */
 #define IMMAX U64(0x8000000000000000)   /* minus MAX (int) */
 
@@ -78,6 +87,251 @@
 
 /***************************************************************************/
 
+/**
+ * \name VAX_fp_host
+ * VAX floating point host FPU fast path.
+ *
+ * A G-floating in register format has the layout of an IEEE T-floating; only
+ * the exponent bias differs: the VAX value 0.1F * 2^(E-1024) equals the IEEE
+ * value 1.F * 2^((E-2)-1023). A finite VAX value is converted to a host
+ * double by subtracting 2 from the exponent field, and back by adding 2. An
+ * F-floating in register format is a G-floating with a 24-bit fraction.
+ *
+ * The host rounds to nearest even, VAX rounds to nearest with ties away from
+ * zero, or chops. For G-floating, the exact error of the host result
+ * (TwoSum for addition, Dekker's product for multiplication, the remainder
+ * for division and square root) tells whether a chopped result must be
+ * decremented, or whether a rounded result is a tie. F-floating results are
+ * computed in double precision, which is exact or (for division and square
+ * root) never close enough to an F-floating rounding boundary to matter, and
+ * then rounded to 24 bits.
+ *
+ * The UFP code is used whenever
+ *   - an operand is zero or a reserved operand, a G-floating operand is not
+ *     within 2^+/-512, or an F-floating operand has more than 24 bits;
+ *   - the result may underflow or overflow (for G-floating: is not within
+ *     2^+/-896, so the exact errors do not underflow);
+ *   - a rounded G-floating result is an exact tie, or a chopped F-floating
+ *     addition has an inexact double result.
+ *   .
+ * That way, all exceptions are still raised by the UFP code.
+ ******************************************************************************/
+
+//\{
+#define HOST_ADD  0
+#define HOST_SUB  1
+#define HOST_MUL  2
+#define HOST_DIV  3
+#define HOST_SQRT 4
+
+#if defined(VAX_HOST_FPU)
+
+/* Difference between the VAX and IEEE exponent fields of a register. */
+#define HOST_BIAS U64(0x0020000000000000)
+
+/* Fraction bits that are zero in a register-format F-floating. */
+#define HOST_FLOW U64(0x000000001FFFFFFF)
+#define HOST_FRND U64(0x0000000010000000)
+
+/* Exponent range (register format) of operands and results. */
+static const s32  host_opmin[2] = { G_BIAS - F_BIAS, G_BIAS - 0x200 };
+static const s32  host_opmax[2] = { G_BIAS - F_BIAS + F_M_EXP, G_BIAS + 0x200 };
+static const s32  host_resmin[2] = { G_BIAS - F_BIAS, G_BIAS - 0x380 };
+static const s32  host_resmax[2] = { G_BIAS - F_BIAS + F_M_EXP, G_BIAS + 0x380 };
+
+/**
+ * \brief Check if an operand can be used by the host FPU.
+ *
+ * \param op  64-bit VAX floating in register format.
+ * \param dp  DT_F for F-floating or DT_G for G-floating.
+ * \return    true if the operand is within range.
+ **/
+static inline bool vax_host_operand(u64 op, u32 dp)
+{
+  s32 exp = FPR_GETEXP(op);
+
+  if((exp <= host_opmin[dp]) || (exp > host_opmax[dp]))
+    return false;
+  return (dp == DT_G) || !(op & HOST_FLOW);
+}
+
+/**
+ * \brief Convert a register-format VAX floating to a host double.
+ **/
+static inline double vax_host_get(u64 op)
+{
+  double  d;
+
+  op -= HOST_BIAS;
+  memcpy(&d, &op, sizeof(d));
+  return d;
+}
+
+/**
+ * \brief Return the bits of a host double.
+ **/
+static inline u64 vax_host_bits(double d)
+{
+  u64 r;
+
+  memcpy(&r, &d, sizeof(r));
+  return r;
+}
+
+/**
+ * \brief Return the rounding error of a host addition.
+ *
+ * \param a   First addend.
+ * \param b   Second addend.
+ * \param s   Rounded sum a + b.
+ * \return    The exact value of (a + b) - s.
+ **/
+static inline double vax_host_sumerr(double a, double b, double s)
+{
+  double  bb = s - a;
+
+  return (a - (s - bb)) + (b - bb);
+}
+
+/**
+ * \brief Return the rounding error of a host multiplication.
+ *
+ * The operands are split into 26-bit halves, whose products are exact.
+ *
+ * \param a   Multiplicand.
+ * \param b   Multiplier.
+ * \param p   Rounded product a * b.
+ * \return    The exact value of (a * b) - p.
+ **/
+static inline double vax_host_mulerr(double a, double b, double p)
+{
+  volatile double ca = 134217729.0 * a; /* 2^27 + 1 */
+  volatile double cb = 134217729.0 * b;
+  double          ah = ca - (ca - a);
+  double          al = a - ah;
+  double          bh = cb - (cb - b);
+  double          bl = b - bh;
+
+  return (((ah * bh - p) + ah * bl) + al * bh) + al * bl;
+}
+
+/**
+ * \brief Perform a VAX floating-point operation using the host FPU.
+ *
+ * \param op    HOST_ADD, HOST_SUB, HOST_MUL, HOST_DIV or HOST_SQRT.
+ * \param s1    First operand (ignored for HOST_SQRT).
+ * \param s2    Second operand.
+ * \param ins   The instruction currently being executed. Used to determine
+ *              the rounding mode.
+ * \param dp    DT_F for F-floating or DT_G for G-floating.
+ * \param res   Receives the result.
+ * \return      true if the result can be used, false if the operation needs
+ *              to be done by the UFP code.
+ **/
+static bool vax_host_op(int op, u64 s1, u64 s2, u32 ins, u32 dp, u64* res)
+{
+  u32             rndm = I_GETFRND(ins);
+  double          a;
+  double          b;
+  volatile double r;
+  volatile double p;
+  double          err;
+  u64             bits;
+  s32             exp;
+
+  if(!vax_host_operand(s2, dp))
+    return false;
+  if(op == HOST_SQRT ? FPR_GETSIGN(s2) : !vax_host_operand(s1, dp))
+    return false;
+
+  a = vax_host_get(s1);
+  b = vax_host_get(s2);
+  switch(op)
+  {
+  case HOST_ADD:  r = a + b; break;
+  case HOST_SUB:  r = a - b; break;
+  case HOST_MUL:  r = a * b; break;
+  case HOST_DIV:  r = a / b; break;
+  default:        r = sqrt(b); break;
+  }
+
+  bits = vax_host_bits(r);
+  if(dp == DT_F)
+  {
+    // Products of F-floatings are exact; sums are exact unless the exponents
+    // are far apart, which only matters when chopping.
+    if(!rndm && (op <= HOST_SUB)
+     && (vax_host_sumerr(a, (op == HOST_SUB) ? -b : b, r) != 0.0))
+      return false;
+    if(rndm)
+      bits += HOST_FRND;
+    bits &= ~HOST_FLOW;
+  }
+  else
+  {
+    exp = FPR_GETEXP(bits + HOST_BIAS);
+    if((exp <= host_resmin[dp]) || (exp > host_resmax[dp]))
+      return false;
+
+    // Determine the sign of the rounding error, if rounding can't settle it.
+    switch(op)
+    {
+    case HOST_ADD:  err = vax_host_sumerr(a, b, r); break;
+    case HOST_SUB:  err = vax_host_sumerr(a, -b, r); break;
+    case HOST_MUL:  err = vax_host_mulerr(a, b, r); break;
+    case HOST_DIV:  // quotients can't be ties
+      if(rndm)
+        err = 0.0;
+      else
+      {
+        p = b * r;
+        err = (a - p) - vax_host_mulerr(b, r, p);
+        if(b < 0.0)
+          err = -err;
+      }
+      break;
+
+    default:        // neither can square roots
+      if(rndm)
+        err = 0.0;
+      else
+      {
+        p = r * r;
+        err = (b - p) - vax_host_mulerr(r, r, p);
+      }
+      break;
+    }
+
+    if(err != 0.0)
+    {
+      if(!rndm)
+      {
+        if((err < 0.0) != (r < 0.0))
+          bits--; /* chop towards zero */
+      }
+      else if(vax_host_bits(fabs(err)) == (((u64) (FPR_GETEXP(bits) - 53)) << FPR_V_EXP))
+        return false; /* tie: round away from zero */
+    }
+  }
+
+  bits += HOST_BIAS;
+  exp = FPR_GETEXP(bits);
+  if((exp <= host_resmin[dp]) || (exp > host_resmax[dp]))
+    return false;
+  *res = bits;
+  return true;
+}
+#else
+static inline bool vax_host_op(int op, u64 s1, u64 s2, u32 ins, u32 dp, u64* res)
+{
+  return false;
+}
+#endif
+
+//\}
+
+/***************************************************************************/
+
 /**
  * \name VAX_fp_load_store
  * VAX floating point load and store functions
@@ -290,6 +544,8 @@ u64 CAlphaCPU::vax_fadd(u64 s1, u64 s2, u32 ins, u32 dp, bool sub)
   u32 sticky;
   s32 ediff;
 
+  FP_HOST_TRY(vax_host_op(sub ? HOST_SUB : HOST_ADD, s1, s2, ins, dp, &hres));
+
   vax_unpack(s1, &a, ins);
   vax_unpack(s2, &b, ins);
   if(sub)
@@ -335,7 +591,7 @@ u64 CAlphaCPU::vax_fadd(u64 s1, u64 s2, u32 ins, u32 dp, bool sub)
     }
   } /* end else if */
 
-  return vax_rpack(&a, ins, dp);  /* round and pack */
+  return FP_HOST_RESULT("vax_fadd", vax_rpack(&a, ins, dp), s1, s2);  /* round and pack */
 }
 
 /**
@@ -354,6 +610,8 @@ u64 CAlphaCPU::vax_fmul(u64 s1, u64 s2, u32 ins, u32 dp)
 
   UFP b;
 
+  FP_HOST_TRY(vax_host_op(HOST_MUL, s1, s2, ins, dp, &hres));
+
   vax_unpack(s1, &a, ins);
   vax_unpack(s2, &b, ins);
   if((a.exp == 0) || (b.exp == 0))
@@ -362,7 +620,7 @@ u64 CAlphaCPU::vax_fmul(u64 s1, u64 s2, u32 ins, u32 dp)
   a.exp = a.exp + b.exp - G_BIAS;   /* add exponents */
   uemul64(a.frac, b.frac, &a.frac); /* mpy fractions */
   vax_norm(&a); /* normalize */
-  return vax_rpack(&a, ins, dp);  /* round and pack */
+  return FP_HOST_RESULT("vax_fmul", vax_rpack(&a, ins, dp), s1, s2);  /* round and pack */
 }
 
 /**
@@ -385,6 +643,8 @@ u64 CAlphaCPU::vax_fdiv(u64 s1, u64 s2, u32 ins, u32 dp)
 
   UFP b;
 
+  FP_HOST_TRY(vax_host_op(HOST_DIV, s1, s2, ins, dp, &hres));
+
   vax_unpack(s1, &a, ins);
   vax_unpack(s2, &b, ins);
   if(b.exp == 0)
@@ -401,7 +661,7 @@ u64 CAlphaCPU::vax_fdiv(u64 s1, u64 s2, u32 ins, u32 dp)
   b.frac = b.frac >> 1;
   a.frac = ufdiv64(a.frac, b.frac, 55, NULL); /* divide */
   vax_norm(&a); /* normalize */
-  return vax_rpack(&a, ins, dp);  /* round and pack */
+  return FP_HOST_RESULT("vax_fdiv", vax_rpack(&a, ins, dp), s1, s2);  /* round and pack */
 }
 
 /**
@@ -417,6 +677,8 @@ u64 CAlphaCPU::vax_sqrt(u64 op, u32 ins, u32 dp)
 {
   UFP b;
 
+  FP_HOST_TRY(vax_host_op(HOST_SQRT, 0, op, ins, dp, &hres));
+
   vax_unpack(op, &b, ins);
   if(b.exp == 0)
     return 0; /* zero? */
@@ -426,9 +688,9 @@ u64 CAlphaCPU::vax_sqrt(u64 op, u32 ins, u32 dp)
     return 0;
   }
 
-  b.exp = ((b.exp + 1 - G_BIAS) >> 1) + G_BIAS; /* result exponent */
   b.frac = fsqrt64(b.frac, b.exp);  /* result fraction */
-  return vax_rpack(&b, ins, dp);    /* round and pack */
+  b.exp = ((b.exp + 1 - G_BIAS) >> 1) + G_BIAS; /* result exponent */
+  return FP_HOST_RESULT("vax_sqrt", vax_rpack(&b, ins, dp), 0, op); /* round and pack */
 }
 
 //\}
@@ -576,6 +838,7 @@ u64 CAlphaCPU::vax_rpack(UFP* r, u32 ins, u32 dp)
   static const u64  roundbit[2] = { UF_FRND, UF_GRND };
   static const s32  expmax[2] = { G_BIAS - F_BIAS + F_M_EXP, G_M_EXP };
   static const s32  expmin[2] = { G_BIAS - F_BIAS, 0};
+  static const u64  fracmask[2] = { U64(0x000FFFFFE0000000), FPR_FRAC };
 
   if(r->frac == 0)
     return 0; /* result 0? */
@@ -602,7 +865,7 @@ u64 CAlphaCPU::vax_rpack(UFP* r, u32 ins, u32 dp)
     return 0;
   } /* underflow to 0 */
 
-  return(((u64) r->sign) << FPR_V_SIGN) | (((u64) r->exp) << FPR_V_EXP) | ((r->frac >> FPR_GUARD) & FPR_FRAC);
+  return(((u64) r->sign) << FPR_V_SIGN) | (((u64) r->exp) << FPR_V_EXP) | ((r->frac >> FPR_GUARD) & fracmask[dp]);
 }
 
 /**
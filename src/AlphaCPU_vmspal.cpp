@@ -28,6 +28,7 @@
  * Contains routines that replace parts of the VMS PALcode for the emulated
  * DecChip 21264CB EV68 Alpha processor. Based on disassembly of original VMS
  * PALcode, HRM, and OpenVMS AXP Internals and Data Structures.
+ * Also contains the few OSF/1 PALcode calls that can be replaced natively.
  *
  * $Id$
  *
@@ -135,12 +136,12 @@
 #define r30           state.r[30]
 #define r31           state.r[31]
 
-#define hw_stq(a, b)  cSystem->WriteMem(a &~U64(0x7), 64, b, this)
-#define hw_stl(a, b)  cSystem->WriteMem(a &~U64(0x3), 32, b, this)
+#define hw_stq(a, b)  vmspal_write(a &~U64(0x7), 64, b)
+#define hw_stl(a, b)  vmspal_write(a &~U64(0x3), 32, b)
 #define stq(a, b)                                        \
   if(virt2phys(a, &phys_address, ACCESS_WRITE, NULL, 0)) \
     return -1;                                           \
-  cSystem->WriteMem(phys_address, 64, b, this);
+  vmspal_write(phys_address, 64, b);
 #define ldq(a, b)                                       \
   if(virt2phys(a, &phys_address, ACCESS_READ, NULL, 0)) \
     return -1;                                          \
@@ -148,7 +149,7 @@
 #define stl(a, b)                                        \
   if(virt2phys(a, &phys_address, ACCESS_WRITE, NULL, 0)) \
     return -1;                                           \
-  cSystem->WriteMem(phys_address, 32, b, this);
+  vmspal_write(phys_address, 32, b);
 #define ldl(a, b)                                       \
   if(virt2phys(a, &phys_address, ACCESS_READ, NULL, 0)) \
     return -1;                                          \
@@ -282,7 +283,7 @@ void CAlphaCPU::vmspal_call_swpctx()
   state.astrr = (int) (p4 >> 4) & 0xf;
   state.fpen = (int) p5 & 1;
   state.ppcen = (int) (p5 >> 0x3e) & 1;
-  state.check_int = true;
+  request_int_check();
 
   hw_ldq(r16 + 0x40, p7);
   hw_ldq(r16 + 0x20, p6);
@@ -318,7 +319,7 @@ void CAlphaCPU::vmspal_call_mtpr_asten()
   r0 = state.aster;
   state.aster &= r16;
   state.aster |= (r16 >> 4) & 0xf;
-  state.check_int = true;
+  request_int_check();
 }
 
 /**
@@ -329,7 +330,7 @@ void CAlphaCPU::vmspal_call_mtpr_astsr()
   r0 = state.astrr;
   state.astrr &= r16;
   state.astrr |= (r16 >> 4) & 0xf;
-  state.check_int = true;
+  request_int_check();
 }
 
 /**
@@ -399,7 +400,7 @@ void CAlphaCPU::vmspal_call_mtpr_ipl()
   state.pcen = ipl_ier_mask[r16][3];
   state.sien = ipl_ier_mask[r16][4];
   state.asten = ipl_ier_mask[r16][5];
-  state.check_int = true;
+  request_int_check();
 }
 
 /**
@@ -478,7 +479,7 @@ void CAlphaCPU::vmspal_call_mtpr_sirr()
   if(r16 > 0 && r16 < 16)
   {
     state.sir |= 1 << r16;
-    state.check_int = true;
+    request_int_check();
   }
 }
 
@@ -820,7 +821,7 @@ int CAlphaCPU::vmspal_call_rei()
     state.pcen = ipl_ier_mask[0][3];
     state.sien = ipl_ier_mask[0][4];
     state.asten = ipl_ier_mask[0][5];
-    state.check_int = true;
+    request_int_check();
     set_pc(p23);
     return 0;
   }
@@ -839,7 +840,7 @@ int CAlphaCPU::vmspal_call_rei()
   state.pcen = ipl_ier_mask[p7][3];
   state.sien = ipl_ier_mask[p7][4];
   state.asten = ipl_ier_mask[p7][5];
-  state.check_int = true;
+  request_int_check();
   set_pc(p23);
   return 0;
 }
@@ -853,7 +854,7 @@ void CAlphaCPU::vmspal_call_swasten()
   if(r16 & 1)
   {
     state.aster |= (1 << ((p22 >> 3) & 3));
-    state.check_int = true;
+    request_int_check();
   }
   else
     state.aster &= ~(1 << ((p22 >> 3) & 3));
@@ -1020,6 +1021,164 @@ int CAlphaCPU::vmspal_int_initiate_interrupt()
   return -1;
 }
 
+/**
+ * Write to memory. While validating, the write is recorded so it can be
+ * undone. Only writes to memory are recorded, as reading back a device
+ * register could have side-effects.
+ **/
+void CAlphaCPU::vmspal_write(u64 address, int dsize, u64 data)
+{
+  if(vmspal_journal_size >= 0 && vmspal_journal_size < VMSPAL_JOURNAL_MAX
+   && address < (U64(0x1) << cSystem->get_memory_bits()))
+  {
+    vmspal_journal[vmspal_journal_size].address = address;
+    vmspal_journal[vmspal_journal_size].dsize = dsize;
+    vmspal_journal[vmspal_journal_size].old_data = cSystem->ReadMem(address, dsize, this);
+    vmspal_journal[vmspal_journal_size].new_data = data;
+    vmspal_journal_size++;
+  }
+
+  cSystem->WriteMem(address, dsize, data, this);
+}
+
+/**
+ * Start validating a replacement routine: save the state and translation
+ * buffers, and start recording memory writes.
+ **/
+void CAlphaCPU::vmspal_check_begin()
+{
+  *vmspal_saved[0] = state;
+  memcpy(vmspal_saved_tb, tb[0], 2 * TB_ENTRIES * sizeof(STBEntry));
+  vmspal_journal_size = 0;
+}
+
+/**
+ * Undo the effects of a replacement routine. The state it left is kept for
+ * vmspal_check_pal, and the state saved by vmspal_check_begin is restored.
+ *
+ * \return Number of memory writes recorded.
+ **/
+int CAlphaCPU::vmspal_check_undo()
+{
+  int writes = vmspal_journal_size;
+  int i;
+
+  *vmspal_saved[1] = state;
+  vmspal_journal_size = -1;
+
+  // undo the memory writes, last one first
+  for(i = writes - 1; i >= 0; i--)
+    cSystem->WriteMem(vmspal_journal[i].address, vmspal_journal[i].dsize,
+                      vmspal_journal[i].old_data, this);
+  state = *vmspal_saved[0];
+  memcpy(tb[0], vmspal_saved_tb, 2 * TB_ENTRIES * sizeof(STBEntry));
+  set_reg_bank();
+  flush_stlb();
+  return writes;
+}
+
+/**
+ * Run the PALcode from its entry point until it leaves PALmode, and report
+ * any difference in the registers, interrupt state or memory written with
+ * the state the replacement routine left.
+ *
+ * \param what   Description of the PALcode flow, for the report.
+ * \param writes Number of memory writes the replacement routine did.
+ **/
+void CAlphaCPU::vmspal_check_pal(const char* what, int writes)
+{
+  SCPU_state*   native = vmspal_saved[1];
+  bool          block = block_enabled;
+  int           i;
+
+  block_enabled = false;
+  for(i = 0; i < VMSPAL_VALIDATE_MAX && (state.pc & 1); i++)
+    execute();
+  block_enabled = block;
+
+  if(state.pc & 1)
+    printf("%s: %s still in PALmode after %d instructions\n", devid_string, what,
+           VMSPAL_VALIDATE_MAX);
+
+  for(i = 0; i < 32; i++)
+  {
+    if(native->r[i] != state.r[i])
+      printf("%s: %s r%d: replacement %016" LL "x, PALcode %016" LL "x\n", devid_string,
+             what, i, native->r[i], state.r[i]);
+  }
+
+#define VMSPAL_CHECK(name, field)                                              \
+  if((u64) native->field != (u64) state.field)                                 \
+    printf("%s: %s " name ": replacement %016" LL "x, PALcode %016" LL "x\n", \
+           devid_string, what, (u64) native->field, (u64) state.field);
+  VMSPAL_CHECK("pc", pc);
+  VMSPAL_CHECK("p21", r[32 + 21]);
+  VMSPAL_CHECK("p22", r[32 + 22]);
+  VMSPAL_CHECK("cm", cm);
+  VMSPAL_CHECK("eien", eien);
+  VMSPAL_CHECK("slen", slen);
+  VMSPAL_CHECK("cren", cren);
+  VMSPAL_CHECK("pcen", pcen);
+  VMSPAL_CHECK("sien", sien);
+  VMSPAL_CHECK("asten", asten);
+  VMSPAL_CHECK("sir", sir);
+  VMSPAL_CHECK("astrr", astrr);
+  VMSPAL_CHECK("aster", aster);
+  VMSPAL_CHECK("asn", asn);
+  VMSPAL_CHECK("asn0", asn0);
+  VMSPAL_CHECK("fpen", fpen);
+  VMSPAL_CHECK("ppcen", ppcen);
+#undef VMSPAL_CHECK
+
+  // compare the final value of each location the replacement routine wrote
+  for(i = 0; i < writes; i++)
+  {
+    int j;
+    for(j = i + 1; j < writes; j++)
+      if(vmspal_journal[j].address == vmspal_journal[i].address)
+        break;
+    if(j < writes)
+      continue;
+
+    u64 pal_data = cSystem->ReadMem(vmspal_journal[i].address, vmspal_journal[i].dsize, this);
+    if(pal_data != vmspal_journal[i].new_data)
+      printf("%s: %s memory %016" LL "x: replacement %016" LL "x, PALcode %016" LL "x\n",
+             devid_string, what, vmspal_journal[i].address, vmspal_journal[i].new_data,
+             pal_data);
+  }
+
+  if(writes == VMSPAL_JOURNAL_MAX)
+    printf("%s: %s wrote more than %d locations\n", devid_string, what,
+           VMSPAL_JOURNAL_MAX);
+}
+
+/**
+ * Take an interrupt both ways, for validating the replacement routines.
+ *
+ * The replacement routines are run first. If they pass control to the OS,
+ * their effects are undone, and the PALcode is run from the same starting
+ * state until it leaves PALmode. Any difference in the registers, interrupt
+ * state or memory written is reported. The PALcode's result is kept.
+ *
+ * \return -1 if control was passed to the OS, 0 otherwise.
+ **/
+int CAlphaCPU::vmspal_check_int()
+{
+  int res;
+  int writes;
+
+  vmspal_check_begin();
+  res = vmspal_ent_int();
+  writes = vmspal_check_undo();
+  if(res >= 0)
+    return 0;
+
+  state.exc_addr = state.current_pc;
+  set_pc(state.pal_base | INTERRUPT | 1);
+  vmspal_check_pal("VMS PALcode interrupt", writes);
+  return -1;
+}
+
 //\}
 
 /***************************************************************************/
@@ -1061,7 +1220,7 @@ int CAlphaCPU::vmspal_ent_sw_int(int si)
   state.pcen = ipl_ier_mask[x][3];
   state.sien = ipl_ier_mask[x][4];
   state.asten = ipl_ier_mask[x][5];
-  state.check_int = true;
+  request_int_check();
   p20 = (u64) x << 8;
   p20 |= 4;
   hw_stq(p21 + 0x128, p20);
@@ -1108,7 +1267,7 @@ int CAlphaCPU::vmspal_ent_ext_int(int ei)
   {
     p5 = cSystem->get_c_dir(state.iProcNum);
     if(test_bit_64(p5, 0x32))
-      FAILURE(NotImplemented, "Can't handle IRQ 50");
+      return 1; // leave IRQ 50 to the PALcode
 
     p4 = 0x100;
     p20 = 8;
@@ -1138,7 +1297,7 @@ int CAlphaCPU::vmspal_ent_ext_int(int ei)
       hw_ldl(p5, p5);
       p4 = p5 & 0xff;
       if(p4 == 0x07)
-        FAILURE(NotImplemented, "Can't handle PIC interrupt 7");
+        return 1; // leave PIC interrupt 7 to the PALcode
 
       if(p4 >= 0x10)
         return 0;
@@ -1182,7 +1341,7 @@ int CAlphaCPU::vmspal_ent_ext_int(int ei)
     state.pcen = ipl_ier_mask[p7][3];
     state.sien = ipl_ier_mask[p7][4];
     state.asten = ipl_ier_mask[p7][5];
-    state.check_int = true;
+    request_int_check();
     p20 = p7 << 8;
     p20 |= 4;
     hw_stq(p21 + 0x128, p20);
@@ -1221,6 +1380,36 @@ int CAlphaCPU::vmspal_ent_ast_int(int ast)
   return vmspal_int_initiate_interrupt();
 }
 
+/**
+ * Interrupt entry point. Takes the pending interrupt with the highest
+ * priority, in the same order as the PALcode does.
+ *
+ * \return -1 if control was passed to the OS, 1 if the interrupt has to be
+ *         left to the PALcode, 0 otherwise.
+ **/
+int CAlphaCPU::vmspal_ent_int()
+{
+  int ast = state.aster & state.astrr & ((1 << (state.cm + 1)) - 1);
+
+  // interprocessor, performance counter and error interrupts
+  if(state.eir & state.eien & ~6)
+    return 1;
+
+  if(state.eir & state.eien & 6)
+    return vmspal_ent_ext_int((int) (state.eir & state.eien & 6));
+
+  if(state.sir & state.sien & 0xfffc)
+    return vmspal_ent_sw_int((int) (state.sir & state.sien));
+
+  if(state.asten && ast)
+    return vmspal_ent_ast_int(ast);
+
+  if(state.sir & state.sien)
+    return vmspal_ent_sw_int((int) (state.sir & state.sien));
+
+  return 0;
+}
+
 /**
  * Entry point for Single Data Translation Buffer Miss.
  **/
@@ -1630,3 +1819,456 @@ int CAlphaCPU::vmspal_ent_dfault(int flags)
 }
 
 //\}
+
+/***************************************************************************/
+
+/**
+ * \name OSF_pal_call
+ * OSF/1 PALcode CALL replacement routines.
+ *
+ * The calls that act on processor state alone are always replaced. The
+ * hot calls that keep state in PALcode scratch locations (SWPCTX, WRENT,
+ * SWPIPL, RDPS, WRUSP, RDUSP, RTI and CALLSYS) are replaced only when
+ * osfpal_call is set to native or validate, as those locations are shared
+ * with the PALcode's own interrupt and exception flows. The routines return
+ * -1 without changing anything for the cases they leave to the PALcode:
+ * calls from the wrong mode, bad arguments and stack addresses that are
+ * not in the translation buffer.
+ *
+ * The scratch layout is assumed to follow the VMS PALcode where the two
+ * images share a location (PTBR, PCBB and the saved kernel stack pointer
+ * at p21 + 0x08, 0x10 and 0x18, the PS in the low bits of p22); the user
+ * stack pointer is kept in the HWPCB while in kernel mode. The locations
+ * of the entry points and the kernel global pointer are not known from
+ * the VMS image. Run with osfpal_call = "validate" to check the layout
+ * against the PALcode of the firmware in use before using "native".
+ ******************************************************************************/
+
+/// OSF/1 PALcode scratch: page table base, as a byte address
+#define OSF_PT_PTBR   U64(0x08)
+/// OSF/1 PALcode scratch: physical address of the current HWPCB
+#define OSF_PT_PCBB   U64(0x10)
+/// OSF/1 PALcode scratch: kernel stack pointer while in user mode
+#define OSF_PT_KSP    U64(0x18)
+/// OSF/1 PALcode scratch: entry points written by WRENT, indexed by r17
+#define OSF_PT_ENT    U64(0x40)
+/// OSF/1 PALcode scratch: kernel global pointer written by WRKGP
+#define OSF_PT_KGP    U64(0x70)
+
+/// WRENT index of the system call entry point (entSys)
+#define OSF_ENT_SYS   5
+
+/// PS bits kept in p22: current mode (set for user mode) and IPL
+#define OSF_PS_MASK   U64(0xf)
+#define OSF_PS_USER   U64(0x8)
+#define OSF_PS_IPL    U64(0x7)
+
+/// Size of the stack frame built by CALLSYS and taken down by RTI
+#define OSF_FRAME     0x30
+
+/**
+ * Mask for interrupt enabling at the OSF/1 IPL's.
+ *
+ * For each of the 8 IPL's gives the values for eien, slen, cren, pcen,
+ * sien and asten. IPL 1 and 2 block software interrupts, 3 and 4 the
+ * device interrupts (irq_h 1 and 0), 5 the interval timer and
+ * interprocessor interrupts (irq_h 2 and 3), 6 the performance counters
+ * and 7 everything else.
+ **/
+static int osf_ipl_ier_mask[8][6] =
+{
+
+  /* ei, sl, cr, pc,     si, ast */
+  { 0x3f, 0, 1, 3, 0xfffe, 0 },
+  { 0x3f, 0, 1, 3, 0xfffc, 0 },
+  { 0x3f, 0, 1, 3, 0, 0 },
+  { 0x3d, 0, 1, 3, 0, 0 },
+  { 0x3c, 0, 1, 3, 0, 0 },
+  { 0x30, 0, 1, 3, 0, 0 },
+  { 0x30, 0, 1, 0, 0, 0 },
+  { 0x00, 0, 0, 0, 0, 0 }
+};
+
+//\{
+
+/**
+ * Implementation of CALL_PAL CFLUSH opcode.
+ **/
+void CAlphaCPU::osfpal_call_cflush()
+{
+
+  // don't do anything...
+}
+
+/**
+ * Implementation of CALL_PAL DRAINA opcode.
+ **/
+void CAlphaCPU::osfpal_call_draina()
+{
+
+  // don't do anything...
+}
+
+/**
+ * Implementation of CALL_PAL TBI opcode.
+ **/
+void CAlphaCPU::osfpal_call_tbi()
+{
+  switch((s64) r16)
+  {
+  case -2:  // TBIA
+    tbia(ACCESS_READ);
+    tbia(ACCESS_EXEC);
+    flush_icache();
+    break;
+
+  case -1:  // TBIAP
+    tbiap(ACCESS_READ);
+    tbiap(ACCESS_EXEC);
+    flush_icache_asm();
+    break;
+
+  case 1:   // TBISI
+    tbis(r17, ACCESS_EXEC);
+    break;
+
+  case 2:   // TBISD
+    tbis(r17, ACCESS_READ);
+    break;
+
+  case 3:   // TBIS
+    tbis(r17, ACCESS_READ);
+    tbis(r17, ACCESS_EXEC);
+    break;
+  }
+}
+
+/**
+ * Implementation of CALL_PAL WHAMI opcode.
+ **/
+void CAlphaCPU::osfpal_call_whami()
+{
+  r0 = get_cpuid();
+}
+
+/**
+ * Implementation of CALL_PAL WTINT opcode.
+ *
+ * No interval clock ticks are skipped, so r0 is always 0.
+ **/
+void CAlphaCPU::osfpal_call_wtint()
+{
+  if(idle_mode & IDLE_WTINT)
+    idle_wait();
+  r0 = 0;
+}
+
+/**
+ * Implementation of CALL_PAL IMB opcode.
+ **/
+void CAlphaCPU::osfpal_call_imb()
+{
+  flush_icache();
+}
+
+/**
+ * Implementation of CALL_PAL SWPCTX opcode.
+ *
+ * The kernel stack pointer and process cycle counter are saved in the
+ * old HWPCB, and the new context is loaded from the HWPCB at r16.
+ **/
+int CAlphaCPU::osfpal_call_swpctx()
+{
+  u64 old_pcbb;
+  u64 ptbr;
+  u64 pcc;
+  u64 asn;
+  u64 flags;
+
+  if((p22 & OSF_PS_USER) || (r16 & 0x7f))
+    return -1;
+
+  hw_ldq(p21 + OSF_PT_PCBB, old_pcbb);
+  hw_stq(old_pcbb, r30);
+  hw_stl(old_pcbb + 0x18, (state.cc & U64(0xffffffff)) + state.cc_offset);
+
+  hw_ldq(r16, r30);
+  hw_ldq(r16 + 0x10, ptbr);
+  hw_ldl(r16 + 0x18, pcc);
+  hw_ldl(r16 + 0x1c, asn);
+  hw_ldq(r16 + 0x28, flags);
+
+  hw_stq(p21 + OSF_PT_PTBR, ptbr << 13);
+  state.cc_offset = ((u32) pcc & 0xffffffff) - (state.cc & U64(0xffffffff));
+  asn &= 0xff;
+  state.asn0 = (int) asn;
+  state.asn1 = (int) asn;
+  state.asn = (int) asn;
+  state.fpen = (int) flags & 1;
+  state.ppcen = (int) (flags >> 0x3e) & 1;
+  hw_stq(p21 + OSF_PT_PCBB, r16);
+  r0 = old_pcbb;
+  return 0;
+}
+
+/**
+ * Implementation of CALL_PAL WRENT opcode.
+ **/
+int CAlphaCPU::osfpal_call_wrent()
+{
+  if((p22 & OSF_PS_USER) || r17 > OSF_ENT_SYS)
+    return -1;
+
+  hw_stq(p21 + OSF_PT_ENT + r17 * 8, r16);
+  return 0;
+}
+
+/**
+ * Implementation of CALL_PAL SWPIPL opcode.
+ **/
+int CAlphaCPU::osfpal_call_swpipl()
+{
+  if(p22 & OSF_PS_USER)
+    return -1;
+
+  r0 = p22 & OSF_PS_IPL;
+  p22 = (p22 &~OSF_PS_IPL) | (r16 & OSF_PS_IPL);
+  osfpal_set_ipl((int) (r16 & OSF_PS_IPL));
+  return 0;
+}
+
+/**
+ * Implementation of CALL_PAL RDPS opcode.
+ **/
+int CAlphaCPU::osfpal_call_rdps()
+{
+  if(p22 & OSF_PS_USER)
+    return -1;
+
+  r0 = p22 & OSF_PS_MASK;
+  return 0;
+}
+
+/**
+ * Implementation of CALL_PAL WRUSP opcode.
+ **/
+int CAlphaCPU::osfpal_call_wrusp()
+{
+  u64 pcbb;
+
+  if(p22 & OSF_PS_USER)
+    return -1;
+
+  hw_ldq(p21 + OSF_PT_PCBB, pcbb);
+  hw_stq(pcbb + 8, r16);
+  return 0;
+}
+
+/**
+ * Implementation of CALL_PAL RDUSP opcode.
+ **/
+int CAlphaCPU::osfpal_call_rdusp()
+{
+  u64 pcbb;
+
+  if(p22 & OSF_PS_USER)
+    return -1;
+
+  hw_ldq(p21 + OSF_PT_PCBB, pcbb);
+  hw_ldq(pcbb + 8, r0);
+  return 0;
+}
+
+/**
+ * Implementation of CALL_PAL RTI opcode.
+ *
+ * Takes down the frame at the kernel stack pointer (PS, PC, GP, a0..a2)
+ * and returns to the mode and IPL in the saved PS.
+ **/
+int CAlphaCPU::osfpal_call_rti()
+{
+  u64 phys;
+  u64 ps;
+  u64 pc;
+  u64 sp;
+  u64 pcbb;
+
+  if((p22 & OSF_PS_USER) || (r30 & 7) || (r30 & 0x1fff) > 0x2000 - OSF_FRAME
+   || !osfpal_kstack(r30, &phys))
+    return -1;
+
+  hw_ldq(phys, ps);
+  hw_ldq(phys + 0x08, pc);
+  hw_ldq(phys + 0x10, r29);
+  hw_ldq(phys + 0x18, r16);
+  hw_ldq(phys + 0x20, r17);
+  hw_ldq(phys + 0x28, r18);
+  sp = (r30 + OSF_FRAME) | ((ps >> 56) & 0x3f);
+
+  if(ps & OSF_PS_USER)
+  {
+
+    // back to user mode, at IPL 0
+    hw_stq(p21 + OSF_PT_KSP, sp);
+    hw_ldq(p21 + OSF_PT_PCBB, pcbb);
+    hw_ldq(pcbb + 8, r30);
+    ps = OSF_PS_USER;
+    state.cm = 3;
+  }
+  else
+  {
+    r30 = sp;
+    ps &= OSF_PS_IPL;
+  }
+
+  p22 = (p22 &~OSF_PS_MASK) | ps;
+  osfpal_set_ipl((int) (ps & OSF_PS_IPL));
+  set_pc(pc &~U64(0x3));
+  return 0;
+}
+
+/**
+ * Implementation of CALL_PAL CALLSYS opcode.
+ *
+ * Switches to the kernel stack, builds a frame on it (PS, PC, GP, a0..a2)
+ * and enters the kernel at entSys with the kernel global pointer.
+ **/
+int CAlphaCPU::osfpal_call_callsys()
+{
+  u64 phys;
+  u64 ksp;
+  u64 sp;
+  u64 pcbb;
+
+  if(!(p22 & OSF_PS_USER))
+    return -1;
+
+  hw_ldq(p21 + OSF_PT_KSP, ksp);
+  sp = (ksp &~U64(0x3f)) - OSF_FRAME;
+  if(!osfpal_kstack(sp, &phys))
+    return -1;
+
+  hw_ldq(p21 + OSF_PT_PCBB, pcbb);
+  hw_stq(pcbb + 8, r30);
+  hw_stq(phys, (p22 & OSF_PS_MASK) | ((ksp & 0x3f) << 56));
+  hw_stq(phys + 0x08, state.pc);
+  hw_stq(phys + 0x10, r29);
+  hw_stq(phys + 0x18, r16);
+  hw_stq(phys + 0x20, r17);
+  hw_stq(phys + 0x28, r18);
+
+  r30 = sp;
+  p22 &= ~OSF_PS_MASK;
+  state.cm = 0;
+  osfpal_set_ipl(0);
+  hw_ldq(p21 + OSF_PT_KGP, r29);
+  hw_ldq(p21 + OSF_PT_ENT + OSF_ENT_SYS * 8, r27);
+  set_pc(r27 &~U64(0x3));
+  return 0;
+}
+
+//\}
+
+/***************************************************************************/
+
+/**
+ * \name OSF_pal_internal
+ * OSF/1 PALcode replacement internal routines.
+ ******************************************************************************/
+
+//\{
+
+/**
+ * Do one of the OSF/1 PALcode calls that keep state in PALcode scratch
+ * locations, the way osfpal_call selects.
+ *
+ * \return 0 if the call was done, -1 if it should go to the PALcode.
+ **/
+int CAlphaCPU::osfpal_call(int function)
+{
+  switch(osfpal_call_mode)
+  {
+  case OSFPAL_CALL_NATIVE:    return osfpal_call_native(function);
+  case OSFPAL_CALL_VALIDATE:  return osfpal_check_call(function);
+  default:                    return -1;
+  }
+}
+
+/**
+ * Run the replacement routine for an OSF/1 PALcode call.
+ *
+ * \return 0 if the call was done, -1 if it should go to the PALcode.
+ **/
+int CAlphaCPU::osfpal_call_native(int function)
+{
+  switch(function)
+  {
+  case 0x30:  return osfpal_call_swpctx();
+  case 0x34:  return osfpal_call_wrent();
+  case 0x35:  return osfpal_call_swpipl();
+  case 0x36:  return osfpal_call_rdps();
+  case 0x38:  return osfpal_call_wrusp();
+  case 0x3a:  return osfpal_call_rdusp();
+  case 0x3f:  return osfpal_call_rti();
+  case 0x83:  return osfpal_call_callsys();
+  default:    return -1;
+  }
+}
+
+/**
+ * Do an OSF/1 PALcode call both ways, for validating the replacement
+ * routines, the same way vmspal_check_int does for interrupts. The
+ * PALcode's result is kept.
+ *
+ * \return 0 if the call was done, -1 if it should go to the PALcode.
+ **/
+int CAlphaCPU::osfpal_check_call(int function)
+{
+  char  what[40];
+  int   res;
+  int   writes;
+
+  vmspal_check_begin();
+  res = osfpal_call_native(function);
+  writes = vmspal_check_undo();
+  if(res < 0)
+    return -1;
+
+  state.r[32 + 23] = state.pc;
+  set_pc(state.pal_base | (1 << 13) | ((function & 0x80) << 5) | ((function & 0x3f) << 6) | 1);
+  sprintf(what, "OSF/1 PALcode call %02x", function);
+  vmspal_check_pal(what, writes);
+  return 0;
+}
+
+/**
+ * Translate an address on the kernel stack, without side effects.
+ *
+ * \return false if the address isn't in the translation buffer.
+ **/
+bool CAlphaCPU::osfpal_kstack(u64 virt, u64* phys)
+{
+  int cm = state.cm;
+  int res;
+
+  state.cm = 0;
+  res = virt2phys(virt, phys, ACCESS_WRITE | FAKE | NO_CHECK, NULL, 0);
+  state.cm = cm;
+  return !res;
+}
+
+/**
+ * Set the interrupt enables for an OSF/1 IPL.
+ **/
+void CAlphaCPU::osfpal_set_ipl(int ipl)
+{
+  state.eien = osf_ipl_ier_mask[ipl][0];
+  state.slen = osf_ipl_ier_mask[ipl][1];
+  state.cren = osf_ipl_ier_mask[ipl][2];
+  state.pcen = osf_ipl_ier_mask[ipl][3];
+  state.sien = osf_ipl_ier_mask[ipl][4];
+  state.asten = osf_ipl_ier_mask[ipl][5];
+  request_int_check();
+}
+
+//\}
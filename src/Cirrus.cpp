@@ -349,9 +349,8 @@ void CCirrus::start_threads()
   if(!myThread)
   {
     myThread = new CThread("cirrus");
-    printf(" %s", myThread->getName().c_str());
     StopThread = false;
-    myThread->start(*this);
+    start_thread(myThread, *this);
   }
 }
 
@@ -426,9 +426,8 @@ void CDEC21143::start_threads()
   if(!myThread)
   {
     myThread = new CThread("nic");
-    printf(" %s", myThread->getName().c_str());
     StopThread = false;
-    myThread->start(*this);
+    start_thread(myThread, *this);
   }
 }
 
@@ -154,9 +154,8 @@ void CKeyboard::start_threads()
   if(!myThread)
   {
     myThread = new CThread("kbd");
-    printf(" %s", myThread->getName().c_str());
     StopThread = false;
-    myThread->start(*this);
+    start_thread(myThread, *this);
   }
 }
 
@@ -602,9 +602,9 @@ void CPCIDevice::do_pci_read(u32 address, void*  dest, size_t element_size,
     // get a pointer to system memory if the address is inside main memory
     char*   memptr = cSystem->PtrToMem(phys_addr);
 
-    // if the address is inside system memory, a simple memcpy operation is
-    // all that is needed.
-    if(memptr)
+    // if the whole range is inside system memory, a simple memcpy operation
+    // is all that is needed.
+    if(memptr && cSystem->PtrToMem(phys_addr + element_size * element_count - 1))
     {
       memcpy(dest, memptr, element_size * element_count);
       return;
@@ -692,11 +692,12 @@ void CPCIDevice::do_pci_write(u32 address, void*  source, size_t element_size,
     // get a pointer to system memory if the address is inside main memory
     char*   memptr = cSystem->PtrToMem(phys_addr);
 
-    // if the address is inside system memory, a simple memcpy operation is
-    // all that is needed.
-    if(memptr)
+    // if the whole range is inside system memory, a simple memcpy operation
+    // is all that is needed.
+    if(memptr && cSystem->PtrToMem(phys_addr + element_size * element_count - 1))
     {
       memcpy(memptr, source, element_size * element_count);
+      cSystem->invalidate_code(phys_addr, element_size * element_count);
       return;
     }
 
@@ -340,9 +340,8 @@ void CS3Trio64::start_threads()
   if(!myThread)
   {
     myThread = new CThread("s3");
-    printf(" %s", myThread->getName().c_str());
     StopThread = false;
-    myThread->start(*this);
+    start_thread(myThread, *this);
   }
 }
 
@@ -299,9 +299,8 @@ void CSerial::start_threads()
   {
     sprintf(buffer, "srl%d", state.iNumber);
     myThread = new CThread(buffer);
-    printf(" %s", myThread->getName().c_str());
     StopThread = false;
-    myThread->start(*this);
+    start_thread(myThread, *this);
   }
 }
 
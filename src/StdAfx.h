@@ -307,6 +307,7 @@ inline char printable(char c)
 #include "base/Thread.h"
 #include "base/Runnable.h"
 #include "base/Semaphore.h"
+#include "base/Event.h"
 #include "base/Timestamp.h"
 #include "base/RWLock.h"
 
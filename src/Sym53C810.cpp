@@ -573,9 +573,8 @@ void CSym53C810::start_threads()
   if(!myThread)
   {
     myThread = new CThread("sym");
-    printf(" %s", myThread->getName().c_str());
     StopThread = false;
-    myThread->start(*this);
+    start_thread(myThread, *this);
     if(state.executing)
       mySemaphore.set();
   }
@@ -321,6 +321,25 @@
 #include <stdlib.h>
 #include <signal.h>
 
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+
+/// Size of a host huge page; memory is aligned to this.
+#define MEMORY_HUGE_PAGE  (2 * 1024 * 1024)
+
+#if !defined(MAP_HUGETLB)
+#define MAP_HUGETLB       0x40000
+#endif
+#if !defined(MADV_HUGEPAGE)
+#define MADV_HUGEPAGE     14
+#endif
+
+/// mbind mode that restricts memory to the given NUMA nodes.
+#define MEMORY_MPOL_BIND  2
+#endif
+
 #define CLOCK_RATIO 10000
 
 #if defined(LS_MASTER) || defined(LS_SLAVE)
@@ -344,6 +363,24 @@ CSystem::CSystem(CConfigurator* cfg)
   iNumMemories = 0;
   iNumCPUs = 0;
   iNumMemoryBits = (int) myCfg->get_num_value("memory.bits", false, 27);
+  if(iNumMemoryBits < 24 || iNumMemoryBits > 35)
+    FAILURE(Configuration, "memory.bits must be from 24 (16 MB) to 35 (32 GB)");
+  if(iNumMemoryBits >= sizeof(size_t) * 8 - 1)
+    FAILURE(Configuration, "memory.bits is too large for a 32-bit host");
+
+  char*   pages = myCfg->get_text_value("memory.hugepages", "none");
+  if(!strcasecmp(pages, "none"))
+    memory_pages = MEMORY_PAGES_NORMAL;
+  else if(!strcasecmp(pages, "thp"))
+    memory_pages = MEMORY_PAGES_THP;
+  else if(!strcasecmp(pages, "hugetlb"))
+    memory_pages = MEMORY_PAGES_HUGETLB;
+  else
+    FAILURE(Configuration, "memory.hugepages must be none, thp or hugetlb");
+  u64 node = myCfg->get_num_value("memory.numa_node", false, (u64) -1);
+  if(node != (u64) -1 && node >= 1024)
+    FAILURE(Configuration, "memory.numa_node must be a host node from 0 to 1023");
+  memory_node = (int) node;
 
   //  iNumConfig = 0;
 #if defined(IDB)
@@ -375,18 +412,9 @@ CSystem::CSystem(CConfigurator* cfg)
   state.tig.HaltA = 0;
   state.tig.HaltB = 0;
 
-  if(iNumMemoryBits > 30)
-  {
+  alloc_memory();
 
-    // size_t may not be big enough, and makes 2^31 negative, so the
-    // alloc fails.  We're going to allocate the memory in
-    //  2^(iNumMemoryBits-10) chunks of 2^10.
-    CHECK_ALLOCATION(memory = calloc(1 << (iNumMemoryBits - 10), 1 << 10));
-  }
-  else
-    CHECK_ALLOCATION(memory = calloc(1 << iNumMemoryBits, 1));
-
-  cpu_lock_mutex = new CFastMutex("cpu-locking-lock");
+  memset((void*) cpu_lock_filter, 0, sizeof(cpu_lock_filter));
 
   printf("%s(%s): $Id$\n",
          cfg->get_myName(), cfg->get_myValue());
@@ -408,7 +436,7 @@ CSystem::~CSystem()
   for(i = 0; i < iNumMemories; i++)
     free(asMemories[i]);
 
-  free(memory);
+  free_memory();
 }
 
 /**
@@ -416,9 +444,108 @@ CSystem::~CSystem()
  **/
 void CSystem::ResetMem(unsigned int membits)
 {
-  free(memory);
+  free_memory();
   iNumMemoryBits = membits;
-  CHECK_ALLOCATION(memory = calloc(1 << iNumMemoryBits, 1));
+  alloc_memory();
+}
+
+/**
+ * \brief Allocate and clear the emulated memory.
+ *
+ * Guest memory is accessed all over the place, so with normal host pages
+ * a lot of time goes to host TLB misses. On Linux, memory.hugepages can ask
+ * for the memory to be backed by huge pages:
+ *   - thp: transparent huge pages (madvise), with the memory aligned to a
+ *     huge page boundary;
+ *   - hugetlb: pages from the hugetlbfs pool (these must have been reserved,
+ *     e.g. through /proc/sys/vm/nr_hugepages). If there aren't enough,
+ *     transparent huge pages are used.
+ * memory.numa_node binds the memory to one host NUMA node.
+ **/
+void CSystem::alloc_memory()
+{
+  memory_size = (size_t) 1 << iNumMemoryBits;
+  memory = 0;
+  memory_mapped = false;
+
+#if defined(__linux__)
+  if(memory_pages != MEMORY_PAGES_NORMAL || memory_node >= 0)
+  {
+    void*   p = MAP_FAILED;
+
+    if(memory_pages == MEMORY_PAGES_HUGETLB)
+    {
+      p = mmap(0, memory_size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if(p == MAP_FAILED)
+        printf("%%SYS-W-HUGETLB: Not enough huge pages reserved for memory (%s); using transparent huge pages.\n",
+               strerror(errno));
+    }
+
+    if(p == MAP_FAILED)
+    {
+
+      // Map one huge page more than needed, so the memory can start on a
+      // huge page boundary, and give back the excess at both ends.
+      char*   raw = (char*) mmap(0, memory_size + MEMORY_HUGE_PAGE,
+                                 PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if(raw == MAP_FAILED)
+        FAILURE(OutOfMemory, "Unable to map memory");
+
+      char*   aligned = (char*) (((size_t) raw + MEMORY_HUGE_PAGE - 1)
+                                 &~(size_t) (MEMORY_HUGE_PAGE - 1));
+      if(aligned != raw)
+        munmap(raw, aligned - raw);
+      if(raw + MEMORY_HUGE_PAGE != aligned)
+        munmap(aligned + memory_size, raw + MEMORY_HUGE_PAGE - aligned);
+      p = aligned;
+
+      if(memory_pages != MEMORY_PAGES_NORMAL
+       && madvise(p, memory_size, MADV_HUGEPAGE))
+        printf("%%SYS-W-THP: Transparent huge pages not available for memory (%s).\n",
+               strerror(errno));
+    }
+
+    if(memory_node >= 0)
+    {
+      unsigned long nodes[1024 / (8 * sizeof(unsigned long))];
+
+      memset(nodes, 0, sizeof(nodes));
+      nodes[memory_node / (8 * sizeof(unsigned long))] |=
+        1UL << (memory_node % (8 * sizeof(unsigned long)));
+      // maxnode counts one bit more than the kernel looks at
+      if(syscall(SYS_mbind, p, memory_size, MEMORY_MPOL_BIND, nodes,
+         8 * sizeof(nodes) + 1, 0))
+        printf("%%SYS-W-NUMA: Unable to bind memory to node %d (%s).\n",
+               memory_node, strerror(errno));
+    }
+
+    memory = p;
+    memory_mapped = true;
+  }
+#else
+  if(memory_pages != MEMORY_PAGES_NORMAL || memory_node >= 0)
+    printf("%%SYS-W-MEMORY: memory.hugepages and memory.numa_node are not supported on this host.\n");
+#endif
+  if(!memory_mapped)
+    CHECK_ALLOCATION(memory = calloc(memory_size, 1));
+
+  CHECK_ALLOCATION(code_pages = (u8*) calloc(memory_size >> CODE_PAGE_SHIFT, 1));
+}
+
+/**
+ * Free the emulated memory.
+ **/
+void CSystem::free_memory()
+{
+#if defined(__linux__)
+  if(memory_mapped)
+    munmap(memory, memory_size);
+  else
+#endif
+    free(memory);
+  free(code_pages);
 }
 
 /**
@@ -448,7 +575,45 @@ char* CSystem::PtrToMem(u64 address)
   if(address >> iNumMemoryBits) // Non Memory
     return 0;
 
-  return &(((char*) memory)[(int) address]);
+  return (char*) memory + (size_t) address;
+}
+
+/**
+ * \brief Invalidate cached instructions for memory that has been written to.
+ *
+ * Called for writes to memory by the CPU's and by DMA. Only pages that
+ * have been copied into an instruction cache are marked in code_pages, so
+ * this is cheap for writes to data pages. For a marked page, the cache
+ * lines for the page are invalidated in all CPU's, and the mark is removed
+ * until the page is cached again. The mark is removed before the lines are
+ * looked at, with a full barrier; a CPU filling a line from the page at the
+ * same time sees the mark gone after publishing the line, and drops it.
+ *
+ * \param address Physical address of the first byte written.
+ * \param length  Number of bytes written.
+ **/
+void CSystem::invalidate_code(u64 address, u64 length)
+{
+  u64 page;
+  u64 last;
+  int i;
+
+  if(!length || (address >> iNumMemoryBits))
+    return;
+
+  last = address + length - 1;
+  if(last >> iNumMemoryBits)
+    last = (U64(0x1) << iNumMemoryBits) - 1;
+
+  for(page = address >> CODE_PAGE_SHIFT; page <= (last >> CODE_PAGE_SHIFT); page++)
+  {
+    if(code_pages[page])
+    {
+      atomic_and_8(&code_pages[page], 0);
+      for(i = 0; i < iNumCPUs; i++)
+        acCPUs[i]->flush_icache_page(page << CODE_PAGE_SHIFT);
+    }
+  }
 }
 
 /**
@@ -628,32 +793,135 @@ int CSystem::SingleStep()
 #if defined(DEBUG_PORTACCESS)
 u64 lastport;
 #endif //defined(DEBUG_PORTACCESS)
-void CSystem::cpu_lock(int cpuid, u64 address)
+/**
+ * \brief Set the LL/SC reservation of a CPU (LDx_L).
+ *
+ * Every CPU owns its own reservation word, so no lock is needed. The
+ * reservation is entered in cpu_lock_filter, which lets writes to other
+ * granules skip the check in cpu_break_lock.
+ *
+ * \param cpuid    CPU doing the load-locked.
+ * \param address  Physical address that was read.
+ * \param data     Data that was read, for the compare-and-swap of the STx_C.
+ **/
+void CSystem::cpu_lock(int cpuid, u64 address, u64 data)
 {
-  SCOPED_FM_LOCK(cpu_lock_mutex);
+  u64 old;
 
   //  printf("cpu%d: lock %" LL "x.   \n",cpuid,address);
-  state.cpu_lock_flags |= (1 << cpuid);
-  state.cpu_lock_address[cpuid] = address;
+  state.cpu_lock_data[cpuid] = data;
+  atomic_or_8(&cpu_lock_filter[CPU_LOCK_HASH(address)], (u8) (1 << cpuid));
+  old = atomic_xchg_64(&state.cpu_lock_address[cpuid], address | CPU_LOCK_VALID);
+  if((old & CPU_LOCK_VALID) && CPU_LOCK_HASH(old) != CPU_LOCK_HASH(address))
+    atomic_and_8(&cpu_lock_filter[CPU_LOCK_HASH(old)], (u8) ~(1 << cpuid));
 }
 
+/**
+ * Take away a CPU's reservation.
+ *
+ * \return         true if the reservation was still held.
+ **/
 bool CSystem::cpu_unlock(int cpuid)
 {
-  SCOPED_FM_LOCK(cpu_lock_mutex);
+  u64 lock = atomic_xchg_64(&state.cpu_lock_address[cpuid], 0);
 
+  //  printf("cpu%d: unlock (%s).   \n",cpuid,(lock & CPU_LOCK_VALID)?"ok":"failed");
+  if(!(lock & CPU_LOCK_VALID))
+    return false;
+  atomic_and_8(&cpu_lock_filter[CPU_LOCK_HASH(lock)], (u8) ~(1 << cpuid));
+  return true;
+}
+
+/**
+ * \brief Store conditional (STx_C).
+ *
+ * The reservation is taken away atomically. If it was still held and the
+ * store is to the locked address in memory, the store is a host
+ * compare-and-swap against the data read by the LDx_L, so a write by another
+ * CPU that slipped in after its check of cpu_lock_filter still makes the
+ * store fail. Other stores are done through WriteMem.
+ *
+ * \param cpuid    CPU doing the store-conditional.
+ * \param address  Physical address to write to.
+ * \param dsize    Size of the data in bits (32 or 64).
+ * \param data     Data to write.
+ * \param source   CPU doing the store-conditional.
+ * \return         true if the store was done.
+ **/
+bool CSystem::cpu_store_cond(int cpuid, u64 address, int dsize, u64 data,
+                             CSystemComponent* source)
+{
+  u64   lock;
+  u64   a;
   bool  retval;
-  retval = state.cpu_lock_flags & (1 << cpuid);
 
-  //  printf("cpu%d: unlock (%s).   \n",cpuid,retval?"ok":"failed");
-  state.cpu_lock_flags &= ~(1 << cpuid);
+  lock = atomic_xchg_64(&state.cpu_lock_address[cpuid], 0);
+  if(!(lock & CPU_LOCK_VALID))
+  {
+    //  printf("cpu%d: unlock failed.   \n",cpuid);
+    return false;
+  }
+
+  atomic_and_8(&cpu_lock_filter[CPU_LOCK_HASH(lock)], (u8) ~(1 << cpuid));
+
+  a = address & U64(0x00000807ffffffff);
+  if((a >> iNumMemoryBits)
+   || (a & (dsize / 8 - 1))
+   || ((lock & ~CPU_LOCK_VALID) & U64(0x00000807ffffffff)) != a)
+  {
+    WriteMem(address, dsize, data, source);
+    return true;
+  }
+
+  if(dsize == 32)
+  {
+    u32 expect = endian_32((u32) state.cpu_lock_data[cpuid]);
+    retval = atomic_cas_32((u32*) ((u8*) memory + a), expect,
+                           endian_32((u32) data)) == expect;
+  }
+  else
+  {
+    u64 expect = endian_64(state.cpu_lock_data[cpuid]);
+    retval = atomic_cas_64((u64*) ((u8*) memory + a), expect,
+                           endian_64(data)) == expect;
+  }
+
+  if(retval)
+  {
+    if(cpu_lock_filter[CPU_LOCK_HASH(a)])
+      cpu_break_lock(a, source);
+    if(code_pages[a >> CODE_PAGE_SHIFT])
+      invalidate_code(a, dsize / 8);
+  }
+
   return retval;
 }
 
-void CSystem::cpu_break_lock(int cpuid, CSystemComponent* source)
+/**
+ * \brief Break the LL/SC reservations other CPUs hold on a granule that is
+ * being written to.
+ *
+ * A reservation is only cleared if it is unchanged, so a new LDx_L by the
+ * owning CPU is never lost.
+ **/
+void CSystem::cpu_break_lock(u64 address, CSystemComponent* source)
 {
-  SCOPED_FM_LOCK(cpu_lock_mutex);
-  printf("cpu%d: lock broken by %s.   \n", cpuid, source->devid_string);
-  state.cpu_lock_flags &= ~(1 << cpuid);
+  u8  cpus = cpu_lock_filter[CPU_LOCK_HASH(address)];
+  u64 lock;
+
+  for(int i = 0; i < iNumCPUs; i++)
+  {
+    if(!(cpus & (1 << i)) || source == acCPUs[i])
+      continue;
+
+    lock = state.cpu_lock_address[i];
+    if((lock & CPU_LOCK_VALID) && !((lock ^ address) & CPU_LOCK_GRANULE)
+     && atomic_cas_64(&state.cpu_lock_address[i], lock, 0) == lock)
+    {
+      atomic_and_8(&cpu_lock_filter[CPU_LOCK_HASH(lock)], (u8) ~(1 << i));
+      printf("cpu%d: lock broken by %s.   \n", i, source->devid_string);
+    }
+  }
 }
 
 /**
@@ -741,178 +1009,185 @@ void CSystem::cpu_break_lock(int cpuid, CSystemComponent* source)
 void CSystem::WriteMem(u64 address, int dsize, u64 data, CSystemComponent*  source)
 {
   u64   a;
-  int   i;
   u8*   p;
 #if defined(ALIGN_MEM_ACCESS)
   u64   t64;
   u32   t32;
   u16   t16;
 #endif //defined(ALIGN_MEM_ACCESS)
-  if(state.cpu_lock_flags)
-  {
-    for(i = 0; i < iNumCPUs; i++)
-    {
-      if((state.cpu_lock_flags & (1 << i)) && (
-           !((state.cpu_lock_address[i] ^ address) & U64(0x00000807ffffff00)))
-       && (source != acCPUs[i])) cpu_break_lock(i, source);
-    }
-  }
+  if(cpu_lock_filter[CPU_LOCK_HASH(address)])
+    cpu_break_lock(address, source);
 
   a = address & U64(0x00000807ffffffff);
 
   if(a >> iNumMemoryBits) // non-memory
   {
+    WriteIO(a, dsize, data, source);
+    return;
+  }
 
-    // check registered device memory ranges
-    for(i = 0; i < iNumMemories; i++)
-    {
-      if((a >= asMemories[i]->base)
-       && (a < asMemories[i]->base + asMemories[i]->length))
-      {
-        asMemories[i]->component->WriteMem(asMemories[i]->index,
-                                           a - asMemories[i]->base, dsize, data);
-        return;
-      }
-    }
+  p = (u8*) memory + a;
 
-    if((a == U64(0x00000801FC000CF8)) && (dsize == 32))
-    {
-      state.cf8_address[0] = (u32) data & 0x00ffffff;
-      return;
-    }
+  // Writing to a page that has instructions cached? Keep the icache coherent.
+  if(code_pages[a >> CODE_PAGE_SHIFT])
+    invalidate_code(a, dsize / 8);
 
-    if((a == U64(0x00000803FC000CF8)) && (dsize == 32))
-    {
-      state.cf8_address[1] = (u32) data & 0x00ffffff;
-      return;
-    }
+  switch(dsize)
+  {
+  case 8:   *((u8*) p) = (u8) data; break;
+  case 16:  *((u16*) p) = endian_16((u16) data); break;
+  case 32:  *((u32*) p) = endian_32((u32) data); break;
+  default:  *((u64*) p) = endian_64((u64) data);
+  }
+}
 
-    if((a == U64(0x00000801FC000CFC)) && (dsize == 32))
-    {
-      printf("PCI 0 config space write through CF8/CFC mechanism.   \n");
-      getc(stdin);
-      WriteMem(U64(0x00000801FE000000) | state.cf8_address[0], dsize, data,
-               source);
-      return;
-    }
+/**
+ * \brief Write to a system address that is not memory: chipset registers,
+ * PCI space or a device. Called from WriteMem.
+ **/
+void CSystem::WriteIO(u64 a, int dsize, u64 data, CSystemComponent* source)
+{
+  int i;
 
-    if((a == U64(0x00000803FC000CFC)) && (dsize == 32))
+  // check registered device memory ranges
+  for(i = 0; i < iNumMemories; i++)
+  {
+    if((a >= asMemories[i]->base)
+     && (a < asMemories[i]->base + asMemories[i]->length))
     {
-      printf("PCI 1 config space write through CF8/CFC mechanism.   \n");
-      getc(stdin);
-      WriteMem(U64(0x00000803FE000000) | state.cf8_address[1], dsize, data,
-               source);
+      asMemories[i]->component->WriteMem(asMemories[i]->index,
+                                         a - asMemories[i]->base, dsize, data);
       return;
     }
+  }
 
-    if(a >= U64(0x00000801A0000000) && a <= U64(0x00000801AFFFFFFF))
-    {
-      cchip_csr_write((u32) a & 0xFFFFFFF, data, source);
-      return;
-    }
+  if((a == U64(0x00000801FC000CF8)) && (dsize == 32))
+  {
+    state.cf8_address[0] = (u32) data & 0x00ffffff;
+    return;
+  }
 
-    if(a >= U64(0x0000080180000000) && a <= U64(0x000008018FFFFFFF))
-    {
-      pchip_csr_write(0, (u32) a & 0xFFFFFFF, data);
-      return;
-    }
+  if((a == U64(0x00000803FC000CF8)) && (dsize == 32))
+  {
+    state.cf8_address[1] = (u32) data & 0x00ffffff;
+    return;
+  }
 
-    if(a >= U64(0x0000080380000000) && a <= U64(0x000008038FFFFFFF))
-    {
-      pchip_csr_write(1, (u32) a & 0xFFFFFFF, data);
-      return;
-    }
+  if((a == U64(0x00000801FC000CFC)) && (dsize == 32))
+  {
+    printf("PCI 0 config space write through CF8/CFC mechanism.   \n");
+    getc(stdin);
+    WriteMem(U64(0x00000801FE000000) | state.cf8_address[0], dsize, data,
+             source);
+    return;
+  }
 
-    if(a >= U64(0x00000801B0000000) && a <= U64(0x00000801BFFFFFFF))
-    {
-      dchip_csr_write((u32) a & 0xFFFFFFF, (u8) data & 0xff);
-      return;
-    }
+  if((a == U64(0x00000803FC000CFC)) && (dsize == 32))
+  {
+    printf("PCI 1 config space write through CF8/CFC mechanism.   \n");
+    getc(stdin);
+    WriteMem(U64(0x00000803FE000000) | state.cf8_address[1], dsize, data,
+             source);
+    return;
+  }
 
-    if(a >= U64(0x0000080100000000) && a <= U64(0x000008013FFFFFFF))
-    {
-      tig_write((u32) a & 0x3FFFFFFF, (u8) data);
-      return;
-    }
+  if(a >= U64(0x00000801A0000000) && a <= U64(0x00000801AFFFFFFF))
+  {
+    cchip_csr_write((u32) a & 0xFFFFFFF, data, source);
+    return;
+  }
 
-    if(a >= U64(0x801fc000000) && a < U64(0x801fe000000))
-    {
+  if(a >= U64(0x0000080180000000) && a <= U64(0x000008018FFFFFFF))
+  {
+    pchip_csr_write(0, (u32) a & 0xFFFFFFF, data);
+    return;
+  }
 
-      // Unused PCI I/O space
-      //      if (source)
-      //        printf("Write to unknown IO port %"LL"x on PCI 0 from %s   \n",a & U64(0x1ffffff),source->devid_string);
-      //      else
-      //        printf("Write to unknown IO port %"LL"x on PCI 0   \n",a & U64(0x1ffffff));
-      return;
-    }
+  if(a >= U64(0x0000080380000000) && a <= U64(0x000008038FFFFFFF))
+  {
+    pchip_csr_write(1, (u32) a & 0xFFFFFFF, data);
+    return;
+  }
 
-    if(a >= U64(0x803fc000000) && a < U64(0x803fe000000))
-    {
+  if(a >= U64(0x00000801B0000000) && a <= U64(0x00000801BFFFFFFF))
+  {
+    dchip_csr_write((u32) a & 0xFFFFFFF, (u8) data & 0xff);
+    return;
+  }
 
-      // Unused PCI I/O space
-      if(source)
-      {
-        printf("Write to unknown IO port %"LL "x on PCI 1 from %s   \n",
-               a & U64(0x1ffffff), source->devid_string);
-      }
-      else
-        printf("Write to unknown IO port %"LL "x on PCI 1   \n",
-               a & U64(0x1ffffff));
-      return;
-    }
+  if(a >= U64(0x0000080100000000) && a <= U64(0x000008013FFFFFFF))
+  {
+    tig_write((u32) a & 0x3FFFFFFF, (u8) data);
+    return;
+  }
 
-    if(a >= U64(0x80000000000) && a < U64(0x80100000000))
-    {
+  if(a >= U64(0x801fc000000) && a < U64(0x801fe000000))
+  {
 
-      // Unused PCI memory space
-      u64 paddr = a & U64(0xffffffff);
-      if(paddr > 0xb8fff || paddr < 0xb8000)
-      { // skip legacy video
-        if(source)
-        {
-          printf("Write to unknown memory %"LL "x on PCI 0 from %s   \n",
-                 a & U64(0xffffffff), source->devid_string);
-        }
-        else
-          printf("Write to unknown memory %"LL "x on PCI 0   \n",
-                 a & U64(0xffffffff));
-      }
-    }
+    // Unused PCI I/O space
+    //      if (source)
+    //        printf("Write to unknown IO port %"LL"x on PCI 0 from %s   \n",a & U64(0x1ffffff),source->devid_string);
+    //      else
+    //        printf("Write to unknown IO port %"LL"x on PCI 0   \n",a & U64(0x1ffffff));
+    return;
+  }
 
-    if(a >= U64(0x80200000000) && a < U64(0x80300000000))
+  if(a >= U64(0x803fc000000) && a < U64(0x803fe000000))
+  {
+
+    // Unused PCI I/O space
+    if(source)
     {
+      printf("Write to unknown IO port %"LL "x on PCI 1 from %s   \n",
+             a & U64(0x1ffffff), source->devid_string);
+    }
+    else
+      printf("Write to unknown IO port %"LL "x on PCI 1   \n",
+             a & U64(0x1ffffff));
+    return;
+  }
+
+  if(a >= U64(0x80000000000) && a < U64(0x80100000000))
+  {
 
-      // Unused PCI memory space
+    // Unused PCI memory space
+    u64 paddr = a & U64(0xffffffff);
+    if(paddr > 0xb8fff || paddr < 0xb8000)
+    { // skip legacy video
       if(source)
       {
-        printf("Write to unknown memory %"LL "x on PCI 1 from %s   \n",
+        printf("Write to unknown memory %"LL "x on PCI 0 from %s   \n",
                a & U64(0xffffffff), source->devid_string);
       }
       else
-        printf("Write to unknown memory %"LL "x on PCI 1   \n",
+        printf("Write to unknown memory %"LL "x on PCI 0   \n",
                a & U64(0xffffffff));
-      return;
     }
+  }
 
-#ifdef DEBUG_UNKMEM
+  if(a >= U64(0x80200000000) && a < U64(0x80300000000))
+  {
+
+    // Unused PCI memory space
     if(source)
-      printf("Write to unknown memory %"LL "x from %s   \n", a,
-             source->devid_string);
+    {
+      printf("Write to unknown memory %"LL "x on PCI 1 from %s   \n",
+             a & U64(0xffffffff), source->devid_string);
+    }
     else
-      printf("Write to unknown memory %"LL "x   \n", a);
-#endif //defined(DEBUG_UNKMEM)
+      printf("Write to unknown memory %"LL "x on PCI 1   \n",
+             a & U64(0xffffffff));
     return;
   }
 
-  p = (u8*) memory + a;
-
-  switch(dsize)
-  {
-  case 8:   *((u8*) p) = (u8) data; break;
-  case 16:  *((u16*) p) = endian_16((u16) data); break;
-  case 32:  *((u32*) p) = endian_32((u32) data); break;
-  default:  *((u64*) p) = endian_64((u64) data);
-  }
+#ifdef DEBUG_UNKMEM
+  if(source)
+    printf("Write to unknown memory %"LL "x from %s   \n", a,
+           source->devid_string);
+  else
+    printf("Write to unknown memory %"LL "x   \n", a);
+#endif //defined(DEBUG_UNKMEM)
+  return;
 }
 
 /**
@@ -1000,156 +1275,163 @@ void CSystem::WriteMem(u64 address, int dsize, u64 data, CSystemComponent*  sour
 u64 CSystem::ReadMem(u64 address, int dsize, CSystemComponent* source)
 {
   u64   a;
-  int   i;
   u8*   p;
 
   a = address & U64(0x00000807ffffffff);
   if(a >> iNumMemoryBits) // Non Memory
-  {
+    return ReadIO(a, dsize, source);
 
-    // check registered device memory ranges
-    for(i = 0; i < iNumMemories; i++)
-    {
-      if((a >= asMemories[i]->base)
-       && (a < asMemories[i]->base + asMemories[i]->length))
-        return asMemories[i]->component->ReadMem(asMemories[i]->index,
-                                                 a - asMemories[i]->base, dsize);
-    }
+  p = (u8*) memory + a;
 
-    if((a == U64(0x00000801FC000CFC)) && (dsize == 32))
-    {
-      printf("PCI 0 config space read through CF8/CFC mechanism.   \n");
-      getc(stdin);
-      return ReadMem(U64(0x00000801FE000000) | state.cf8_address[0], dsize,
-                     source);
-    }
+  switch(dsize)
+  {
+  case 8:   return *((u8*) p);
+  case 16:  return endian_16(*((u16*) p));
+  case 32:  return endian_32(*((u32*) p));
+  default:  return endian_64(*((u64*) p));
+  }
+}
 
-    if((a == U64(0x00000803FC000CFC)) && (dsize == 32))
-    {
-      printf("PCI 1 config space read through CF8/CFC mechanism.   \n");
-      getc(stdin);
-      return ReadMem(U64(0x00000803FE000000) | state.cf8_address[1], dsize,
-                     source);
-    }
+/**
+ * \brief Read from a system address that is not memory: chipset registers,
+ * PCI space or a device. Called from ReadMem.
+ **/
+u64 CSystem::ReadIO(u64 a, int dsize, CSystemComponent* source)
+{
+  int i;
 
-    if(a >= U64(0x00000801A0000000) && a <= U64(0x00000801AFFFFFFF))
-      return cchip_csr_read((u32) a & 0xFFFFFFF, source);
+  // check registered device memory ranges
+  for(i = 0; i < iNumMemories; i++)
+  {
+    if((a >= asMemories[i]->base)
+     && (a < asMemories[i]->base + asMemories[i]->length))
+      return asMemories[i]->component->ReadMem(asMemories[i]->index,
+                                               a - asMemories[i]->base, dsize);
+  }
 
-    if(a >= U64(0x0000080180000000) && a <= U64(0x000008018FFFFFFF))
-      return pchip_csr_read(0, (u32) a & 0xFFFFFFF);
+  if((a == U64(0x00000801FC000CFC)) && (dsize == 32))
+  {
+    printf("PCI 0 config space read through CF8/CFC mechanism.   \n");
+    getc(stdin);
+    return ReadMem(U64(0x00000801FE000000) | state.cf8_address[0], dsize,
+                   source);
+  }
 
-    if(a >= U64(0x0000080380000000) && a <= U64(0x000008038FFFFFFF))
-      return pchip_csr_read(1, (u32) a & 0xFFFFFFF);
+  if((a == U64(0x00000803FC000CFC)) && (dsize == 32))
+  {
+    printf("PCI 1 config space read through CF8/CFC mechanism.   \n");
+    getc(stdin);
+    return ReadMem(U64(0x00000803FE000000) | state.cf8_address[1], dsize,
+                   source);
+  }
 
-    if(a >= U64(0x00000801B0000000) && a <= U64(0x00000801BFFFFFFF))
-      return dchip_csr_read((u32) a & 0xFFFFFFF) * U64(0x0101010101010101);
+  if(a >= U64(0x00000801A0000000) && a <= U64(0x00000801AFFFFFFF))
+    return cchip_csr_read((u32) a & 0xFFFFFFF, source);
 
-    if(a >= U64(0x0000080100000000) && a <= U64(0x000008013FFFFFFF))
-      return tig_read((u32) a & 0x3FFFFFFF);
+  if(a >= U64(0x0000080180000000) && a <= U64(0x000008018FFFFFFF))
+    return pchip_csr_read(0, (u32) a & 0xFFFFFFF);
 
-    if((a >= U64(0x801fe000000) && a < U64(0x801ff000000))
-     || (a >= U64(0x803fe000000) && a < U64(0x803ff000000)))
-    {
+  if(a >= U64(0x0000080380000000) && a <= U64(0x000008038FFFFFFF))
+    return pchip_csr_read(1, (u32) a & 0xFFFFFFF);
 
-      // Unused PCI configuration space
-      switch(dsize)
-      {
-      case 8:   return X64_BYTE;
-      case 16:  return X64_WORD;
-      case 32:  return X64_LONG;
-      case 64:  return X64_QUAD;
-      }
-    }
+  if(a >= U64(0x00000801B0000000) && a <= U64(0x00000801BFFFFFFF))
+    return dchip_csr_read((u32) a & 0xFFFFFFF) * U64(0x0101010101010101);
 
-    if(a >= U64(0x800000c0000) && a < U64(0x801000e0000))
-    {
+  if(a >= U64(0x0000080100000000) && a <= U64(0x000008013FFFFFFF))
+    return tig_read((u32) a & 0x3FFFFFFF);
 
-      // Unused PCI ROM BIOS space
-      return 0;
-    }
+  if((a >= U64(0x801fe000000) && a < U64(0x801ff000000))
+   || (a >= U64(0x803fe000000) && a < U64(0x803ff000000)))
+  {
 
-    if(a >= U64(0x801fc000000) && a < U64(0x801fe000000))
+    // Unused PCI configuration space
+    switch(dsize)
     {
-
-      // Unused PCI I/O space
-      //if (source)
-      //  printf("Read from unknown IO port %"LL"x on PCI 0 from %s   \n",a & U64(0x1ffffff),source->devid_string);
-      //else
-      //  printf("Read from unknown IO port %"LL"x on PCI 0   \n",a & U64(0x1ffffff));
-      return 0;
+    case 8:   return X64_BYTE;
+    case 16:  return X64_WORD;
+    case 32:  return X64_LONG;
+    case 64:  return X64_QUAD;
     }
+  }
 
-    if(a >= U64(0x803fc000000) && a < U64(0x803fe000000))
-    {
+  if(a >= U64(0x800000c0000) && a < U64(0x801000e0000))
+  {
 
-      // Unused PCI I/O space
-      if(source)
-      {
-        printf("Read from unknown IO port %"LL "x on PCI 1 from %s   \n",
-               a & U64(0x1ffffff), source->devid_string);
-      }
-      else
-        printf("Read from unknown IO port %"LL "x on PCI 1   \n",
-               a & U64(0x1ffffff));
-      return 0;
-    }
+    // Unused PCI ROM BIOS space
+    return 0;
+  }
 
-    if(a >= U64(0x80000000000) && a < U64(0x80100000000))
-    {
+  if(a >= U64(0x801fc000000) && a < U64(0x801fe000000))
+  {
 
-      // Unused PCI memory space
-      u64 paddr = a & U64(0xffffffff);
-      if(paddr > 0xb8fff || paddr < 0xb8000)
-      { // skip legacy video
-        if(source)
-        {
-          printf("Read from unknown memory %"LL "x on PCI 0 from %s   \n",
-                 a & U64(0xffffffff), source->devid_string);
-        }
-        else
-          printf("Read from unknown memory %"LL "x on PCI 0   \n",
-                 a & U64(0xffffffff));
-      }
+    // Unused PCI I/O space
+    //if (source)
+    //  printf("Read from unknown IO port %"LL"x on PCI 0 from %s   \n",a & U64(0x1ffffff),source->devid_string);
+    //else
+    //  printf("Read from unknown IO port %"LL"x on PCI 0   \n",a & U64(0x1ffffff));
+    return 0;
+  }
 
-      return 0;
-    }
+  if(a >= U64(0x803fc000000) && a < U64(0x803fe000000))
+  {
 
-    if(a >= U64(0x80200000000) && a < U64(0x80300000000))
+    // Unused PCI I/O space
+    if(source)
     {
+      printf("Read from unknown IO port %"LL "x on PCI 1 from %s   \n",
+             a & U64(0x1ffffff), source->devid_string);
+    }
+    else
+      printf("Read from unknown IO port %"LL "x on PCI 1   \n",
+             a & U64(0x1ffffff));
+    return 0;
+  }
 
-      // Unused PCI memory space
+  if(a >= U64(0x80000000000) && a < U64(0x80100000000))
+  {
+
+    // Unused PCI memory space
+    u64 paddr = a & U64(0xffffffff);
+    if(paddr > 0xb8fff || paddr < 0xb8000)
+    { // skip legacy video
       if(source)
       {
-        printf("Read from unknown memory %"LL "x on PCI 1 from %s   \n",
+        printf("Read from unknown memory %"LL "x on PCI 0 from %s   \n",
                a & U64(0xffffffff), source->devid_string);
       }
       else
-        printf("Read from unknown memory %"LL "x on PCI 1   \n",
+        printf("Read from unknown memory %"LL "x on PCI 0   \n",
                a & U64(0xffffffff));
-      return 0;
     }
 
-#if defined(DEBUG_UNKMEM)
+    return 0;
+  }
+
+  if(a >= U64(0x80200000000) && a < U64(0x80300000000))
+  {
+
+    // Unused PCI memory space
     if(source)
-      printf("Read from unknown memory %"LL "x from %s   \n", a,
-             source->devid_string);
+    {
+      printf("Read from unknown memory %"LL "x on PCI 1 from %s   \n",
+             a & U64(0xffffffff), source->devid_string);
+    }
     else
-      printf("Read from unknown memory %"LL "x   \n", a);
-#endif //defined(DEBUG_UNKMEM)
-    return 0x00;
-
-    //                    return 0x77; // 7f
+      printf("Read from unknown memory %"LL "x on PCI 1   \n",
+             a & U64(0xffffffff));
+    return 0;
   }
 
-  p = (u8*) memory + a;
+#if defined(DEBUG_UNKMEM)
+  if(source)
+    printf("Read from unknown memory %"LL "x from %s   \n", a,
+           source->devid_string);
+  else
+    printf("Read from unknown memory %"LL "x   \n", a);
+#endif //defined(DEBUG_UNKMEM)
+  return 0x00;
 
-  switch(dsize)
-  {
-  case 8:   return *((u8*) p);
-  case 16:  return endian_16(*((u16*) p));
-  case 32:  return endian_32(*((u32*) p));
-  default:  return endian_64(*((u64*) p));
-  }
+  //                    return 0x77; // 7f
 }
 
 /**
@@ -1626,6 +1908,25 @@ void CSystem::pchip_csr_write(int num, u32 a, u64 data)
   }
 }
 
+/**
+ * \brief Read an array address register (AAR0-3).
+ *
+ * All memory is in a single block. A Typhoon array holds at most 8 GB
+ * (ASIZ 1010), so memory larger than that is shown to the console as up to
+ * four arrays of 8 GB each, one after the other.
+ *
+ * Source: 21272 HRM, 10.2.2.2 (AARx: ADDR <34:24>, ASIZ <15:12>).
+ **/
+u64 CSystem::cchip_aar(int array)
+{
+  unsigned int  bits = (iNumMemoryBits > 33) ? 33 : iNumMemoryBits;
+  u64           base = (u64) array << bits;
+
+  if(base >> iNumMemoryBits)
+    return 0;   // array not present
+  return base | ((u64) (bits - 23) << 12);
+}
+
 u64 CSystem::cchip_csr_read(u32 a, CSystemComponent* source)
 {
   CAlphaCPU*  cpu = (CAlphaCPU*) source;
@@ -1640,16 +1941,10 @@ u64 CSystem::cchip_csr_read(u32 a, CSystemComponent* source)
     return state.cchip.misc | ((CAlphaCPU*) source)->get_cpuid();
 
   case 0x100:
-
-    // WE PUT ALL OUR MEMORY IN A SINGLE ARRAY FOR NOW...
-    return((u64) (iNumMemoryBits - 23) << 12);  //size
-
   case 0x140:
   case 0x180:
   case 0x1c0:
-
-    // WE PUT ALL OUR MEMORY IN A SINGLE ARRAY FOR NOW...
-    return 0;
+    return cchip_aar((a >> 6) & 3);
 
   case 0x200:
   case 0x240:
@@ -2420,6 +2715,7 @@ void CSystem::start_threads()
   for(i = 0; i < iNumComponents; i++)
     acComponents[i]->start_threads();
   printf("\n");
+  CSystemComponent::report_threads();
 
   for(i = 0; i < iNumCPUs; i++)
     acCPUs[i]->release_threads();
@@ -2440,11 +2736,11 @@ void CSystem::SaveState(const char* fn)
 {
   FILE*         f;
   int           i;
-  unsigned int  m;
+  size_t        m;
   unsigned int  j;
   int*          mem = (int*) memory;
   int           int0 = 0;
-  unsigned int  memints = (1 << iNumMemoryBits) / (unsigned int) sizeof(int);
+  size_t        memints = memory_size / sizeof(int);
   u32           temp_32;
 
   f = fopen(fn, "wb");
@@ -2466,7 +2762,7 @@ void CSystem::SaveState(const char* fn)
       {
         j = 0;
         m++;
-        while(!mem[m] && (m < memints))
+        while((m < memints) && !mem[m])
         {
           m++;
           j++;
@@ -2474,7 +2770,7 @@ void CSystem::SaveState(const char* fn)
             break;
         }
 
-        if(mem[m])
+        if(m < memints && mem[m])
           m--;
         fwrite(&int0, 1, sizeof(int), f);
         fwrite(&j, 1, sizeof(int), f);
@@ -2500,10 +2796,10 @@ void CSystem::RestoreState(const char* fn)
 {
   FILE*         f;
   int           i;
-  unsigned int  m;
+  size_t        m;
   unsigned int  j;
   int*          mem = (int*) memory;
-  unsigned int  memints = (1 << iNumMemoryBits) / (unsigned int) sizeof(int);
+  size_t        memints = memory_size / sizeof(int);
   u32           temp_32;
 
   f = fopen(fn, "rb");
@@ -2535,7 +2831,7 @@ void CSystem::RestoreState(const char* fn)
     if(!mem[m])
     {
       fread(&j, 1, sizeof(int), f);
-      while(j--)
+      while(j-- && m + 1 < memints)
       {
         mem[++m] = 0;
       }
@@ -2544,6 +2840,13 @@ void CSystem::RestoreState(const char* fn)
 
   fread(&state, sizeof(state), 1, f);
 
+  memset((void*) cpu_lock_filter, 0, sizeof(cpu_lock_filter));
+  for(i = 0; i < iNumCPUs; i++)
+  {
+    if(state.cpu_lock_address[i] & CPU_LOCK_VALID)
+      cpu_lock_filter[CPU_LOCK_HASH(state.cpu_lock_address[i])] |= (u8) (1 << i);
+  }
+
   // components
   //
   //  Components should also save any non-initial memory-registrations and re-register upon restore!
@@ -2563,16 +2866,16 @@ void CSystem::RestoreState(const char* fn)
 void CSystem::DumpMemory(unsigned int filenum)
 {
   char    file[100];
-  int     x;
+  size_t  x;
   int*    mem = (int*) memory;
   FILE*   f;
 
   sprintf(file, "memory_%012d.dmp", filenum);
   f = fopen(file, "wb");
 
-  x = (1 << iNumMemoryBits) / (unsigned int) sizeof(int) / 2;
+  x = memory_size / sizeof(int) / 2;
 
-  while(!mem[x - 1])
+  while(x && !mem[x - 1])
     x--;
 
   fwrite(mem, 1, x * sizeof(int), f);
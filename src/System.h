@@ -180,6 +180,24 @@ extern bool   profile_started;
 extern char*  dbg_strptr;
 #endif
 
+/// Host pages used for the emulated memory (memory.hugepages).
+#define MEMORY_PAGES_NORMAL   0
+#define MEMORY_PAGES_THP      1
+#define MEMORY_PAGES_HUGETLB  2
+
+/// Granularity (in address bits) of the tracking of memory that contains cached code.
+#define CODE_PAGE_SHIFT 13
+
+/// Set in SSys_state::cpu_lock_address when the CPU holds an LL/SC reservation.
+#define CPU_LOCK_VALID        U64(0x8000000000000000)
+
+/// Address bits that select the lock granule (256 bytes; bits 35-42 are don't cares).
+#define CPU_LOCK_GRANULE      U64(0x00000807ffffff00)
+
+/// Number of entries in the filter of granules that might be locked.
+#define CPU_LOCK_FILTER_SIZE  1024
+#define CPU_LOCK_HASH(a)      (((a) >> 8) & (CPU_LOCK_FILTER_SIZE - 1))
+
 /// Structure used for mapping memory ranges to devices.
 struct SMemoryUser
 {
@@ -219,6 +237,10 @@ class CSystem
   public:
     void          DumpMemory(unsigned int filenum);
     char*         PtrToMem(u64 address);
+    void          mark_code_page(u64 address);
+    bool          is_code_page(u64 address);
+    bool          is_write_watched(u64 address);
+    void          invalidate_code(u64 address, u64 length);
     unsigned int  get_memory_bits();
     void          RestoreState(const char* fn);
     void          SaveState(const char* fn);
@@ -230,6 +252,8 @@ class CSystem
     u64           ReadMem(u64 address, int dsize, CSystemComponent* source);
     void          WriteMem(u64 address, int dsize, u64 data,
                            CSystemComponent*  source);
+    template <int dsize> u64  ReadMem(u64 address, CSystemComponent* source);
+    template <int dsize> void WriteMem(u64 address, u64 data, CSystemComponent* source);
     void          Run();
     int           SingleStep();
 
@@ -248,6 +272,10 @@ class CSystem
     CAlphaCPU*    get_cpu(int cpunum) { return acCPUs[cpunum]; };
     int           get_cpu_num()       { return iNumCPUs; };
 
+    /// What is_write_watched looks at, for stores in translated code
+    volatile u8*  get_cpu_lock_filter() { return cpu_lock_filter; };
+    u8**          get_code_pages()      { return &code_pages; };
+
     virtual       ~CSystem();
     unsigned int  iNumMemoryBits;
 
@@ -263,10 +291,17 @@ class CSystem
     u64           get_c_dim(int ProcNum);
     void          set_c_dim(int ProcNum, u64 value);
 
-    void          cpu_lock(int cpuid, u64 address);
+    void          cpu_lock(int cpuid, u64 address, u64 data);
     bool          cpu_unlock(int cpuid);
-    void          cpu_break_lock(int cpuid, CSystemComponent* source);
+    bool          cpu_store_cond(int cpuid, u64 address, int dsize, u64 data,
+                                 CSystemComponent* source);
+    void          cpu_break_lock(u64 address, CSystemComponent* source);
   private:
+    void          alloc_memory();
+    void          free_memory();
+    u64           ReadIO(u64 a, int dsize, CSystemComponent* source);
+    void          WriteIO(u64 a, int dsize, u64 data, CSystemComponent* source);
+    u64           cchip_aar(int array);
     u64           cchip_csr_read(u32 address, CSystemComponent* source);
     void          cchip_csr_write(u32 address, u64 data, CSystemComponent*  source);
     u64           pchip_csr_read(int num, u32 address);
@@ -277,13 +312,12 @@ class CSystem
     void          tig_write(u32 address, u8 data);
 
     int           iNumCPUs;
-    CFastMutex*   cpu_lock_mutex;
 
     /// The state structure contains all elements that need to be saved to the statefile.
     struct SSys_state
     {
-      int cpu_lock_flags;
-      u64 cpu_lock_address[4];
+      u64 cpu_lock_address[4];  /**< LL/SC reservation: CPU_LOCK_VALID | physical address */
+      u64 cpu_lock_data[4];     /**< Data read by the LDx_L, compared by the STx_C */
 
       /**
      * TIGbus state data
@@ -465,6 +499,17 @@ class CSystem
       u32 cf8_address[2];
     } state;
     void*                 memory;
+    size_t                memory_size;    /**< Size of memory in bytes */
+    bool                  memory_mapped;  /**< memory comes from mmap rather than calloc */
+    int                   memory_pages;   /**< Host pages used for memory (MEMORY_PAGES_xxx) */
+    int                   memory_node;    /**< Host NUMA node for memory, or -1 */
+    u8*                   code_pages; /**< Pages of memory that have cached instructions */
+
+    /**
+     * Per CPU-bitmask of the reservations whose granule hashes to each entry.
+     * A write to a granule with an empty entry cannot break a lock.
+     **/
+    volatile u8           cpu_lock_filter[CPU_LOCK_FILTER_SIZE];
 
     //    void * memmap;
     int                   iNumComponents;
@@ -483,6 +528,85 @@ class CSystem
 #endif
 };
 
+/**
+ * Remember that a page of memory is being copied into an instruction cache,
+ * so writes to it must invalidate the cached instructions. A new mark is
+ * set with a full barrier, so it is seen by writers before the page is
+ * read.
+ **/
+inline void CSystem::mark_code_page(u64 address)
+{
+  if(!(address >> iNumMemoryBits) && !code_pages[address >> CODE_PAGE_SHIFT])
+    atomic_or_8(&code_pages[address >> CODE_PAGE_SHIFT], 1);
+}
+
+/**
+ * Check if a page of memory is still marked as cached by mark_code_page.
+ **/
+inline bool CSystem::is_code_page(u64 address)
+{
+  return !(address >> iNumMemoryBits) && code_pages[address >> CODE_PAGE_SHIFT];
+}
+
+/**
+ * Check if a write to an address needs to go through WriteMem, because it
+ * is not memory, or could break an LL/SC lock or modify cached instructions.
+ **/
+inline bool CSystem::is_write_watched(u64 address)
+{
+  return (address >> iNumMemoryBits)
+    || cpu_lock_filter[CPU_LOCK_HASH(address)]
+    || code_pages[address >> CODE_PAGE_SHIFT];
+}
+
+/**
+ * Read 8, 16, 32 or 64 bits from a system address, with the size known at
+ * compile time. A read from memory is a bounds check and a load; anything
+ * else goes to ReadIO.
+ **/
+template <int dsize> inline u64 CSystem::ReadMem(u64 address, CSystemComponent* source)
+{
+  u64 a = address & U64(0x00000807ffffffff);
+
+  if(a >> iNumMemoryBits)
+    return ReadIO(a, dsize, source);
+
+  u8*   p = (u8*) memory + a;
+  switch(dsize)
+  {
+  case 8:   return *((u8*) p);
+  case 16:  return endian_16(*((u16*) p));
+  case 32:  return endian_32(*((u32*) p));
+  default:  return endian_64(*((u64*) p));
+  }
+}
+
+/**
+ * Write 8, 16, 32 or 64 bits to a system address, with the size known at
+ * compile time. A write to memory that can't affect an LL/SC lock or cached
+ * instructions is a bounds check and a store; anything else goes to the
+ * general WriteMem.
+ **/
+template <int dsize> inline void CSystem::WriteMem(u64 address, u64 data, CSystemComponent* source)
+{
+  u64 a = address & U64(0x00000807ffffffff);
+
+  if(is_write_watched(a))
+  {
+    WriteMem(address, dsize, data, source);
+    return;
+  }
+
+  u8*   p = (u8*) memory + a;
+  switch(dsize)
+  {
+  case 8:   *((u8*) p) = (u8) data; break;
+  case 16:  *((u16*) p) = endian_16((u16) data); break;
+  case 32:  *((u32*) p) = endian_32((u32) data); break;
+  default:  *((u64*) p) = endian_64((u64) data);
+  }
+}
+
 inline u64 CSystem::get_c_misc()
 {
   return state.cchip.misc;
@@ -95,3 +95,200 @@ CSystemComponent::~CSystemComponent()
 {
   free(devid_string);
 }
+
+/// Maximum number of threads remembered for report_threads.
+#define MAX_THREAD_REPORT 32
+
+/// Threads started since the last report_threads, with the problem (if any)
+/// applying their host scheduling options.
+static struct SThreadReport
+{
+  CThread*  thread;
+  char      error[100];
+} thread_report[MAX_THREAD_REPORT];
+static int  thread_reports = 0;
+
+/// Number of host processors a thread's affinity can name (the bits of a u64)
+#define MAX_HOST_CPUS 64
+
+/**
+ * Convert a list of host processors, such as "0-3,8", to a bit mask.
+ *
+ * \return 0 if the list is valid, -1 if it is not, or the first processor
+ *         number that is MAX_HOST_CPUS or higher.
+ **/
+static long parse_cpu_list(const char* s, u64* mask)
+{
+  char*   e;
+  long  first;
+  long  last;
+
+  *mask = 0;
+  while(*s)
+  {
+    first = last = strtol(s, &e, 10);
+    if(e == s || first < 0)
+      return -1;
+    if(*e == '-')
+    {
+      s = e + 1;
+      last = strtol(s, &e, 10);
+      if(e == s || last < first)
+        return -1;
+    }
+
+    if(last >= MAX_HOST_CPUS)
+      return (first >= MAX_HOST_CPUS) ? first : MAX_HOST_CPUS;
+    for(; first <= last; first++)
+      *mask |= U64(0x1) << first;
+    s = e;
+    if(*s == ',')
+      s++;
+    else if(*s)
+      return -1;
+  }
+
+  return *mask ? 0 : -1;
+}
+
+/**
+ * Convert a bit mask of host processors to a list such as "0-3,8".
+ **/
+static void format_cpu_list(u64 mask, char* buffer)
+{
+  char*   start = buffer;
+  int   i;
+  int   j;
+
+  *buffer = 0;
+  for(i = 0; i < MAX_HOST_CPUS; i = j)
+  {
+    if(!(mask & (U64(0x1) << i)))
+    {
+      j = i + 1;
+      continue;
+    }
+
+    for(j = i + 1; j < MAX_HOST_CPUS && (mask & (U64(0x1) << j)); j++)
+      ;
+    buffer += sprintf(buffer, (j - i > 1) ? "%s%d-%d" : "%s%d",
+                      (buffer != start) ? "," : "", i, j - 1);
+  }
+}
+
+/**
+ * Remember the first host scheduling option refused for a thread.
+ **/
+static void report_thread_error(SThreadReport* r, CException & e)
+{
+  if(r && !r->error[0])
+  {
+    strncpy(r->error, e.displayText().c_str(), sizeof(r->error) - 1);
+    r->error[sizeof(r->error) - 1] = 0;
+  }
+}
+
+/**
+ * Start one of the component's threads, and apply the host scheduling
+ * options from the component's configuration to it:
+ *   - thread.affinity: host processors the thread may run on, e.g. "0-3,8".
+ *   - thread.policy: "normal", "fifo" or "rr".
+ *   - thread.priority: host priority, for the "fifo" and "rr" policies.
+ *
+ * The options are set on the thread before it is started, and the thread
+ * is created with them where the host allows that. Options the host
+ * refuses (real-time policies usually need privileges) are shown by
+ * report_threads, and otherwise ignored. Only host processors 0 to 63 can
+ * be named in thread.affinity.
+ **/
+void CSystemComponent::start_thread(CThread* thread, CRunnable& target)
+{
+  char*   affinity = myCfg->get_text_value("thread.affinity", "");
+  char*   policy = myCfg->get_text_value("thread.policy", "normal");
+  int     priority = (int) myCfg->get_num_value("thread.priority", false, 0);
+  u64     mask = 0;
+  long    cpu;
+  CThread::Policy p;
+  SThreadReport*  r = 0;
+
+  if(*affinity && (cpu = parse_cpu_list(affinity, &mask)))
+  {
+    if(cpu < 0)
+      FAILURE_1(Configuration, "%s: thread.affinity must be a list of host processors like 0-3,8",
+                devid_string);
+    FAILURE_2(Configuration, "%s: thread.affinity: host processor %ld is not supported; only 0 to 63 can be used",
+              devid_string, cpu);
+  }
+
+  if(!strcasecmp(policy, "normal"))
+    p = CThread::POLICY_DEFAULT;
+  else if(!strcasecmp(policy, "fifo"))
+    p = CThread::POLICY_FIFO;
+  else if(!strcasecmp(policy, "rr"))
+    p = CThread::POLICY_RR;
+  else
+    FAILURE_1(Configuration, "%s: thread.policy must be normal, fifo or rr",
+              devid_string);
+
+  if(thread_reports < MAX_THREAD_REPORT)
+  {
+    r = &thread_report[thread_reports++];
+    r->thread = thread;
+    r->error[0] = 0;
+  }
+
+  try
+  {
+    if(p != CThread::POLICY_DEFAULT || priority)
+      thread->setOSPriority(priority, p);
+    if(mask)
+      thread->setAffinity(mask);
+  }
+
+  catch(CException & e)
+  {
+    report_thread_error(r, e);
+  }
+
+  printf(" %s", thread->getName().c_str());
+
+  // The thread applies the options while it is being started; it is
+  // running even if the host refused one of them.
+  try
+  {
+    thread->start(target);
+  }
+
+  catch(CNoPermissionException & e)
+  {
+    report_thread_error(r, e);
+  }
+}
+
+/**
+ * Show the host processors, policy and priority of the threads that were
+ * started since the last call.
+ **/
+void CSystemComponent::report_threads()
+{
+  static const char*  policies[] = { "normal", "fifo", "rr" };
+  char                cpus[200];
+  int                 pol;
+
+  for(int i = 0; i < thread_reports; i++)
+  {
+    CThread*  t = thread_report[i].thread;
+
+    format_cpu_list(t->getAffinity(), cpus);
+    pol = (t->getPolicy() == CThread::POLICY_FIFO) ? 1 :
+      (t->getPolicy() == CThread::POLICY_RR) ? 2 : 0;
+    printf("%%SYS-I-THREAD: %s on host cpu(s) %s, policy %s, priority %d.\n",
+           t->getName().c_str(), *cpus ? cpus : "(any)", policies[pol],
+           t->getOSPriority());
+    if(thread_report[i].error[0])
+      printf("%%SYS-W-THREAD: %s: %s.\n", t->getName().c_str(),
+             thread_report[i].error);
+  }
+
+  thread_reports = 0;
+}
@@ -106,8 +106,12 @@ class CSystemComponent
     virtual void  start_threads()                                       { };
     virtual void  stop_threads()                                        { };
 
+    static void   report_threads();
+
     char*         devid_string;
   protected:
+    void          start_thread(CThread* thread, CRunnable& target);
+
     class CSystem*        cSystem;
     class CConfigurator*  myCfg;
 };
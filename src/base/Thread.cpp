@@ -116,6 +116,36 @@ CThread::Priority CThread::getPriority() const
 }
 
 
+void CThread::setOSPriority(int prio, Policy policy)
+{
+	setOSPriorityImpl(prio, policy);
+}
+
+
+int CThread::getOSPriority() const
+{
+	return getOSPriorityImpl();
+}
+
+
+CThread::Policy CThread::getPolicy() const
+{
+	return Policy(getPolicyImpl());
+}
+
+
+void CThread::setAffinity(UInt64 mask)
+{
+	setAffinityImpl(mask);
+}
+
+
+UInt64 CThread::getAffinity() const
+{
+	return getAffinityImpl();
+}
+
+
 void CThread::start(CRunnable& target)
 {
 	startImpl(target);
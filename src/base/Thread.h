@@ -109,6 +109,14 @@ public:
 		PRIO_HIGHEST = PRIO_HIGHEST_IMPL /// The highest thread priority.
 	};
 
+	enum Policy
+		/// Host scheduling policies, for setOSPriority().
+	{
+		POLICY_DEFAULT = POLICY_DEFAULT_IMPL, /// Normal time-sharing scheduling.
+		POLICY_FIFO    = POLICY_FIFO_IMPL,    /// Real-time, first in first out.
+		POLICY_RR      = POLICY_RR_IMPL       /// Real-time, round robin.
+	};
+
 	CThread();
 		/// Creates a thread. Call start() to start it.
 		
@@ -139,6 +147,30 @@ public:
 	Priority getPriority() const;
 		/// Returns the thread's priority.
 
+	void setOSPriority(int prio, Policy policy = POLICY_DEFAULT);
+		/// Sets the thread's priority and scheduling policy, using
+		/// an operating system specific priority value.
+		///
+		/// Some platforms only support the default policy, or only
+		/// allow real-time policies if the process has certain
+		/// privileges.
+
+	int getOSPriority() const;
+		/// Returns the priority set with setOSPriority().
+
+	Policy getPolicy() const;
+		/// Returns the scheduling policy set with setOSPriority().
+
+	void setAffinity(UInt64 mask);
+		/// Restricts the thread to the host processors whose
+		/// bits are set in mask (bit 0 = processor 0). Throws a
+		/// NotImplementedException on platforms that don't
+		/// support this.
+
+	UInt64 getAffinity() const;
+		/// Returns the mask of host processors the thread may
+		/// run on, or 0 if this isn't known.
+
 	void start(CRunnable& target);
 		/// Starts the thread with the given target.
 
@@ -137,24 +137,165 @@ void CThreadImpl::setPriorityImpl(int prio)
 }
 
 
+void CThreadImpl::setOSPriorityImpl(int prio, int policy)
+{
+	_pData->osPrio = prio;
+	_pData->policy = policy;
+	if (_pData->pTarget)
+	{
+		struct sched_param par;
+		par.sched_priority = prio;
+		if (pthread_setschedparam(_pData->thread, policy, &par))
+			throw CSystemException("cannot set thread priority");
+	}
+}
+
+
+void CThreadImpl::setAffinityImpl(UInt64 mask)
+{
+	_pData->affinity = mask;
+	if (_pData->pTarget)
+		applyAffinity(_pData->thread, mask);
+}
+
+
+UInt64 CThreadImpl::getAffinityImpl() const
+{
+#if defined(__linux__)
+	if (_pData->pTarget)
+	{
+		cpu_set_t cpus;
+		UInt64 mask = 0;
+		if (pthread_getaffinity_np(_pData->thread, sizeof(cpus), &cpus))
+			return 0;
+		for (int i = 0; i < 64; i++)
+		{
+			if (CPU_ISSET(i, &cpus))
+				mask |= (UInt64) 1 << i;
+		}
+		return mask;
+	}
+#endif
+	return _pData->affinity;
+}
+
+
+#if defined(__linux__)
+static void maskToCpuSet(UInt64 mask, cpu_set_t* cpus)
+{
+	CPU_ZERO(cpus);
+	for (int i = 0; i < 64; i++)
+	{
+		if (mask & ((UInt64) 1 << i))
+			CPU_SET(i, cpus);
+	}
+}
+#endif
+
+
+void CThreadImpl::applyAffinity(pthread_t thread, UInt64 mask)
+{
+#if defined(__linux__)
+	cpu_set_t cpus;
+	maskToCpuSet(mask, &cpus);
+	if (pthread_setaffinity_np(thread, sizeof(cpus), &cpus))
+		throw CSystemException("cannot set thread affinity");
+#else
+	throw CNotImplementedException("thread affinity");
+#endif
+}
+
+
+bool CThreadImpl::setAttributes(pthread_attr_t* attr) const
+{
+	if (_pData->prio != PRIO_NORMAL_IMPL || _pData->policy != SCHED_OTHER || _pData->osPrio)
+	{
+		struct sched_param par;
+		int policy = _pData->policy;
+		par.sched_priority = _pData->osPrio;
+		if (policy == SCHED_OTHER && !_pData->osPrio)
+			par.sched_priority = mapPrio(_pData->prio);
+		if (pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED)
+		 || pthread_attr_setschedpolicy(attr, policy)
+		 || pthread_attr_setschedparam(attr, &par))
+			return false;
+	}
+
+	if (_pData->affinity)
+	{
+#if defined(__linux__)
+		cpu_set_t cpus;
+		maskToCpuSet(_pData->affinity, &cpus);
+		if (pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus))
+			return false;
+#else
+		return false;
+#endif
+	}
+	return true;
+}
+
+
 void CThreadImpl::startImpl(CRunnable& target)
 {
 	if (_pData->pTarget) throw CSystemException("thread already running");
 
 	_pData->pTarget = &target;
+
+	// Create the thread with its scheduling options, so that it starts
+	// out with them.
+	pthread_attr_t attr;
+	bool created = false;
+	if (!pthread_attr_init(&attr))
+	{
+		if (setAttributes(&attr))
+			created = !pthread_create(&_pData->thread, &attr, entry, this);
+		pthread_attr_destroy(&attr);
+	}
+	if (created)
+		return;
+
+	// The host refused one of the options (real-time policies usually need
+	// privileges). Create the thread without them and apply the options
+	// one by one; the ones the host refuses don't stop the thread, and are
+	// reported with a CNoPermissionException.
 	if (pthread_create(&_pData->thread, NULL, entry, this))
 	{
 		_pData->pTarget = 0;
 		throw CSystemException("cannot start thread");
 	}
 
+	const char* refused = 0;
 	if (_pData->prio != PRIO_NORMAL_IMPL)
 	{
 		struct sched_param par;
 		par.sched_priority = mapPrio(_pData->prio);
 		if (pthread_setschedparam(_pData->thread, SCHED_OTHER, &par))
-			throw CSystemException("cannot set thread priority");
+			refused = "cannot set thread priority";
+	}
+
+	if (_pData->policy != SCHED_OTHER || _pData->osPrio)
+	{
+		struct sched_param par;
+		par.sched_priority = _pData->osPrio;
+		if (pthread_setschedparam(_pData->thread, _pData->policy, &par))
+			refused = "cannot set thread priority";
 	}
+
+	if (_pData->affinity)
+	{
+		try
+		{
+			applyAffinity(_pData->thread, _pData->affinity);
+		}
+		catch (CException&)
+		{
+			refused = "cannot set thread affinity";
+		}
+	}
+
+	if (refused)
+		throw CNoPermissionException(refused);
 }
 
 
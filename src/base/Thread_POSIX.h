@@ -99,12 +99,24 @@ public:
 		PRIO_HIGHEST_IMPL
 	};
 
+	enum Policy
+	{
+		POLICY_DEFAULT_IMPL = SCHED_OTHER,
+		POLICY_FIFO_IMPL    = SCHED_FIFO,
+		POLICY_RR_IMPL      = SCHED_RR
+	};
+
 	CThreadImpl();				
 	~CThreadImpl();
 
 	CRunnable& targetImpl() const;
 	void setPriorityImpl(int prio);
 	int getPriorityImpl() const;
+	void setOSPriorityImpl(int prio, int policy);
+	int getOSPriorityImpl() const;
+	int getPolicyImpl() const;
+	void setAffinityImpl(UInt64 mask);
+	UInt64 getAffinityImpl() const;
 	void startImpl(CRunnable& target);
 
 	void joinImpl();
@@ -117,6 +129,8 @@ public:
 protected:
 	static void* entry(void* pThread);
 	static int mapPrio(int prio);
+	static void applyAffinity(pthread_t thread, UInt64 mask);
+	bool setAttributes(pthread_attr_t* attr) const;
 
 private:
 	struct CThreadData: public CRefCountedObject
@@ -125,6 +139,9 @@ private:
 			pTarget(0),
 			thread(0),
 			prio(PRIO_NORMAL_IMPL),
+			osPrio(0),
+			policy(SCHED_OTHER),
+			affinity(0),
 			done(false)
 		{
 		}
@@ -132,6 +149,9 @@ private:
 		CRunnable* pTarget;
 		pthread_t thread;
 		int       prio;
+		int       osPrio;
+		int       policy;
+		UInt64    affinity;
 		CEvent     done;
 	};
 	
@@ -156,6 +176,18 @@ inline int CThreadImpl::getPriorityImpl() const
 }
 
 
+inline int CThreadImpl::getOSPriorityImpl() const
+{
+	return _pData->osPrio;
+}
+
+
+inline int CThreadImpl::getPolicyImpl() const
+{
+	return _pData->policy;
+}
+
+
 inline void CThreadImpl::sleepImpl(long milliseconds)
 {
 #if defined(__VMS) || defined(__digital__)
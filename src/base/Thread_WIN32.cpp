@@ -74,7 +74,7 @@
 
 DWORD CThreadImpl::_currentKey = TLS_OUT_OF_INDEXES;
 
-CThreadImpl::CThreadImpl(): _pTarget(0), _thread(0), _prio(PRIO_NORMAL_IMPL)
+CThreadImpl::CThreadImpl(): _pTarget(0), _thread(0), _prio(PRIO_NORMAL_IMPL), _affinity(0)
 {
 	if (_currentKey == TLS_OUT_OF_INDEXES)
 	{
@@ -105,6 +105,22 @@ void CThreadImpl::setPriorityImpl(int prio)
 }
 
 
+void CThreadImpl::setOSPriorityImpl(int prio, int policy)
+{
+	if (policy != POLICY_DEFAULT_IMPL)
+		throw CNotImplementedException("thread scheduling policy");
+	setPriorityImpl(prio);
+}
+
+
+void CThreadImpl::setAffinityImpl(UInt64 mask)
+{
+	_affinity = mask;
+	if (_thread && SetThreadAffinityMask(_thread, (DWORD_PTR) mask) == 0)
+		throw CSystemException("cannot set thread affinity");
+}
+
+
 void CThreadImpl::startImpl(CRunnable& target)
 {
 	if (_thread) throw CSystemException("thread already running");
@@ -112,15 +128,25 @@ void CThreadImpl::startImpl(CRunnable& target)
 	_pTarget = &target;
 #if defined(_DLL)
 	DWORD threadId;
-	_thread = CreateThread(NULL, 0, entry, this, 0, &threadId);
+	_thread = CreateThread(NULL, 0, entry, this, CREATE_SUSPENDED, &threadId);
 #else
 	unsigned threadId;
-	_thread = (HANDLE) _beginthreadex(NULL, 0, entry, this, 0, &threadId);
+	_thread = (HANDLE) _beginthreadex(NULL, 0, entry, this, CREATE_SUSPENDED, &threadId);
 #endif
 	if (!_thread)
 		throw CSystemException("cannot create thread");
+	// The thread is created suspended, so that it starts out with its
+	// options. Options the host refuses don't stop it, and are reported
+	// with a CNoPermissionException.
+	const char* refused = 0;
 	if (_prio != PRIO_NORMAL_IMPL && !SetThreadPriority(_thread, _prio))
-		throw CSystemException("cannot set thread priority");
+		refused = "cannot set thread priority";
+	if (_affinity && !SetThreadAffinityMask(_thread, (DWORD_PTR) _affinity))
+		refused = "cannot set thread affinity";
+	if (ResumeThread(_thread) == (DWORD) -1)
+		throw CSystemException("cannot start thread");
+	if (refused)
+		throw CNoPermissionException(refused);
 }
 
 
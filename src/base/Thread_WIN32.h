@@ -91,11 +91,23 @@ public:
 		PRIO_HIGHEST_IMPL = THREAD_PRIORITY_HIGHEST
 	};
 
+	enum Policy
+	{
+		POLICY_DEFAULT_IMPL,
+		POLICY_FIFO_IMPL,
+		POLICY_RR_IMPL
+	};
+
 	CThreadImpl();				
 	~CThreadImpl();
 
 	void setPriorityImpl(int prio);
 	int getPriorityImpl() const;
+	void setOSPriorityImpl(int prio, int policy);
+	int getOSPriorityImpl() const;
+	int getPolicyImpl() const;
+	void setAffinityImpl(UInt64 mask);
+	UInt64 getAffinityImpl() const;
 	void startImpl(CRunnable& target);
 
 	void joinImpl();
@@ -116,6 +128,7 @@ private:
 	CRunnable* _pTarget;
 	HANDLE    _thread;
 	int       _prio;
+	UInt64    _affinity;
 
 	static DWORD _currentKey;
 };
@@ -130,6 +143,24 @@ inline int CThreadImpl::getPriorityImpl() const
 }
 
 
+inline int CThreadImpl::getOSPriorityImpl() const
+{
+	return _prio;
+}
+
+
+inline int CThreadImpl::getPolicyImpl() const
+{
+	return POLICY_DEFAULT_IMPL;
+}
+
+
+inline UInt64 CThreadImpl::getAffinityImpl() const
+{
+	return _affinity;
+}
+
+
 inline void CThreadImpl::sleepImpl(long milliseconds)
 {
 	Sleep(DWORD(milliseconds));
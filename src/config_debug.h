@@ -68,6 +68,9 @@
 // Define to 1 if you want to enable Floating Point load/store debugging
 #undef DEBUG_FP_LOADSTORE
 
+// Define to 1 if you want to enable Floating Point host FPU debugging
+#undef DEBUG_FP_HOST
+
 // Define to 1 if you want to enable General NIC debugging
 #undef DEBUG_NIC
 
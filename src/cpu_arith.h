@@ -123,30 +123,9 @@
     }                                                                           \
   }
 
-#define DO_CTLZ   temp_64 = 0; \
-  temp_64_2 = RBV;             \
-  for(i = 63; i >= 0; i--)     \
-    if((temp_64_2 >> i) & 1)   \
-      break;                   \
-    else                       \
-      temp_64++;               \
-  RCV = temp_64;
-
-#define DO_CTPOP  temp_64 = 0; \
-  temp_64_2 = RBV;             \
-  for(i = 0; i < 64; i++)      \
-    if((temp_64_2 >> i) & 1)   \
-      temp_64++;               \
-  RCV = temp_64;
-
-#define DO_CTTZ   temp_64 = 0; \
-  temp_64_2 = RBV;             \
-  for(i = 0; i < 64; i++)      \
-    if((temp_64_2 >> i) & 1)   \
-      break;                   \
-    else                       \
-      temp_64++;               \
-  RCV = temp_64;
+#define DO_CTLZ   RCV = ctlz64(RBV);
+#define DO_CTPOP  RCV = ctpop64(RBV);
+#define DO_CTTZ   RCV = cttz64(RBV);
 
 #define DO_CMPULT RCV = ((u64) RAV < (u64) RBV) ? 1 : 0;
 #define DO_CMPULE RCV = ((u64) RAV <= (u64) RBV) ? 1 : 0;
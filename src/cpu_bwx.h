@@ -65,15 +65,7 @@
  *
  * \author Camiel Vanderhoeven (camiel@camicom.com / http://www.camicom.com)
  **/
-#define DO_CMPBGE state.r[REG_3] =                                                   \
-    (((u8) (state.r[REG_1] & 0xff) >= (u8) (V_2 & 0xff)) ? 1 : 0) |                  \
-    (((u8) ((state.r[REG_1] >> 8) & 0xff) >= (u8) ((V_2 >> 8) & 0xff)) ? 2 : 0) |    \
-    (((u8) ((state.r[REG_1] >> 16) & 0xff) >= (u8) ((V_2 >> 16) & 0xff)) ? 4 : 0) |  \
-    (((u8) ((state.r[REG_1] >> 24) & 0xff) >= (u8) ((V_2 >> 24) & 0xff)) ? 8 : 0) |  \
-    (((u8) ((state.r[REG_1] >> 32) & 0xff) >= (u8) ((V_2 >> 32) & 0xff)) ? 16 : 0) | \
-    (((u8) ((state.r[REG_1] >> 40) & 0xff) >= (u8) ((V_2 >> 40) & 0xff)) ? 32 : 0) | \
-    (((u8) ((state.r[REG_1] >> 48) & 0xff) >= (u8) ((V_2 >> 48) & 0xff)) ? 64 : 0) | \
-    (((u8) ((state.r[REG_1] >> 56) & 0xff) >= (u8) ((V_2 >> 56) & 0xff)) ? 128 : 0);
+#define DO_CMPBGE state.r[REG_3] = cmpbge64(state.r[REG_1], V_2);
 
 #define DO_EXTBL  state.r[REG_3] = \
     (                              \
@@ -139,22 +131,5 @@
 #define DO_SEXTB  state.r[REG_3] = sext_u64_8(V_2);
 #define DO_SEXTW  state.r[REG_3] = sext_u64_16(V_2);
 
-#define DO_ZAP    state.r[REG_3] = state.r[REG_1] &                           \
-    (                                                                         \
-      ((V_2 & 1) ? 0 : U64(0xff)) | ((V_2 & 2) ? 0 : U64(0xff00)) |           \
-        ((V_2 & 4) ? 0 : U64(0xff0000)) | ((V_2 & 8) ? 0 : U64(0xff000000)) | \
-          ((V_2 & 16) ? 0 : U64(0xff00000000)) |                              \
-            ((V_2 & 32) ? 0 : U64(0xff0000000000)) |                          \
-              ((V_2 & 64) ? 0 : U64(0xff000000000000)) |                      \
-                ((V_2 & 128) ? 0 : U64(0xff00000000000000))                   \
-    );
-
-#define DO_ZAPNOT state.r[REG_3] = state.r[REG_1] &                           \
-    (                                                                         \
-      ((V_2 & 1) ? U64(0xff) : 0) | ((V_2 & 2) ? U64(0xff00) : 0) |           \
-        ((V_2 & 4) ? U64(0xff0000) : 0) | ((V_2 & 8) ? U64(0xff000000) : 0) | \
-          ((V_2 & 16) ? U64(0xff00000000) : 0) |                              \
-            ((V_2 & 32) ? U64(0xff0000000000) : 0) |                          \
-              ((V_2 & 64) ? U64(0xff000000000000) : 0) |                      \
-                ((V_2 & 128) ? U64(0xff00000000000000) : 0)                   \
-    );
+#define DO_ZAP    state.r[REG_3] = state.r[REG_1] &~bytemask64(V_2);
+#define DO_ZAPNOT state.r[REG_3] = state.r[REG_1] & bytemask64(V_2);
@@ -89,6 +89,7 @@
     temp_64 = state.r[REG_2] &~U64(0x3);  \
     state.r[REG_1] = state.pc &~U64(0x3); \
     set_pc(temp_64 | (state.pc & 3));     \
+    predict_jump(ins);                    \
   }
 
 // JSR, RET and JSR_COROUTINE is really JMP, just with different prediction bits.
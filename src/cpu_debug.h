@@ -758,3 +758,41 @@ void          handle_debug_string(char* s);
   mnemonic();                    \
   return;
 #endif //defined(IDB)
+
+#if defined(DEBUG_FP_HOST)
+
+/**
+ * \brief Compare the result of a host FPU fast path with the UFP result.
+ *
+ * Used to debug the host FPU fast paths: the UFP result is always used,
+ * and any difference is reported.
+ **/
+inline u64 fp_host_check(const char* fn, u64 hres, u64 res, u64 s1, u64 s2,
+                         u32 ins)
+{
+  if(hres != res)
+    printf("%s: %016" LL "x, %016" LL "x (%08x): host %016" LL "x, UFP %016" LL "x.\n",
+           fn, s1, s2, ins, hres, res);
+  return res;
+}
+
+// Try the host FPU, but do the UFP operation as well
+#define FP_HOST_TRY(x) \
+  u64   hres;          \
+  bool  host = (x);
+
+// Check the UFP result against the host FPU result
+#define FP_HOST_RESULT(fn, r, a, b) \
+  (host ? fp_host_check(fn, hres, r, a, b, ins) : (r))
+#else
+
+// Return the host FPU result if it can be used
+#define FP_HOST_TRY(x) \
+  {                    \
+    u64 hres;          \
+    if(x)              \
+      return hres;     \
+  }
+
+#define FP_HOST_RESULT(fn, r, a, b) (r)
+#endif
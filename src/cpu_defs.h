@@ -90,6 +90,13 @@
 #if !defined(__CPU_DEFS__)
 #define __CPU_DEFS__
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__BMI2__)
+#include <immintrin.h>
+#endif
+
 /* Instruction formats */
 #define I_V_OP        26        /* opcode */
 #define I_M_OP        0x3F
@@ -292,6 +299,13 @@ typedef struct ufp  UFP;
 /* 64b * 64b unsigned multiply */
 inline u64 uemul64(u64 a, u64 b, u64* hi)
 {
+#if defined(__SIZEOF_INT128__)
+  unsigned __int128 r = (unsigned __int128) a * b;
+
+  if(hi)
+    *hi = (u64) (r >> 64);
+  return (u64) r;
+#else
   u64 ahi;
 
   u64 alo;
@@ -328,6 +342,106 @@ inline u64 uemul64(u64 a, u64 b, u64* hi)
   if(hi)
     *hi = rhi & X64_QUAD;
   return rlo;
+#endif
+}
+
+/* 64b population count */
+inline u64 ctpop64(u64 x)
+{
+#if defined(__GNUC__)
+  return (u64) __builtin_popcountll(x);
+#else
+  x = x - ((x >> 1) & U64(0x5555555555555555));
+  x = (x & U64(0x3333333333333333)) + ((x >> 2) & U64(0x3333333333333333));
+  x = (x + (x >> 4)) & U64(0x0f0f0f0f0f0f0f0f);
+  return (x * U64(0x0101010101010101)) >> 56;
+#endif
+}
+
+/* 64b count leading zeros */
+inline u64 ctlz64(u64 x)
+{
+#if defined(__GNUC__)
+  return x ? (u64) __builtin_clzll(x) : 64;
+#else
+  u64 n = 0;
+
+  if(!x)
+    return 64;
+  if(!(x & U64(0xffffffff00000000)))
+  {
+    n += 32;
+    x <<= 32;
+  }
+
+  if(!(x & U64(0xffff000000000000)))
+  {
+    n += 16;
+    x <<= 16;
+  }
+
+  if(!(x & U64(0xff00000000000000)))
+  {
+    n += 8;
+    x <<= 8;
+  }
+
+  if(!(x & U64(0xf000000000000000)))
+  {
+    n += 4;
+    x <<= 4;
+  }
+
+  if(!(x & U64(0xc000000000000000)))
+  {
+    n += 2;
+    x <<= 2;
+  }
+
+  if(!(x & U64(0x8000000000000000)))
+    n += 1;
+  return n;
+#endif
+}
+
+/* 64b count trailing zeros */
+inline u64 cttz64(u64 x)
+{
+#if defined(__GNUC__)
+  return x ? (u64) __builtin_ctzll(x) : 64;
+#else
+  return ctpop64((x & (0 - x)) - 1);
+#endif
+}
+
+/* Expand an 8-bit byte mask to a 64-bit mask (ZAP/ZAPNOT) */
+inline u64 bytemask64(u64 m)
+{
+#if defined(__BMI2__)
+  return _pdep_u64(m, U64(0x0101010101010101)) * 0xff;
+#else
+  m &= 0xff;
+  m = (m | (m << 28)) & U64(0x0000000f0000000f);
+  m = (m | (m << 14)) & U64(0x0003000300030003);
+  m = (m | (m << 7)) & U64(0x0101010101010101);
+  return m * 0xff;
+#endif
+}
+
+/* Unsigned byte compare (CMPBGE): bit n set if byte n of a >= byte n of b */
+inline u64 cmpbge64(u64 a, u64 b)
+{
+#if defined(__SSE2__)
+  __m128i va = _mm_loadl_epi64((const __m128i*) &a);
+  __m128i vb = _mm_loadl_epi64((const __m128i*) &b);
+
+  return (u64) (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(va, vb), va)) & 0xff);
+#else
+  u64 d = (a | U64(0x8080808080808080)) - (b & U64(0x7f7f7f7f7f7f7f7f));
+  u64 ge = ((a & ~b) | (~(a ^ b) & d)) & U64(0x8080808080808080);
+
+  return ((ge >> 7) * U64(0x0102040810204080)) >> 56;
+#endif
 }
 
 /* 64b / 64b unsigned fraction divide */
@@ -355,77 +469,42 @@ inline u64 ufdiv64(u64 dvd, u64 dvr, u32 prec, u32* sticky)
   return quo; /* return quotient */
 }
 
-/* Fraction square root routine - code from SoftFloat */
+/* Fraction square root routine; exp is the exponent of the operand.
+   The operand is a fraction in [0.5,1) scaled by 2^(exp - bias), with an even
+   bias; for an odd exp, the square root of half the fraction is returned. */
 inline u64 fsqrt64(u64 asig, s32 exp)
 {
-  static const u32  sqrtOdd[] = {
-    0x0004, 0x0022, 0x005D, 0x00B1, 0x011D, 0x019F, 0x0236, 0x02E0,
-    0x039C, 0x0468, 0x0545, 0x0631, 0x072B, 0x0832, 0x0946, 0x0A67 };
-  static const u32  sqrtEven[] = {
-    0x0A2D, 0x08AF, 0x075A, 0x0629, 0x051A, 0x0429, 0x0356, 0x029E,
-    0x0200, 0x0179, 0x0109, 0x00AF, 0x0068, 0x0034, 0x0012, 0x0002 };
-
-  u64               zsig;
-  u64               remh;
-  u64               reml;
-  u64               t;
-  u32               index;
-  u32               z;
-  u32               a;
-  u32               sticky = 0;
-
-  /* Calculate an approximation to the square root of the 32-bit significand given
-   by 'a'.  Considered as an integer, 'a' must be at least 2^31.  If bit 0 of
-   'exp' (the least significant bit) is 1, the integer returned approximates
-   2^31*sqrt('a'/2^31), where 'a' is considered an integer.  If bit 0 of 'exp'
-   is 0, the integer returned approximates 2^31*sqrt('a'/2^30).  In either
-   case, the approximation returned lies strictly within +/-2 of the exact
-   value. */
-  a = (u32) (asig >> 32);   /* high order frac */
-  index = (a >> 27) & 0xF;  /* bits<30:27> */
+  u64 rhi;  /* radicand */
+  u64 rlo;
+  u64 zsig;
+  u64 t;
+  u64 thi;
+  u64 tlo;
+  int i;
+
   if(exp & 1)
   { /* odd exp? */
-    z = 0x4000 + (a >> 17) - sqrtOdd[index];  /* initial guess */
-    z = ((a / z) << 14) + (z << 15);          /* Newton iteration */
-    a = a >> 1;
+    rhi = asig >> 1;
+    rlo = asig << 63;
   }
   else
   {
-    z = 0x8000 + (a >> 17) - sqrtEven[index]; /* initial guess */
-    z = (a / z) + z;  /* Newton iteration */
-    z = (z >= 0x20000) ? 0xFFFF8000 : (z << 15);
-    if(z <= a)
-      z = (a >> 1) | 0x80000000;
+    rhi = asig;
+    rlo = 0;
+  }
+
+  zsig = 0;
+  for(i = 63; i >= 0; i--)
+  { /* develop root bits */
+    t = zsig | (U64(0x1) << i);
+    tlo = uemul64(t, t, &thi);
+    if((thi < rhi) || ((thi == rhi) && (tlo <= rlo)))
+      zsig = t;
   }
 
-  zsig = (((((u64) a) << 31) / ((u64) z)) + (z >> 1)) & X64_LONG;
-
-  /* Calculate the final answer in two steps.  First, do one iteration of
-   Newton's approximation.  The divide-by-2 is accomplished by clever
-   positioning of the operands.  Then, check the bits just below the
-   (double precision) rounding bit to see if they are close to zero
-   (that is, the rounding bits are close to midpoint).  If so, make
-   sure that the result^2 is <below> the input operand */
-  asig = asig >> ((exp & 1) ? 3 : 2); /* leave 2b guard */
-  zsig = ufdiv64(asig, zsig << 32, 64, NULL) + (zsig << 30);  /* Newton iteration */
-  if((zsig & 0x1FF) <= 5)
-  { /* close to even? */
-    remh = uemul64(zsig, zsig, &reml);  /* result^2 */
-    remh = (asig - remh - (reml ? 1 : 0)) & X64_QUAD; /* arg - result^2 */
-    reml = NEG_Q(reml);
-    while(Q_GETSIGN(remh) != 0)
-    { /* if arg < result^2 */
-      zsig = (zsig - 1) & X64_QUAD;     /* decr result */
-      t = ((zsig << 1) & X64_QUAD) | 1; /* incr result^2 */
-      reml = (reml + t) & X64_QUAD;     /* and retest */
-      remh = (remh + (zsig >> 63) + ((reml < t) ? 1 : 0)) & X64_QUAD;
-    }
-
-    if((remh | reml) != 0)
-      sticky = 1;
-  } /* not exact? */
-
-  zsig = (zsig << 1) | sticky;  /* left justify result */
+  tlo = uemul64(zsig, zsig, &thi);
+  if((thi != rhi) || (tlo != rlo))
+    zsig = zsig | 1;  /* not exact? sticky */
   return zsig;
 }
 
@@ -496,68 +575,68 @@ inline u64 fsqrt64(u64 asig, s32 exp)
 #endif
 
 #define READ_PHYS(size)                       \
-  cSystem->ReadMem(phys_address, size, this); \
+  cSystem->ReadMem<size>(phys_address, this); \
   LLR
 
 #define READ_VIRT(va, size, dest)                       \
+  if (stlb_read(va, size, &temp_64_2)) {                \
+    dest = temp_64_2;                                   \
+  } else {                                              \
   pbc = false;                                          \
   DATA_PHYS(va, ACCESS_READ, (size/8)-1);               \
   LLR;                         \
   if (pbc) {                                            \
-    dest = 0;                                           \
-    for (int ii=0; ii<(size/8); ii++) {                 \
-      DATA_PHYS(va+ii, ACCESS_READ,0);                  \
-      dest |= (cSystem->ReadMem(phys_address, 8, this) << (ii*8));  \
-    }                                                   \
+    if (read_split(va, phys_address, size, ins, &temp_64_2)) \
+      return;                                           \
+    dest = temp_64_2;                                   \
   } else {                                              \
-    dest = cSystem->ReadMem(phys_address, size, this);  \
+    stlb_fill(va, phys_address, 0);                     \
+    dest = cSystem->ReadMem<size>(phys_address, this);  \
+  }                                                     \
   }
 
 #define READ_VIRT_LOCK(va, size, dest)                  \
   pbc = false;                                          \
   DATA_PHYS(va, ACCESS_READ, (size/8)-1);               \
   LLR;                         \
-  cSystem->cpu_lock(state.iProcNum, phys_address);      \
   if (pbc) {                                            \
-    dest = 0;                                           \
-    for (int ii=0; ii<(size/8); ii++) {                 \
-      DATA_PHYS(va+ii, ACCESS_READ,0);                  \
-      dest |= (cSystem->ReadMem(phys_address, 8, this) << (ii*8));  \
-    }                                                   \
+    if (read_split(va, phys_address, size, ins, &temp_64_2)) \
+      return;                                           \
   } else {                                              \
-    dest = cSystem->ReadMem(phys_address, size, this);  \
-  }
+    temp_64_2 = cSystem->ReadMem<size>(phys_address, this); \
+  }                                                     \
+  cSystem->cpu_lock(state.iProcNum, phys_address, temp_64_2); \
+  dest = temp_64_2;
 
 #define READ_VIRT_F(va, size, dest, f)                    \
+  if (stlb_read(va, size, &temp_64_2)) {                  \
+    dest = f(temp_64_2);                                  \
+  } else {                                                \
   pbc = false;                                            \
   DATA_PHYS(va, ACCESS_READ, (size/8)-1);                 \
   LLR;                           \
   if (pbc) {                                              \
-    u64 aa = 0;                                           \
-    for (int ii=0; ii<(size/8); ii++) {                   \
-      DATA_PHYS(va+ii, ACCESS_READ,0);                    \
-      aa |= (cSystem->ReadMem(phys_address, 8, this) << (ii*8));  \
-    }                                                     \
-    dest = f(aa);                                         \
+    if (read_split(va, phys_address, size, ins, &temp_64_2)) \
+      return;                                             \
+    dest = f(temp_64_2);                                  \
   } else {                                                \
-    dest = f(cSystem->ReadMem(phys_address, size, this)); \
+    stlb_fill(va, phys_address, 0);                       \
+    dest = f(cSystem->ReadMem<size>(phys_address, this)); \
   }                                                       \
+  }
 
 #define READ_VIRT_LOCK_F(va, size, dest, f)               \
   pbc = false;                                            \
   DATA_PHYS(va, ACCESS_READ, (size/8)-1);                 \
   LLR;                           \
-  cSystem->cpu_lock(state.iProcNum, phys_address);        \
   if (pbc) {                                              \
-    u64 aa = 0;                                           \
-    for (int ii=0; ii<(size/8); ii++) {                   \
-      DATA_PHYS(va+ii, ACCESS_READ,0);                    \
-      aa |= (cSystem->ReadMem(phys_address, 8, this) << (ii*8));  \
-    }                                                     \
-    dest = f(aa);                                         \
+    if (read_split(va, phys_address, size, ins, &temp_64_2)) \
+      return;                                             \
   } else {                                                \
-    dest = f(cSystem->ReadMem(phys_address, size, this)); \
+    temp_64_2 = cSystem->ReadMem<size>(phys_address, this); \
   }                                                       \
+  cSystem->cpu_lock(state.iProcNum, phys_address, temp_64_2); \
+  dest = f(temp_64_2);
 
 /**
  * Normal variant of write action
@@ -566,22 +645,42 @@ inline u64 fsqrt64(u64 asig, s32 exp)
  * just perform the write as requested using the unaligned address.
  **/
 #define WRITE_PHYS(data, size)                        \
-  cSystem->WriteMem(phys_address, size, data, this);  \
+  cSystem->WriteMem<size>(phys_address, data, this);  \
   LWR
 
 #define WRITE_VIRT(va, size, src)                     \
+  if (!stlb_write(va, size, src)) {                   \
+  pbc = false;                                        \
+  DATA_PHYS(va, ACCESS_WRITE, (size/8)-1);            \
+  LWR;                                                \
+  if (pbc) {                                          \
+    if (write_split(va, phys_address, size, ins, src)) \
+      return;                                         \
+  } else {                                            \
+    stlb_fill(va, phys_address, 1);                   \
+    cSystem->WriteMem<size>(phys_address, src, this); \
+  }                                                   \
+  }
+
+/**
+ * Store conditional. The address is translated first, so a TB miss
+ * doesn't cost the reservation. An unaligned store that crosses a page
+ * still has to hold the reservation, and takes it away.
+ **/
+#define WRITE_VIRT_COND(va, size, src, dest)          \
   pbc = false;                                        \
   DATA_PHYS(va, ACCESS_WRITE, (size/8)-1);            \
   LWR;                                                \
   if (pbc) {                                          \
-    u64 aa = src;                                     \
-    for (int ii=0; ii<(size/8); ii++) {               \
-      DATA_PHYS(va+ii, ACCESS_WRITE, 0);              \
-      cSystem->WriteMem(phys_address, 8, aa, this);   \
-      aa >>= 8;                                       \
+    if (!cSystem->cpu_unlock(state.iProcNum)) {       \
+      dest = 0;                                       \
+    } else {                                          \
+      if (write_split(va, phys_address, size, ins, src)) \
+        return;                                       \
+      dest = 1;                                       \
     }                                                 \
   } else {                                            \
-    cSystem->WriteMem(phys_address, size, src, this); \
+    dest = cSystem->cpu_store_cond(state.iProcNum, phys_address, size, src, this) ? 1 : 0; \
   }
 
 /**
@@ -591,7 +690,7 @@ inline u64 fsqrt64(u64 asig, s32 exp)
  * address.
  **/
 #define READ_PHYS_NT(size)                                \
-  cSystem->ReadMem(ALIGN_PHYS((size) / 8), size, this);   \
+  cSystem->ReadMem<size>(ALIGN_PHYS((size) / 8), this);   \
   LLR;
 
 /**
@@ -602,11 +701,11 @@ inline u64 fsqrt64(u64 asig, s32 exp)
  **/
 #if defined(IDB)
 #define WRITE_PHYS_NT(data, size)                               \
-  cSystem->WriteMem(ALIGN_PHYS((size) / 8), size, data, this);  \
+  cSystem->WriteMem<size>(ALIGN_PHYS((size) / 8), data, this);  \
   LWR
 #else
 #define WRITE_PHYS_NT(data, size) \
-  cSystem->WriteMem(ALIGN_PHYS((size) / 8), size, data, this)
+  cSystem->WriteMem<size>(ALIGN_PHYS((size) / 8), data, this)
 #endif
 
 #define REG_1         RREG(I_GETRA(ins))
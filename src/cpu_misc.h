@@ -80,6 +80,8 @@
   }                                                                    \
   else                                                                 \
   {                                                                    \
+    if(function == 0x0a)  /* SWPPAL: variant 2 is the OSF/1 PALcode */ \
+      state.swppal_osf = (state.r[16] == 2);                           \
     if(state.pal_vms)                                                  \
     {                                                                  \
       switch(function)                                                 \
@@ -291,8 +293,57 @@
         TRC(true, false)                                               \
       }                                                                \
     }                                                                  \
+    else if(state.pal_osf)                                             \
+    {                                                                  \
+      switch(function)                                                 \
+      {                                                                \
+      case 0x01:  /* CFLUSH */                                         \
+        osfpal_call_cflush();                                          \
+        break;                                                         \
+                                                                \
+      case 0x02:  /* DRAINA */                                         \
+        osfpal_call_draina();                                          \
+        break;                                                         \
+                                                                \
+      case 0x33:  /* TBI */                                            \
+        osfpal_call_tbi();                                             \
+        break;                                                         \
+                                                                \
+      case 0x3c:  /* WHAMI */                                          \
+        osfpal_call_whami();                                           \
+        break;                                                         \
+                                                                \
+      case 0x3e:  /* WTINT */                                          \
+        osfpal_call_wtint();                                           \
+        break;                                                         \
+                                                                \
+      case 0x86:  /* IMB */                                            \
+        osfpal_call_imb();                                             \
+        break;                                                         \
+                                                                \
+      case 0x30:  /* SWPCTX */                                         \
+      case 0x34:  /* WRENT */                                          \
+      case 0x35:  /* SWPIPL */                                         \
+      case 0x36:  /* RDPS */                                           \
+      case 0x38:  /* WRUSP */                                          \
+      case 0x3a:  /* RDUSP */                                          \
+      case 0x3f:  /* RTI */                                            \
+      case 0x83:  /* CALLSYS */                                        \
+        if(osfpal_call(function) >= 0)                                 \
+          break;                                                       \
+                                                                \
+      /* not replaced; fall through to the PALcode */                  \
+      default:                                                         \
+        state.r[32 + 23] = state.pc;                                   \
+        set_pc(state.pal_base | (1 << 13) | ((function & 0x80) << 5) | \
+                 ((function & 0x3f) << 6) | 1);                        \
+        TRC(true, false)                                               \
+      }                                                                \
+    }                                                                  \
     else                                                               \
     {                                                                  \
+      if(function == 0x3e && (idle_mode & IDLE_WTINT)) /* WTINT */     \
+        idle_wait();                                                   \
       state.r[32 + 23] = state.pc;                                     \
       set_pc(state.pal_base | (1 << 13) | ((function & 0x80) << 5) |   \
                ((function & 0x3f) << 6) | 1);                          \
@@ -45,6 +45,90 @@
  *
  * \author Camiel Vanderhoeven (camiel@camicom.com / http://www.camicom.com)
  **/
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+/**
+ * \brief Load a 64-bit value into the low half of an SSE2 register.
+ **/
+inline __m128i mvi_load(u64 x)
+{
+  return _mm_loadl_epi64((const __m128i*) &x);
+}
+
+/**
+ * \brief Store the low half of an SSE2 register as a 64-bit value.
+ **/
+inline u64 mvi_store(__m128i x)
+{
+  u64 r;
+  _mm_storel_epi64((__m128i*) &r, x);
+  return r;
+}
+
+/* Flip the sign bit of each byte or word, to compare signed bytes as unsigned
+   bytes, and unsigned words as signed words. SSE2 has no other forms. */
+#define MVI_B8  U64(0x8080808080808080)
+#define MVI_W4  U64(0x8000800080008000)
+
+inline u64 mvi_minub8(u64 a, u64 b)
+{
+  return mvi_store(_mm_min_epu8(mvi_load(a), mvi_load(b)));
+}
+
+inline u64 mvi_maxub8(u64 a, u64 b)
+{
+  return mvi_store(_mm_max_epu8(mvi_load(a), mvi_load(b)));
+}
+
+inline u64 mvi_minsb8(u64 a, u64 b)
+{
+  return mvi_store(_mm_min_epu8(mvi_load(a ^ MVI_B8), mvi_load(b ^ MVI_B8))) ^ MVI_B8;
+}
+
+inline u64 mvi_maxsb8(u64 a, u64 b)
+{
+  return mvi_store(_mm_max_epu8(mvi_load(a ^ MVI_B8), mvi_load(b ^ MVI_B8))) ^ MVI_B8;
+}
+
+inline u64 mvi_minsw4(u64 a, u64 b)
+{
+  return mvi_store(_mm_min_epi16(mvi_load(a), mvi_load(b)));
+}
+
+inline u64 mvi_maxsw4(u64 a, u64 b)
+{
+  return mvi_store(_mm_max_epi16(mvi_load(a), mvi_load(b)));
+}
+
+inline u64 mvi_minuw4(u64 a, u64 b)
+{
+  return mvi_store(_mm_min_epi16(mvi_load(a ^ MVI_W4), mvi_load(b ^ MVI_W4))) ^ MVI_W4;
+}
+
+inline u64 mvi_maxuw4(u64 a, u64 b)
+{
+  return mvi_store(_mm_max_epi16(mvi_load(a ^ MVI_W4), mvi_load(b ^ MVI_W4))) ^ MVI_W4;
+}
+
+/**
+ * \brief Sum of the absolute differences of the unsigned bytes.
+ **/
+inline u64 mvi_perr(u64 a, u64 b)
+{
+  return mvi_store(_mm_sad_epu8(mvi_load(a), mvi_load(b)));
+}
+
+#define DO_MINUB8 state.r[REG_3] = mvi_minub8(state.r[REG_1], V_2);
+#define DO_MINSB8 state.r[REG_3] = mvi_minsb8(state.r[REG_1], V_2);
+#define DO_MINUW4 state.r[REG_3] = mvi_minuw4(state.r[REG_1], V_2);
+#define DO_MINSW4 state.r[REG_3] = mvi_minsw4(state.r[REG_1], V_2);
+#define DO_MAXUB8 state.r[REG_3] = mvi_maxub8(state.r[REG_1], V_2);
+#define DO_MAXSB8 state.r[REG_3] = mvi_maxsb8(state.r[REG_1], V_2);
+#define DO_MAXUW4 state.r[REG_3] = mvi_maxuw4(state.r[REG_1], V_2);
+#define DO_MAXSW4 state.r[REG_3] = mvi_maxsw4(state.r[REG_1], V_2);
+#define DO_PERR   state.r[REG_3] = mvi_perr(state.r[REG_1], V_2);
+#else
 #define DO_MINUB8 temp_64 = 0;                                                  \
   temp_64_1 = state.r[REG_1];                                                   \
   temp_64_2 = V_2;                                                              \
@@ -141,33 +225,18 @@
   }                                                                               \
   state.r[REG_3] = temp_64;
 
-#define DO_PERR   temp_64 = 0;                                                  \
-  temp_64_1 = state.r[REG_1];                                                   \
-  temp_64_2 = V_2;                                                              \
-  for(i = 0; i < 64; i += 8)                                                    \
-  {                                                                             \
-    if((s8) ((temp_64_1 >> i) & X64_BYTE) > (s8) ((temp_64_2 >> i) & X64_BYTE)) \
-      temp_64 |=                                                                \
-        (                                                                       \
-          (u64)                                                                 \
-            (                                                                   \
-              (s8) ((temp_64_1 >> i) & X64_BYTE) - (s8)                         \
-                ((temp_64_2 >> i) & X64_BYTE)                                   \
-            ) <<                                                                \
-          i                                                                     \
-        );                                                                      \
-    else                                                                        \
-      temp_64 |=                                                                \
-        (                                                                       \
-          (u64)                                                                 \
-            (                                                                   \
-              (s8) ((temp_64_2 >> i) & X64_BYTE) - (s8)                         \
-                ((temp_64_1 >> i) & X64_BYTE)                                   \
-            ) <<                                                                \
-          i                                                                     \
-        );                                                                      \
-  }                                                                             \
+#define DO_PERR   temp_64 = 0;                                   \
+  temp_64_1 = state.r[REG_1];                                    \
+  temp_64_2 = V_2;                                               \
+  for(i = 0; i < 64; i += 8)                                     \
+  {                                                              \
+    if((u8) (temp_64_1 >> i) > (u8) (temp_64_2 >> i))            \
+      temp_64 += (u8) (temp_64_1 >> i) - (u8) (temp_64_2 >> i);  \
+    else                                                         \
+      temp_64 += (u8) (temp_64_2 >> i) - (u8) (temp_64_1 >> i);  \
+  }                                                              \
   state.r[REG_3] = temp_64;
+#endif
 
 #define DO_PKLB   temp_64_2 = V_2; \
   state.r[REG_3] = (temp_64_2 & U64(0x00000000000000ff)) | ((temp_64_2 & U64(0x000000ff00000000)) >> 24);
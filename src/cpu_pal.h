@@ -202,12 +202,12 @@
     if(function & 2)                                                             \
     {                                                                            \
       state.aster = (int) (state.r[REG_2] >> 5) & 0xf;                           \
-      state.check_int = true;                                                    \
+      request_int_check();                                                       \
     }                                                                            \
     if(function & 4)                                                             \
     {                                                                            \
       state.astrr = (int) (state.r[REG_2] >> 9) & 0xf;                           \
-      state.check_int = true;                                                    \
+      request_int_check();                                                       \
     }                                                                            \
     if(function & 8)                                                             \
       state.ppcen = (int) (state.r[REG_2] >> 1) & 1;                             \
@@ -240,12 +240,12 @@
                                                                             \
     case 0x09:  /* CM */                                                         \
       state.cm = (int) (state.r[REG_2] >> 3) & 3;                                \
-      state.check_int = true;                                                    \
+      request_int_check();                                                       \
       break;                                                                     \
                                                                             \
     case 0x0b:  /* IER_CM */                                                     \
       state.cm = (int) (state.r[REG_2] >> 3) & 3;                                \
-      state.check_int = true;                                                    \
+      request_int_check();                                                       \
                                                                             \
     case 0x0a:  /* IER */                                                        \
       state.asten = (int) (state.r[REG_2] >> 13) & 1;                            \
@@ -254,12 +254,12 @@
       state.cren = (int) (state.r[REG_2] >> 31) & 1;                             \
       state.slen = (int) (state.r[REG_2] >> 32) & 1;                             \
       state.eien = (int) (state.r[REG_2] >> 33) & 0x3f;                          \
-      state.check_int = true;                                                    \
+      request_int_check();                                                       \
       break;                                                                     \
                                                                             \
     case 0x0c:  /* SIRR */                                                       \
       state.sir = (int) (state.r[REG_2] >> 13) & 0xfffe;                         \
-      state.check_int = true;                                                    \
+      request_int_check();                                                       \
       break;                                                                     \
                                                                             \
     case 0x0e:  /* HW_INT_CLR */                                                 \
@@ -279,6 +279,8 @@
       state.sde = (state.r[REG_2] >> 7) & 1;                                     \
       state.hwe = (state.r[REG_2] >> 12) & 1;                                    \
       state.i_ctl_va_mode = (int) (state.r[REG_2] >> 15) & 3;                    \
+      set_reg_bank();                                                            \
+      flush_decode(); /* PALshadow register translation may have changed */     \
       break;                                                                     \
                                                                             \
     case 0x12:  /* ic_flush_asm */                                               \
@@ -328,6 +330,7 @@
     case 0x28:  /* M_CTL */                                                      \
       state.smc = (int) (state.r[REG_2] >> 4) & 3;                               \
       state.m_ctl_spe = (int) (state.r[REG_2] >> 1) & 7;                         \
+      flush_stlb();   /* superpage mappings may have changed */                  \
       break;                                                                     \
                                                                             \
     case 0x29:  /* DC_CTL */                                                     \
@@ -391,8 +394,9 @@
                                                                            \
   case 2:       /* longword physical locked */                                \
     phys_address = state.r[REG_2] + DISP_12;                                  \
-    cSystem->cpu_lock(state.iProcNum, phys_address);                          \
-    state.r[REG_1] = READ_PHYS_NT(32);                                        \
+    temp_64_2 = READ_PHYS_NT(32);                                             \
+    cSystem->cpu_lock(state.iProcNum, ALIGN_PHYS(4), temp_64_2);              \
+    state.r[REG_1] = temp_64_2;                                               \
     break;                                                                    \
                                                                            \
   case 4:       /* longword virtual vpte                 chk   alt    vpte */ \
@@ -433,8 +437,9 @@
                                                                            \
   case 3:       /* quadword physical locked */                                \
     phys_address = state.r[REG_2] + DISP_12;                                  \
-    cSystem->cpu_lock(state.iProcNum, phys_address);                          \
-    state.r[REG_1] = READ_PHYS_NT(64);                                        \
+    temp_64_2 = READ_PHYS_NT(64);                                             \
+    cSystem->cpu_lock(state.iProcNum, ALIGN_PHYS(8), temp_64_2);              \
+    state.r[REG_1] = temp_64_2;                                               \
     break;                                                                    \
                                                                            \
   case 5:       /* quadword virtual vpte                 chk   alt    vpte */ \
@@ -474,14 +479,10 @@
     break;                                                                    \
                                                                            \
   case 2:       /* longword physical conditional */                           \
-    if(cSystem->cpu_unlock(state.iProcNum))                                   \
-    {                                                                         \
-      phys_address = state.r[REG_2] + DISP_12;                                \
-      WRITE_PHYS_NT(state.r[REG_1], 32);                                      \
-      state.r[REG_1] = 1;                                                     \
-    }                                                                         \
-    else                                                                      \
-      state.r[REG_1] = 0;                                                     \
+    phys_address = state.r[REG_2] + DISP_12;                                  \
+    LWR;                                                                      \
+    state.r[REG_1] = cSystem->cpu_store_cond(state.iProcNum, ALIGN_PHYS(4),   \
+                                             32, state.r[REG_1], this) ? 1 : 0; \
     break;                                                                    \
                                                                            \
   case 4:       /* longword virtual                      chk   alt    vpte */ \
@@ -506,14 +507,10 @@
     break;                                                                     \
                                                                             \
   case 3:       /* quadword physical conditional */                            \
-    if(cSystem->cpu_unlock(state.iProcNum))                                    \
-    {                                                                          \
-      phys_address = state.r[REG_2] + DISP_12;                                 \
-      WRITE_PHYS_NT(state.r[REG_1], 64);                                       \
-      state.r[REG_1] = 1;                                                      \
-    }                                                                          \
-    else                                                                       \
-      state.r[REG_1] = 0;                                                      \
+    phys_address = state.r[REG_2] + DISP_12;                                   \
+    LWR;                                                                       \
+    state.r[REG_1] = cSystem->cpu_store_cond(state.iProcNum, ALIGN_PHYS(8),    \
+                                             64, state.r[REG_1], this) ? 1 : 0;  \
     break;                                                                     \
                                                                             \
   case 5:       /* quadword virtual                      chk    alt    vpte */ \
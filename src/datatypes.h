@@ -238,4 +238,170 @@ inline u32 sext_u32_24(u32 a)
 {
   return(((a) & 0x00800000) ? ((a) | 0xff000000) : ((a) & 0x00ffffff));
 }
+
+/**
+ * Atomic operations on memory shared between CPU threads.
+ * The compare-and-swap functions return the previous contents of *p.
+ * atomic_load_32 has acquire, atomic_store_32 release semantics.
+ * atomic_or_8 and atomic_and_8 are full barriers, as is atomic_fence.
+ **/
+#if defined(_MSC_VER)
+#include <intrin.h>
+
+inline u32 atomic_cas_32(volatile u32* p, u32 oldval, u32 newval)
+{
+  return (u32) _InterlockedCompareExchange((volatile long*) p, (long) newval,
+                                           (long) oldval);
+}
+
+inline u64 atomic_cas_64(volatile u64* p, u64 oldval, u64 newval)
+{
+  return (u64) _InterlockedCompareExchange64((volatile __int64*) p,
+                                             (__int64) newval, (__int64) oldval);
+}
+
+inline void atomic_or_8(volatile u8* p, u8 bits)
+{
+  _InterlockedOr8((volatile char*) p, (char) bits);
+}
+
+inline void atomic_and_8(volatile u8* p, u8 bits)
+{
+  _InterlockedAnd8((volatile char*) p, (char) bits);
+}
+
+inline void atomic_fence()
+{
+  _mm_mfence();
+}
+
+// volatile accesses have acquire/release semantics with /volatile:ms
+inline u32 atomic_load_32(volatile u32* p)
+{
+  return *p;
+}
+
+inline void atomic_store_32(volatile u32* p, u32 val)
+{
+  *p = val;
+}
+#elif defined(__GNUC__)
+inline u32 atomic_cas_32(volatile u32* p, u32 oldval, u32 newval)
+{
+  return __sync_val_compare_and_swap(p, oldval, newval);
+}
+
+inline u64 atomic_cas_64(volatile u64* p, u64 oldval, u64 newval)
+{
+  return __sync_val_compare_and_swap(p, oldval, newval);
+}
+
+inline void atomic_or_8(volatile u8* p, u8 bits)
+{
+  __sync_fetch_and_or(p, bits);
+}
+
+inline void atomic_and_8(volatile u8* p, u8 bits)
+{
+  __sync_fetch_and_and(p, bits);
+}
+
+inline void atomic_fence()
+{
+  __sync_synchronize();
+}
+
+#if defined(__ATOMIC_ACQUIRE)
+inline u32 atomic_load_32(volatile u32* p)
+{
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+inline void atomic_store_32(volatile u32* p, u32 val)
+{
+  __atomic_store_n(p, val, __ATOMIC_RELEASE);
+}
+#else
+inline u32 atomic_load_32(volatile u32* p)
+{
+  u32 v = *p;
+
+  __sync_synchronize();
+  return v;
+}
+
+inline void atomic_store_32(volatile u32* p, u32 val)
+{
+  __sync_synchronize();
+  *p = val;
+}
+#endif
+#else
+inline u32 atomic_cas_32(volatile u32* p, u32 oldval, u32 newval)
+{
+  u32 v = *p;
+
+  if(v == oldval)
+    *p = newval;
+  return v;
+}
+
+inline u64 atomic_cas_64(volatile u64* p, u64 oldval, u64 newval)
+{
+  u64 v = *p;
+
+  if(v == oldval)
+    *p = newval;
+  return v;
+}
+
+inline void atomic_or_8(volatile u8* p, u8 bits)
+{
+  *p |= bits;
+}
+
+inline void atomic_and_8(volatile u8* p, u8 bits)
+{
+  *p &= bits;
+}
+
+inline void atomic_fence()
+{
+}
+
+inline u32 atomic_load_32(volatile u32* p)
+{
+  return *p;
+}
+
+inline void atomic_store_32(volatile u32* p, u32 val)
+{
+  *p = val;
+}
+#endif
+
+/**
+ * Atomically replace *p, returning the previous contents.
+ **/
+inline u32 atomic_xchg_32(volatile u32* p, u32 newval)
+{
+  u32 v;
+
+  do
+  {
+    v = *p;
+  } while(atomic_cas_32(p, v, newval) != v);
+  return v;
+}
+
+inline u64 atomic_xchg_64(volatile u64* p, u64 newval)
+{
+  u64 v;
+
+  do
+  {
+    v = *p;
+  } while(atomic_cas_64(p, v, newval) != v);
+  return v;
+}
 #endif //INCLUDED_DATATYPES_H
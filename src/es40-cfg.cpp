@@ -342,10 +342,10 @@ int main(int argc, char* argv[])
   mem_q.setExplanation("Your system should have enough free memory to emulate the amount you choose here.");
   mem_q.setDefault("256M");
 
-  /* Add memory sizes from 32 MB to 8 GB
-   * (25 to 34 bits).
+  /* Add memory sizes from 32 MB to 32 GB
+   * (25 to 35 bits).
    */
-  for (int i = 25;i<34;i++)
+  for (int i = 25;i<=35;i++)
   {
     string a;
     int j = i;
@@ -437,10 +437,10 @@ int main(int argc, char* argv[])
   MultipleChoiceQuestion icache_q;
 
   icache_q.setQuestion("Do you want the ICACHE on the CPU's enabled?");
-  icache_q.setExplanation("The ICACHE makes the CPU emulation more accurate, but also slows down the emulator. Decent operating systems shouldn't depend on this.");
-  icache_q.setDefault("no");
-  icache_q.addAnswer("yes","true","ICACHE enabled. Performance hit, but may be necessary for some software.");
-  icache_q.addAnswer("no","false","ICACHE disabled. Better performance, but may not always work.");
+  icache_q.setExplanation("The ICACHE makes the CPU emulation more accurate, and is kept coherent with writes to memory, so it is safe for all software. It also allows instructions to be decoded only once.");
+  icache_q.setDefault("yes");
+  icache_q.addAnswer("yes","true","ICACHE enabled. Best performance.");
+  icache_q.addAnswer("no","false","ICACHE disabled. Instructions are fetched from memory every time.");
 
   icache_q.ask();
 